@@ -0,0 +1,329 @@
+/*
+ * apex_api.c
+ * Contains the embedding API of the APEX simulator (libapex)
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex_api.h"
+#include "apex_system.h"
+
+/*
+ * Creates a CPU running a copy of code. The CPU runs without single-step
+ * prompts; release it with APEX_cpu_stop.
+ */
+APEX_CPU *
+APEX_cpu_create(const APEX_Instruction *code, int size)
+{
+    APEX_Instruction *code_memory;
+    APEX_CPU *cpu;
+
+    if (!code || size <= 0)
+    {
+        return NULL;
+    }
+
+    code_memory = malloc(sizeof(APEX_Instruction) * size);
+    if (!code_memory)
+    {
+        return NULL;
+    }
+    memcpy(code_memory, code, sizeof(APEX_Instruction) * size);
+
+    cpu = APEX_cpu_init_from_code(code_memory, size);
+    if (cpu)
+    {
+        cpu->single_step = FALSE;
+    }
+    return cpu;
+}
+
+/*
+ * Executes up to insns instructions functionally and leaves the CPU in the
+ * state they produce. They run on the translator if use_jit is set and the
+ * host can run it, and on the block cache otherwise. Only a CPU that has
+ * not run a cycle and runs a single thread can be fast-forwarded; the
+ * instructions do not count as retired. Stops short of an instruction that
+ * faults, so that the pipeline reports it. Fills stats if it is not NULL.
+ * Returns APEX_RUN_OK, APEX_RUN_HALT when HALT was executed, or
+ * APEX_RUN_STOPPED on error.
+ */
+int
+APEX_cpu_fast_forward(APEX_CPU *cpu, int insns, int use_jit,
+                      APEX_Ffwd_Stats *stats)
+{
+    APEX_Jit *jit = NULL;
+    APEX_Bb_Cache *cache = NULL;
+    APEX_Ref ref;
+    int status;
+
+    if (cpu->clock != 0 || cpu->system || cpu->num_threads > 1 || insns <= 0)
+    {
+        return APEX_RUN_STOPPED;
+    }
+
+    if (use_jit)
+    {
+        jit = jit_create(cpu->code_memory, cpu->code_memory_size);
+        if (jit && !jit->code)
+        {
+            jit_destroy(jit);
+            jit = NULL;
+        }
+    }
+    if (!jit)
+    {
+        cache = bb_create(cpu->code_memory, cpu->code_memory_size);
+    }
+    if ((!jit && !cache)
+        || ref_init(&ref, cpu->code_memory, cpu->code_memory_size, NULL))
+    {
+        jit_destroy(jit);
+        bb_destroy(cache);
+        return APEX_RUN_STOPPED;
+    }
+
+    /* The reference runs on the CPU's memory itself, not on a copy */
+    memory_free(&ref.data_memory);
+    ref.data_memory = cpu->data_memory;
+    ref.pc = cpu->pc;
+    memcpy(ref.regs, cpu->regs, sizeof(ref.regs));
+    ref.zero_flag = cpu->zero_flag;
+    ref.pos_flag = cpu->pos_flag;
+    ref.neg_flag = cpu->neg_flag;
+
+    status = jit ? jit_run(jit, &ref, insns) : bb_run(cache, &ref, insns);
+
+    cpu->data_memory = ref.data_memory;
+    cpu->pc = ref.pc;
+    memcpy(cpu->regs, ref.regs, sizeof(cpu->regs));
+    cpu->zero_flag = ref.zero_flag;
+    cpu->pos_flag = ref.pos_flag;
+    cpu->neg_flag = ref.neg_flag;
+    if (status == REF_HALT)
+    {
+        cpu->halted = TRUE;
+    }
+
+    if (stats)
+    {
+        memset(stats, 0, sizeof(*stats));
+        stats->insns = ref.insn_completed;
+        stats->translated = (jit != NULL);
+        if (jit)
+        {
+            stats->jit = jit->stats;
+        }
+        else
+        {
+            stats->bb = cache->stats;
+        }
+    }
+    jit_destroy(jit);
+    bb_destroy(cache);
+    return status == REF_HALT ? APEX_RUN_HALT : APEX_RUN_OK;
+}
+
+static int
+run_status(const APEX_CPU *cpu)
+{
+    return cpu->halted ? APEX_RUN_HALT : APEX_RUN_STOPPED;
+}
+
+/*
+ * Runs until predicate holds (never when NULL), the simulation ends, or the
+ * clock reaches stop_clock (0 for no limit). The cycle callback test is
+ * hoisted out of the loop.
+ */
+static int
+run_loop(APEX_CPU *cpu, int stop_clock, APEX_Predicate predicate, void *arg)
+{
+    /* A stop requested by a callback only ends the call that saw it */
+    if (!cpu->cosim || !cpu->cosim->diverged)
+    {
+        cpu->stopped = FALSE;
+    }
+
+    if (cpu->cycle_callback)
+    {
+        while (!stop_clock || cpu->clock < stop_clock)
+        {
+            if (APEX_cpu_cycle(cpu, cpu->clock + 1))
+            {
+                return run_status(cpu);
+            }
+            if (cpu->cycle_callback(cpu, cpu->cycle_callback_arg))
+            {
+                cpu->stopped = TRUE;
+                return APEX_RUN_STOPPED;
+            }
+            if (predicate && predicate(cpu, arg))
+            {
+                return APEX_RUN_OK;
+            }
+        }
+    }
+    else
+    {
+        while (!stop_clock || cpu->clock < stop_clock)
+        {
+            if (APEX_cpu_cycle(cpu, stop_clock))
+            {
+                return run_status(cpu);
+            }
+            if (predicate && predicate(cpu, arg))
+            {
+                return APEX_RUN_OK;
+            }
+        }
+    }
+
+    return predicate ? APEX_RUN_LIMIT : APEX_RUN_OK;
+}
+
+static int
+stop_clock(const APEX_CPU *cpu, int max_cycles)
+{
+    return max_cycles > 0 ? cpu->clock + max_cycles : 0;
+}
+
+/* Simulates the given number of cycles */
+int
+APEX_cpu_step(APEX_CPU *cpu, int cycles)
+{
+    if (cycles <= 0)
+    {
+        return APEX_RUN_OK;
+    }
+    return run_loop(cpu, cpu->clock + cycles, NULL, NULL);
+}
+
+static int
+pc_retired(const APEX_CPU *cpu, void *arg)
+{
+    (void)arg;
+    return cpu->target_hit;
+}
+
+/*
+ * Runs until the instruction at pc retires. max_cycles bounds the run,
+ * 0 for no limit. Writeback marks the target as it retires each
+ * instruction, so the flag setter of a fused pair is found too.
+ */
+int
+APEX_cpu_run_until_pc(APEX_CPU *cpu, int pc, int max_cycles)
+{
+    int status;
+
+    cpu->target_pc = pc;
+    cpu->target_hit = FALSE;
+    status = run_loop(cpu, stop_clock(cpu, max_cycles), pc_retired, NULL);
+    cpu->target_pc = 0;
+    return status;
+}
+
+static int
+insns_retired(const APEX_CPU *cpu, void *arg)
+{
+    return cpu->insn_completed >= *(const int *)arg;
+}
+
+/* Runs until insns instructions have retired in total */
+int
+APEX_cpu_run_until_insns(APEX_CPU *cpu, int insns, int max_cycles)
+{
+    if (cpu->insn_completed >= insns)
+    {
+        return APEX_RUN_OK;
+    }
+    return run_loop(cpu, stop_clock(cpu, max_cycles), insns_retired, &insns);
+}
+
+/* Runs until predicate holds after a cycle, or to HALT when it is NULL */
+int
+APEX_cpu_run_until(APEX_CPU *cpu, APEX_Predicate predicate, void *arg,
+                   int max_cycles)
+{
+    int status = run_loop(cpu, stop_clock(cpu, max_cycles), predicate, arg);
+
+    if (!predicate && status == APEX_RUN_OK && max_cycles > 0)
+    {
+        return APEX_RUN_LIMIT;
+    }
+    return status;
+}
+
+/*
+ * Register and memory accessors return 0, or -1 for a register index out of
+ * range or an address at or above the data memory limit. Cores of a
+ * multi-core system access the shared memory.
+ * Writes take effect immediately; instructions in flight that already read
+ * their operands are not affected, and the co-simulation reference is not
+ * updated.
+ */
+int
+APEX_cpu_read_reg(const APEX_CPU *cpu, int reg, int *value)
+{
+    if (reg < 0 || reg >= REG_FILE_SIZE)
+    {
+        return -1;
+    }
+    *value = cpu->regs[reg];
+    return 0;
+}
+
+int
+APEX_cpu_write_reg(APEX_CPU *cpu, int reg, int value)
+{
+    if (reg < 0 || reg >= REG_FILE_SIZE)
+    {
+        return -1;
+    }
+    cpu->regs[reg] = value;
+    return 0;
+}
+
+int
+APEX_cpu_read_mem(const APEX_CPU *cpu, int address, int *value)
+{
+    const APEX_Memory *mem
+        = cpu->system ? &cpu->system->memory : &cpu->data_memory;
+
+    if (!memory_valid(mem, address))
+    {
+        return -1;
+    }
+    *value = memory_peek(mem, address);
+    return 0;
+}
+
+int
+APEX_cpu_write_mem(APEX_CPU *cpu, int address, int value)
+{
+    APEX_Memory *mem = cpu->system ? &cpu->system->memory : &cpu->data_memory;
+
+    if (!memory_valid(mem, address))
+    {
+        return -1;
+    }
+    memory_write(mem, address, value);
+    return 0;
+}
+
+/* Registers the callback called after every retirement, NULL to remove it */
+void
+APEX_cpu_set_retire_callback(APEX_CPU *cpu, APEX_Retire_Callback callback,
+                             void *arg)
+{
+    cpu->retire_callback = callback;
+    cpu->retire_callback_arg = arg;
+}
+
+/* Registers the callback called after every cycle, NULL to remove it */
+void
+APEX_cpu_set_cycle_callback(APEX_CPU *cpu, APEX_Cycle_Callback callback,
+                            void *arg)
+{
+    cpu->cycle_callback = callback;
+    cpu->cycle_callback_arg = arg;
+}
@@ -0,0 +1,66 @@
+/*
+ * apex_api.h
+ * Contains the embedding API of the APEX simulator (libapex)
+ *
+ * A harness creates CPUs from in-memory programs and drives them cycle by
+ * cycle, without going through files or the command line driver:
+ *
+ *     APEX_CPU *cpu = APEX_cpu_create(code, size);
+ *     APEX_cpu_run_until_pc(cpu, 4012, 1000);
+ *     APEX_cpu_read_reg(cpu, 1, &value);
+ *     APEX_cpu_stop(cpu);
+ *
+ * Callbacks cost one pointer test per retirement (retire callback) or per
+ * call into the run functions (cycle callback) when none is registered.
+ * While a cycle callback is registered, --skip-idle style jumps are off so
+ * that it sees every cycle.
+ *
+ * APEX_cpu_fast_forward executes instructions functionally, with no
+ * timing, before a CPU starts simulating cycles; see apex_jit.h and
+ * apex_bbcache.h.
+ */
+#ifndef _APEX_API_H_
+#define _APEX_API_H_
+
+#include "apex_bbcache.h"
+#include "apex_cpu.h"
+#include "apex_jit.h"
+
+/* Return values of the run functions */
+#define APEX_RUN_OK 0        /* The requested cycles or condition were reached */
+#define APEX_RUN_HALT 1      /* HALT retired */
+#define APEX_RUN_STOPPED 2   /* A callback or the co-simulation checker stopped */
+#define APEX_RUN_LIMIT 3     /* max_cycles elapsed before the condition held */
+
+/* What APEX_cpu_fast_forward ran */
+typedef struct APEX_Ffwd_Stats
+{
+    uint64_t insns;          /* Instructions executed */
+    int translated;          /* TRUE on the translator, FALSE on the block cache */
+    APEX_Jit_Stats jit;
+    APEX_Bb_Stats bb;
+} APEX_Ffwd_Stats;
+
+/* Condition for APEX_cpu_run_until, checked after every cycle */
+typedef int (*APEX_Predicate)(const APEX_CPU *cpu, void *arg);
+
+APEX_CPU *APEX_cpu_create(const APEX_Instruction *code, int size);
+
+int APEX_cpu_fast_forward(APEX_CPU *cpu, int insns, int use_jit,
+                          APEX_Ffwd_Stats *stats);
+int APEX_cpu_step(APEX_CPU *cpu, int cycles);
+int APEX_cpu_run_until_pc(APEX_CPU *cpu, int pc, int max_cycles);
+int APEX_cpu_run_until_insns(APEX_CPU *cpu, int insns, int max_cycles);
+int APEX_cpu_run_until(APEX_CPU *cpu, APEX_Predicate predicate, void *arg,
+                       int max_cycles);
+
+int APEX_cpu_read_reg(const APEX_CPU *cpu, int reg, int *value);
+int APEX_cpu_write_reg(APEX_CPU *cpu, int reg, int value);
+int APEX_cpu_read_mem(const APEX_CPU *cpu, int address, int *value);
+int APEX_cpu_write_mem(APEX_CPU *cpu, int address, int value);
+
+void APEX_cpu_set_retire_callback(APEX_CPU *cpu, APEX_Retire_Callback callback,
+                                  void *arg);
+void APEX_cpu_set_cycle_callback(APEX_CPU *cpu, APEX_Cycle_Callback callback,
+                                 void *arg);
+#endif
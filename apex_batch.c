@@ -0,0 +1,738 @@
+/*
+ * apex_batch.c
+ * Contains the batched functional engine
+ *
+ * ALU operations, CMP, CML and conditional branches are applied to a vector
+ * of lanes at a time under a lane mask. The remaining opcodes (DIV, memory
+ * accesses, JUMP, JALR, HALT, and MUL without SSE4.1) run one lane at a time.
+ * Lanes outside the mask keep their state through blends, so the same
+ * kernels serve converged and divergent steps.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+#endif
+
+#include "apex_batch.h"
+#include "apex_cpu.h"
+
+/* Integer vector of BATCH_VECTOR_WIDTH lanes; masks are 0 or -1 per lane */
+#if defined(__AVX2__)
+typedef __m256i VInt;
+#define V_LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define V_STORE(p, v) _mm256_storeu_si256((__m256i *)(p), v)
+#define V_SET1(x) _mm256_set1_epi32(x)
+#define V_ZERO _mm256_setzero_si256()
+#define V_ADD(a, b) _mm256_add_epi32(a, b)
+#define V_SUB(a, b) _mm256_sub_epi32(a, b)
+#define V_MUL(a, b) _mm256_mullo_epi32(a, b)
+#define V_AND(a, b) _mm256_and_si256(a, b)
+#define V_OR(a, b) _mm256_or_si256(a, b)
+#define V_XOR(a, b) _mm256_xor_si256(a, b)
+#define V_ANDNOT(m, v) _mm256_andnot_si256(m, v)
+#define V_CMPEQ(a, b) _mm256_cmpeq_epi32(a, b)
+#define V_CMPGT(a, b) _mm256_cmpgt_epi32(a, b)
+#define V_BLEND(old, new, m) _mm256_blendv_epi8(old, new, m)
+#define V_ANY(v) (!_mm256_testz_si256(v, v))
+#define V_HAS_MUL 1
+#elif defined(__SSE2__)
+typedef __m128i VInt;
+#define V_LOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define V_STORE(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#define V_SET1(x) _mm_set1_epi32(x)
+#define V_ZERO _mm_setzero_si128()
+#define V_ADD(a, b) _mm_add_epi32(a, b)
+#define V_SUB(a, b) _mm_sub_epi32(a, b)
+#define V_AND(a, b) _mm_and_si128(a, b)
+#define V_OR(a, b) _mm_or_si128(a, b)
+#define V_XOR(a, b) _mm_xor_si128(a, b)
+#define V_ANDNOT(m, v) _mm_andnot_si128(m, v)
+#define V_CMPEQ(a, b) _mm_cmpeq_epi32(a, b)
+#define V_CMPGT(a, b) _mm_cmpgt_epi32(a, b)
+#define V_BLEND(old, new, m) V_OR(V_AND(m, new), V_ANDNOT(m, old))
+#define V_ANY(v) (_mm_movemask_epi8(v) != 0)
+#if defined(__SSE4_1__)
+#define V_MUL(a, b) _mm_mullo_epi32(a, b)
+#define V_HAS_MUL 1
+#else
+#define V_HAS_MUL 0
+#endif
+#else
+typedef int VInt;
+#define V_LOAD(p) (*(p))
+#define V_STORE(p, v) (*(p) = (v))
+#define V_SET1(x) (x)
+#define V_ZERO 0
+#define V_ADD(a, b) ref_add(a, b)
+#define V_SUB(a, b) ref_sub(a, b)
+#define V_MUL(a, b) ref_mul(a, b)
+#define V_AND(a, b) ((a) & (b))
+#define V_OR(a, b) ((a) | (b))
+#define V_XOR(a, b) ((a) ^ (b))
+#define V_ANDNOT(m, v) (~(m) & (v))
+#define V_CMPEQ(a, b) (-((a) == (b)))
+#define V_CMPGT(a, b) (-((a) > (b)))
+#define V_BLEND(old, new, m) (((m) & (new)) | (~(m) & (old)))
+#define V_ANY(v) ((v) != 0)
+#define V_HAS_MUL 1
+#endif
+
+static int *
+batch_reg(const APEX_Batch *batch, int reg)
+{
+    return batch->regs + reg * batch->stride;
+}
+
+static int
+batch_valid_pc(const APEX_Batch *batch, int pc)
+{
+    return pc >= 4000 && (pc - 4000) % 4 == 0
+           && (pc - 4000) / 4 < batch->code_memory_size;
+}
+
+APEX_Batch *
+batch_create(const APEX_Instruction *code_memory, int code_memory_size,
+             int num_lanes)
+{
+    APEX_Batch *batch;
+    int stride, lane;
+
+    if (!code_memory || num_lanes <= 0)
+    {
+        return NULL;
+    }
+
+    batch = calloc(1, sizeof(APEX_Batch));
+    if (!batch)
+    {
+        return NULL;
+    }
+
+    stride = (num_lanes + BATCH_VECTOR_WIDTH - 1) / BATCH_VECTOR_WIDTH
+             * BATCH_VECTOR_WIDTH;
+    batch->num_lanes = num_lanes;
+    batch->stride = stride;
+    batch->code_memory = code_memory;
+    batch->code_memory_size = code_memory_size;
+    batch->regs = calloc(REG_FILE_SIZE * stride, sizeof(int));
+    batch->zero_flag = calloc(stride, sizeof(int));
+    batch->pos_flag = calloc(stride, sizeof(int));
+    batch->neg_flag = calloc(stride, sizeof(int));
+    batch->pc = calloc(stride, sizeof(int));
+    batch->status = calloc(stride, sizeof(int));
+    batch->insn_completed = calloc(stride, sizeof(int));
+    batch->run_mask = calloc(stride, sizeof(int));
+    batch->mask = calloc(stride, sizeof(int));
+    batch->data_memory = calloc((size_t)DATA_MEMORY_SIZE * stride, sizeof(int));
+
+    if (!batch->regs || !batch->zero_flag || !batch->pos_flag
+        || !batch->neg_flag || !batch->pc || !batch->status
+        || !batch->insn_completed || !batch->run_mask || !batch->mask
+        || !batch->data_memory)
+    {
+        batch_destroy(batch);
+        return NULL;
+    }
+
+    /* Padding lanes up to the stride never run */
+    for (lane = 0; lane < num_lanes; ++lane)
+    {
+        batch->pc[lane] = 4000;
+        batch->run_mask[lane] = -1;
+    }
+    batch->num_running = num_lanes;
+    batch->converged = TRUE;
+    batch->common_pc = 4000;
+    return batch;
+}
+
+/* Copies the first words of a data memory image into one lane */
+void
+batch_load_memory(APEX_Batch *batch, int lane, const int *image, int words)
+{
+    int address;
+
+    for (address = 0; address < words && address < DATA_MEMORY_SIZE; ++address)
+    {
+        batch->data_memory[address * batch->stride + lane] = image[address];
+    }
+}
+
+void
+batch_set_reg(APEX_Batch *batch, int lane, int reg, int value)
+{
+    batch_reg(batch, reg)[lane] = value;
+}
+
+int
+batch_get_reg(const APEX_Batch *batch, int lane, int reg)
+{
+    return batch_reg(batch, reg)[lane];
+}
+
+int
+batch_get_mem(const APEX_Batch *batch, int lane, int address)
+{
+    return batch->data_memory[address * batch->stride + lane];
+}
+
+/* Exact between calls to batch_run */
+int
+batch_get_insns(const APEX_Batch *batch, int lane)
+{
+    return batch->insn_completed[lane];
+}
+
+/* Adds the steps issued while converged to every running lane */
+static void
+batch_flush_insns(APEX_Batch *batch)
+{
+    int lane;
+
+    if (!batch->converged_insns)
+    {
+        return;
+    }
+    for (lane = 0; lane < batch->num_lanes; ++lane)
+    {
+        if (batch->run_mask[lane])
+        {
+            batch->insn_completed[lane] += batch->converged_insns;
+        }
+    }
+    batch->converged_insns = 0;
+}
+
+/* Gives every running lane its own PC before lanes may split */
+static void
+batch_diverge(APEX_Batch *batch)
+{
+    int lane;
+
+    batch_flush_insns(batch);
+    for (lane = 0; lane < batch->num_lanes; ++lane)
+    {
+        if (batch->run_mask[lane])
+        {
+            batch->pc[lane] = batch->common_pc;
+        }
+    }
+    batch->converged = FALSE;
+}
+
+/* Returns to converged mode if all running lanes are at the same PC */
+static void
+batch_try_converge(APEX_Batch *batch)
+{
+    int lane, pc = 0, found = FALSE;
+
+    for (lane = 0; lane < batch->num_lanes; ++lane)
+    {
+        if (!batch->run_mask[lane])
+        {
+            continue;
+        }
+        if (found && batch->pc[lane] != pc)
+        {
+            return;
+        }
+        pc = batch->pc[lane];
+        found = TRUE;
+    }
+
+    batch->converged = TRUE;
+    batch->common_pc = pc;
+}
+
+static void
+batch_stop_lane(APEX_Batch *batch, int lane, int status)
+{
+    batch->status[lane] = status;
+    batch->run_mask[lane] = 0;
+    batch->num_running--;
+}
+
+/* Sets the flags of the lanes in m by comparing x with y */
+static inline void
+batch_set_flags(APEX_Batch *batch, int i, VInt x, VInt y, VInt m)
+{
+    V_STORE(batch->zero_flag + i,
+            V_BLEND(V_LOAD(batch->zero_flag + i), V_CMPEQ(x, y), m));
+    V_STORE(batch->pos_flag + i,
+            V_BLEND(V_LOAD(batch->pos_flag + i), V_CMPGT(x, y), m));
+    V_STORE(batch->neg_flag + i,
+            V_BLEND(V_LOAD(batch->neg_flag + i), V_CMPGT(y, x), m));
+}
+
+/*
+ * Applies an ALU operation, CMP or CML to the lanes in mask. Returns FALSE
+ * for opcodes without a vector kernel.
+ */
+static int
+batch_vector_alu(APEX_Batch *batch, const APEX_Instruction *ins,
+                 const int *mask)
+{
+    int *rd = batch_reg(batch, ins->rd);
+    const int *a = batch_reg(batch, ins->rs1);
+    const int *b = batch_reg(batch, ins->rs2);
+    VInt imm = V_SET1(ins->imm);
+    VInt zero = V_ZERO;
+    int i;
+
+#define BATCH_ALU_LOOP(expr)                                                  \
+    for (i = 0; i < batch->stride; i += BATCH_VECTOR_WIDTH)                   \
+    {                                                                         \
+        VInt m = V_LOAD(mask + i);                                            \
+        VInt x = V_LOAD(a + i);                                               \
+        VInt y = V_LOAD(b + i);                                               \
+        VInt r = (expr);                                                      \
+        (void)x;                                                              \
+        (void)y;                                                              \
+        V_STORE(rd + i, V_BLEND(V_LOAD(rd + i), r, m));                       \
+        batch_set_flags(batch, i, r, zero, m);                                \
+    }
+
+#define BATCH_CMP_LOOP(rhs)                                                   \
+    for (i = 0; i < batch->stride; i += BATCH_VECTOR_WIDTH)                   \
+    {                                                                         \
+        VInt m = V_LOAD(mask + i);                                            \
+        VInt x = V_LOAD(a + i);                                               \
+        VInt y = V_LOAD(b + i);                                               \
+        (void)y;                                                              \
+        batch_set_flags(batch, i, x, (rhs), m);                               \
+    }
+
+    switch (ins->opcode)
+    {
+        case OPCODE_ADD: BATCH_ALU_LOOP(V_ADD(x, y)); break;
+        case OPCODE_SUB: BATCH_ALU_LOOP(V_SUB(x, y)); break;
+        case OPCODE_AND: BATCH_ALU_LOOP(V_AND(x, y)); break;
+        case OPCODE_OR: BATCH_ALU_LOOP(V_OR(x, y)); break;
+        case OPCODE_XOR: BATCH_ALU_LOOP(V_XOR(x, y)); break;
+        case OPCODE_ADDL: BATCH_ALU_LOOP(V_ADD(x, imm)); break;
+        case OPCODE_SUBL: BATCH_ALU_LOOP(V_SUB(x, imm)); break;
+        case OPCODE_MOVC: BATCH_ALU_LOOP(imm); break;
+#if V_HAS_MUL
+        case OPCODE_MUL: BATCH_ALU_LOOP(V_MUL(x, y)); break;
+#endif
+        case OPCODE_CMP: BATCH_CMP_LOOP(y); break;
+        case OPCODE_CML: BATCH_CMP_LOOP(imm); break;
+        default: return FALSE;
+    }
+
+#undef BATCH_ALU_LOOP
+#undef BATCH_CMP_LOOP
+    return TRUE;
+}
+
+/* Moves the lanes in mask on to next_pc after a divergent vector step */
+static void
+batch_advance_masked(APEX_Batch *batch, const int *mask, int next_pc)
+{
+    VInt next = V_SET1(next_pc);
+    int i;
+
+    for (i = 0; i < batch->stride; i += BATCH_VECTOR_WIDTH)
+    {
+        VInt m = V_LOAD(mask + i);
+
+        V_STORE(batch->pc + i, V_BLEND(V_LOAD(batch->pc + i), next, m));
+        V_STORE(batch->insn_completed + i,
+                V_SUB(V_LOAD(batch->insn_completed + i), m));
+    }
+}
+
+/* Conditional branch over the lanes in mask */
+static void
+batch_branch(APEX_Batch *batch, const APEX_Instruction *ins, int pc,
+             const int *mask)
+{
+    const int *flag;
+    VInt invert, taken_pc, fall_pc;
+    VInt any_taken = V_ZERO, any_fall = V_ZERO;
+    int i;
+
+    switch (ins->opcode)
+    {
+        case OPCODE_BZ:
+        case OPCODE_BNZ: flag = batch->zero_flag; break;
+        case OPCODE_BP:
+        case OPCODE_BNP: flag = batch->pos_flag; break;
+        default: flag = batch->neg_flag; break;
+    }
+    invert = V_SET1((ins->opcode == OPCODE_BNZ || ins->opcode == OPCODE_BNP
+                     || ins->opcode == OPCODE_BNN) ? -1 : 0);
+    taken_pc = V_SET1(pc + ins->imm);
+    fall_pc = V_SET1(pc + 4);
+
+    if (batch->converged)
+    {
+        for (i = 0; i < batch->stride; i += BATCH_VECTOR_WIDTH)
+        {
+            VInt m = V_LOAD(mask + i);
+            VInt t = V_AND(V_XOR(V_LOAD(flag + i), invert), m);
+
+            any_taken = V_OR(any_taken, t);
+            any_fall = V_OR(any_fall, V_ANDNOT(t, m));
+        }
+
+        batch->converged_insns++;
+        batch->vector_steps++;
+
+        if (!V_ANY(any_fall))
+        {
+            batch->common_pc = pc + ins->imm;
+            return;
+        }
+        if (!V_ANY(any_taken))
+        {
+            batch->common_pc = pc + 4;
+            return;
+        }
+
+        /* Lanes split: from now on every lane keeps its own PC */
+        batch_flush_insns(batch);
+        batch->converged = FALSE;
+        for (i = 0; i < batch->stride; i += BATCH_VECTOR_WIDTH)
+        {
+            VInt m = V_LOAD(mask + i);
+            VInt t = V_AND(V_XOR(V_LOAD(flag + i), invert), m);
+
+            V_STORE(batch->pc + i, V_BLEND(V_LOAD(batch->pc + i),
+                                           V_BLEND(fall_pc, taken_pc, t), m));
+        }
+        return;
+    }
+
+    for (i = 0; i < batch->stride; i += BATCH_VECTOR_WIDTH)
+    {
+        VInt m = V_LOAD(mask + i);
+        VInt t = V_AND(V_XOR(V_LOAD(flag + i), invert), m);
+
+        V_STORE(batch->pc + i, V_BLEND(V_LOAD(batch->pc + i),
+                                       V_BLEND(fall_pc, taken_pc, t), m));
+        V_STORE(batch->insn_completed + i,
+                V_SUB(V_LOAD(batch->insn_completed + i), m));
+    }
+    batch->divergent_steps++;
+}
+
+static void
+batch_set_lane_flags(APEX_Batch *batch, int lane, int a, int b)
+{
+    batch->zero_flag[lane] = -(a == b);
+    batch->pos_flag[lane] = -(a > b);
+    batch->neg_flag[lane] = -(a < b);
+}
+
+/* Runs the instruction at pc on one lane, as ref_step does */
+static void
+batch_step_lane(APEX_Batch *batch, const APEX_Instruction *ins, int lane,
+                int pc)
+{
+    int *regs = batch->regs + lane;
+    int *memory = batch->data_memory + lane;
+    int stride = batch->stride;
+    int rs1 = regs[ins->rs1 * stride];
+    int rs2 = regs[ins->rs2 * stride];
+    int next_pc = pc + 4;
+    int taken = FALSE;
+    int result, address;
+
+    batch->pc[lane] = pc;
+
+    switch (ins->opcode)
+    {
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_AND:
+        case OPCODE_OR:
+        case OPCODE_XOR:
+        case OPCODE_ADDL:
+        case OPCODE_SUBL:
+        case OPCODE_MOVC:
+        {
+            switch (ins->opcode)
+            {
+                case OPCODE_ADD: result = ref_add(rs1, rs2); break;
+                case OPCODE_SUB: result = ref_sub(rs1, rs2); break;
+                case OPCODE_MUL: result = ref_mul(rs1, rs2); break;
+                case OPCODE_DIV: result = ref_div(rs1, rs2); break;
+                case OPCODE_AND: result = rs1 & rs2; break;
+                case OPCODE_OR: result = rs1 | rs2; break;
+                case OPCODE_XOR: result = rs1 ^ rs2; break;
+                case OPCODE_ADDL: result = ref_add(rs1, ins->imm); break;
+                case OPCODE_SUBL: result = ref_sub(rs1, ins->imm); break;
+                default: result = ins->imm; break;
+            }
+            batch_set_lane_flags(batch, lane, result, 0);
+            regs[ins->rd * stride] = result;
+            break;
+        }
+
+        case OPCODE_CMP:
+        {
+            batch_set_lane_flags(batch, lane, rs1, rs2);
+            break;
+        }
+
+        case OPCODE_CML:
+        {
+            batch_set_lane_flags(batch, lane, rs1, ins->imm);
+            break;
+        }
+
+        case OPCODE_LOAD:
+        case OPCODE_LOADP:
+        {
+            address = ref_add(rs1, ins->imm);
+            if (address < 0 || address >= DATA_MEMORY_SIZE)
+            {
+                batch_stop_lane(batch, lane, REF_BAD_ADDRESS);
+                return;
+            }
+            if (ins->opcode == OPCODE_LOADP)
+            {
+                regs[ins->rs1 * stride] = ref_add(rs1, 4);
+            }
+            regs[ins->rd * stride] = memory[address * stride];
+            break;
+        }
+
+        case OPCODE_STORE:
+        case OPCODE_STOREP:
+        {
+            address = ref_add(rs2, ins->imm);
+            if (address < 0 || address >= DATA_MEMORY_SIZE)
+            {
+                batch_stop_lane(batch, lane, REF_BAD_ADDRESS);
+                return;
+            }
+            memory[address * stride] = rs1;
+            if (ins->opcode == OPCODE_STOREP)
+            {
+                regs[ins->rs2 * stride] = ref_add(rs2, 4);
+            }
+            break;
+        }
+
+        case OPCODE_BZ: taken = batch->zero_flag[lane]; break;
+        case OPCODE_BNZ: taken = !batch->zero_flag[lane]; break;
+        case OPCODE_BP: taken = batch->pos_flag[lane]; break;
+        case OPCODE_BNP: taken = !batch->pos_flag[lane]; break;
+        case OPCODE_BN: taken = batch->neg_flag[lane]; break;
+        case OPCODE_BNN: taken = !batch->neg_flag[lane]; break;
+
+        case OPCODE_JUMP:
+        {
+            next_pc = ref_add(rs1, ins->imm);
+            break;
+        }
+
+        case OPCODE_JALR:
+        {
+            regs[ins->rd * stride] = pc + 4;
+            next_pc = ref_add(rs1, ins->imm);
+            break;
+        }
+
+        case OPCODE_HALT:
+        {
+            batch->insn_completed[lane]++;
+            batch_stop_lane(batch, lane, REF_HALT);
+            return;
+        }
+    }
+
+    if (taken)
+    {
+        next_pc = pc + ins->imm;
+    }
+
+    batch->pc[lane] = next_pc;
+    batch->insn_completed[lane]++;
+}
+
+/*
+ * Issues one instruction: to all running lanes while converged, otherwise
+ * to the lanes at the lowest PC, which lets lanes that took different paths
+ * meet again at the join point.
+ */
+static void
+batch_step(APEX_Batch *batch)
+{
+    const APEX_Instruction *ins;
+    const int *mask;
+    int lane, pc, count, found;
+
+    if (batch->converged)
+    {
+        pc = batch->common_pc;
+        mask = batch->run_mask;
+    }
+    else
+    {
+        pc = 0;
+        found = FALSE;
+        for (lane = 0; lane < batch->num_lanes; ++lane)
+        {
+            if (batch->run_mask[lane] && (!found || batch->pc[lane] < pc))
+            {
+                pc = batch->pc[lane];
+                found = TRUE;
+            }
+        }
+
+        count = 0;
+        for (lane = 0; lane < batch->num_lanes; ++lane)
+        {
+            batch->mask[lane] = -(batch->run_mask[lane]
+                                  && batch->pc[lane] == pc);
+            count += batch->mask[lane] & 1;
+        }
+
+        if (count == batch->num_running)
+        {
+            batch->converged = TRUE;
+            batch->common_pc = pc;
+            mask = batch->run_mask;
+        }
+        else
+        {
+            mask = batch->mask;
+        }
+    }
+
+    if (!batch_valid_pc(batch, pc))
+    {
+        if (batch->converged)
+        {
+            batch_diverge(batch);
+            mask = batch->run_mask;
+        }
+        for (lane = 0; lane < batch->num_lanes; ++lane)
+        {
+            if (mask[lane])
+            {
+                batch_stop_lane(batch, lane, REF_BAD_PC);
+            }
+        }
+        return;
+    }
+
+    ins = &batch->code_memory[(pc - 4000) / 4];
+
+    switch (ins->opcode)
+    {
+        case OPCODE_BZ:
+        case OPCODE_BNZ:
+        case OPCODE_BP:
+        case OPCODE_BNP:
+        case OPCODE_BN:
+        case OPCODE_BNN:
+        {
+            batch_branch(batch, ins, pc, mask);
+            return;
+        }
+    }
+
+    if (batch_vector_alu(batch, ins, mask))
+    {
+        if (batch->converged)
+        {
+            batch->common_pc = pc + 4;
+            batch->converged_insns++;
+            batch->vector_steps++;
+        }
+        else
+        {
+            batch_advance_masked(batch, mask, pc + 4);
+            batch->divergent_steps++;
+        }
+        return;
+    }
+
+    /* No vector kernel: run the lanes one at a time */
+    if (batch->converged)
+    {
+        batch_diverge(batch);
+        mask = batch->run_mask;
+    }
+    else
+    {
+        batch->divergent_steps++;
+    }
+
+    for (lane = 0; lane < batch->num_lanes; ++lane)
+    {
+        if (mask[lane])
+        {
+            batch_step_lane(batch, ins, lane, pc);
+            batch->scalar_lane_insns++;
+        }
+    }
+
+    if (batch->num_running)
+    {
+        batch_try_converge(batch);
+    }
+}
+
+/*
+ * Runs until every lane halted or failed, or for at most max_steps issued
+ * instructions (0 for no limit). Returns the number of lanes still running.
+ */
+int
+batch_run(APEX_Batch *batch, uint64_t max_steps)
+{
+    uint64_t steps;
+    int lane;
+
+    for (steps = 0; batch->num_running && (!max_steps || steps < max_steps);
+         ++steps)
+    {
+        batch_step(batch);
+    }
+
+    batch_flush_insns(batch);
+    if (batch->converged)
+    {
+        for (lane = 0; lane < batch->num_lanes; ++lane)
+        {
+            if (batch->run_mask[lane])
+            {
+                batch->pc[lane] = batch->common_pc;
+            }
+        }
+    }
+    return batch->num_running;
+}
+
+void
+batch_destroy(APEX_Batch *batch)
+{
+    if (!batch)
+    {
+        return;
+    }
+    free(batch->regs);
+    free(batch->zero_flag);
+    free(batch->pos_flag);
+    free(batch->neg_flag);
+    free(batch->pc);
+    free(batch->status);
+    free(batch->insn_completed);
+    free(batch->run_mask);
+    free(batch->mask);
+    free(batch->data_memory);
+    free(batch);
+}
@@ -0,0 +1,70 @@
+/*
+ * apex_batch.h
+ * Contains declarations of the batched functional engine
+ *
+ * The batch runs one program on K independent lanes, each with its own
+ * registers, flags and data memory, with the semantics of apex_ref.c. State
+ * is kept in structure-of-arrays layout so that one instruction is applied
+ * to a whole vector of lanes at once. While all running lanes share a PC
+ * they are issued together; when a branch or JUMP splits them, the lanes
+ * with the lowest PC are issued under a lane mask until they meet again.
+ *
+ * Each lane has a flat DATA_MEMORY_SIZE-word memory rather than the paged
+ * one of the pipeline; an access outside it stops the lane with
+ * REF_BAD_ADDRESS, as the reference does with that limit.
+ */
+#ifndef _APEX_BATCH_H_
+#define _APEX_BATCH_H_
+
+#include <stdint.h>
+
+#include "apex_macros.h"
+#include "apex_ref.h"
+
+struct APEX_Instruction;
+
+/* Lanes per vector of the kernels compiled in (AVX2, SSE2 or scalar) */
+#if defined(__AVX2__)
+#define BATCH_VECTOR_WIDTH 8
+#elif defined(__SSE2__)
+#define BATCH_VECTOR_WIDTH 4
+#else
+#define BATCH_VECTOR_WIDTH 1
+#endif
+
+typedef struct APEX_Batch
+{
+    int num_lanes;         /* K */
+    int stride;            /* K rounded up to BATCH_VECTOR_WIDTH */
+    int *regs;             /* regs[reg * stride + lane] */
+    int *zero_flag;        /* Flags are 0 or -1 so they can be used as masks */
+    int *pos_flag;
+    int *neg_flag;
+    int *pc;               /* Per-lane PC, stale while converged */
+    int *status;           /* REF_OK while running, then REF_HALT or an error */
+    int *insn_completed;   /* Per-lane retired instructions */
+    int *run_mask;         /* -1 for running lanes */
+    int *mask;             /* Lanes issued by the current step */
+    int *data_memory;      /* data_memory[address * stride + lane] */
+    int num_running;
+    int converged;         /* All running lanes are at common_pc */
+    int common_pc;
+    int converged_insns;   /* Steps not yet added to insn_completed */
+    const struct APEX_Instruction *code_memory;
+    int code_memory_size;
+    uint64_t vector_steps;       /* Steps issued to all running lanes */
+    uint64_t divergent_steps;    /* Steps issued to a subset of the lanes */
+    uint64_t scalar_lane_insns;  /* Lane instructions run one lane at a time */
+} APEX_Batch;
+
+APEX_Batch *batch_create(const struct APEX_Instruction *code_memory,
+                         int code_memory_size, int num_lanes);
+void batch_load_memory(APEX_Batch *batch, int lane, const int *image,
+                       int words);
+void batch_set_reg(APEX_Batch *batch, int lane, int reg, int value);
+int batch_get_reg(const APEX_Batch *batch, int lane, int reg);
+int batch_get_mem(const APEX_Batch *batch, int lane, int address);
+int batch_get_insns(const APEX_Batch *batch, int lane);
+int batch_run(APEX_Batch *batch, uint64_t max_steps);
+void batch_destroy(APEX_Batch *batch);
+#endif
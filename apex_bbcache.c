@@ -0,0 +1,433 @@
+/*
+ * apex_bbcache.c
+ * Contains the basic-block cache of the functional engine
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex_bbcache.h"
+#include "apex_cpu.h"
+
+static int
+valid_reg(int reg)
+{
+    return reg >= 0 && reg < REG_FILE_SIZE;
+}
+
+/*
+ * Returns TRUE if ins can be decoded into a micro-op. Instructions naming a
+ * register out of range, or with an opcode that does not fit, are left to
+ * ref_step.
+ */
+static int
+decodable(const APEX_Instruction *ins)
+{
+    return ins->opcode >= 0 && ins->opcode <= UINT8_MAX
+           && valid_reg(ins->rd) && valid_reg(ins->rs1)
+           && valid_reg(ins->rs2);
+}
+
+static int
+ends_block(int opcode)
+{
+    switch (opcode)
+    {
+        case OPCODE_BZ:
+        case OPCODE_BNZ:
+        case OPCODE_BP:
+        case OPCODE_BNP:
+        case OPCODE_BN:
+        case OPCODE_BNN:
+        case OPCODE_JUMP:
+        case OPCODE_JALR:
+        case OPCODE_HALT:
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * Decodes the block starting at instruction index. Returns it, or NULL if
+ * the first instruction cannot be decoded or out of memory.
+ */
+static Bb_Block *
+bb_decode(APEX_Bb_Cache *cache, int index)
+{
+    const APEX_Instruction *ins = &cache->code_memory[index];
+    Bb_Block *block;
+    int n, k;
+
+    for (n = 0; n < BB_BLOCK_INSNS && index + n < cache->code_memory_size
+                && decodable(&ins[n]);
+         ++n)
+    {
+        if (ends_block(ins[n].opcode))
+        {
+            ++n;
+            break;
+        }
+    }
+    if (n == 0)
+    {
+        return NULL;
+    }
+
+    block = arena_alloc(&cache->arena, sizeof(Bb_Block) + sizeof(Bb_Op) * n);
+    if (!block)
+    {
+        return NULL;
+    }
+    block->pc = 4000 + 4 * index;
+    block->num_ops = n;
+    block->next = NULL;
+    block->taken = NULL;
+    for (k = 0; k < n; ++k)
+    {
+        block->op[k].opcode = (uint8_t)ins[k].opcode;
+        block->op[k].rd = (uint8_t)ins[k].rd;
+        block->op[k].rs1 = (uint8_t)ins[k].rs1;
+        block->op[k].rs2 = (uint8_t)ins[k].rs2;
+        block->op[k].imm = ins[k].imm;
+    }
+
+    cache->block[index] = block;
+    cache->stats.blocks++;
+    cache->stats.block_insns += n;
+    return block;
+}
+
+/* Returns the block at pc, decoding it if needed, or NULL */
+static Bb_Block *
+bb_lookup(APEX_Bb_Cache *cache, int pc)
+{
+    int index = (pc - 4000) / 4;
+
+    if (pc < 4000 || (pc - 4000) % 4 != 0 || index >= cache->code_memory_size)
+    {
+        return NULL;
+    }
+    cache->stats.lookups++;
+    if (cache->block[index])
+    {
+        return cache->block[index];
+    }
+    return bb_decode(cache, index);
+}
+
+/*
+ * Discards all blocks and makes the cache serve code_memory. Returns 0, or
+ * -1 when out of memory.
+ */
+int
+bb_invalidate(APEX_Bb_Cache *cache, const APEX_Instruction *code_memory,
+              int code_memory_size)
+{
+    Bb_Block **table = cache->block;
+
+    if (code_memory_size != cache->code_memory_size || !table)
+    {
+        table = realloc(table, sizeof(Bb_Block *)
+                                   * (code_memory_size > 0 ? code_memory_size
+                                                           : 1));
+        if (!table)
+        {
+            return -1;
+        }
+        cache->block = table;
+    }
+
+    arena_free(&cache->arena);
+    memset(cache->block, 0, sizeof(Bb_Block *) * code_memory_size);
+    cache->code_memory = code_memory;
+    cache->code_memory_size = code_memory_size;
+    cache->stats.invalidations++;
+    return 0;
+}
+
+/* Creates a cache for code_memory, or returns NULL when out of memory */
+APEX_Bb_Cache *
+bb_create(const APEX_Instruction *code_memory, int code_memory_size)
+{
+    APEX_Bb_Cache *cache = calloc(1, sizeof(APEX_Bb_Cache));
+
+    if (!cache)
+    {
+        return NULL;
+    }
+    arena_init(&cache->arena);
+    if (bb_invalidate(cache, code_memory, code_memory_size))
+    {
+        free(cache);
+        return NULL;
+    }
+    cache->stats.invalidations = 0;
+    return cache;
+}
+
+void
+bb_destroy(APEX_Bb_Cache *cache)
+{
+    if (!cache)
+    {
+        return;
+    }
+    arena_free(&cache->arena);
+    free(cache->block);
+    free(cache);
+}
+
+/* Runs budget instructions, or until HALT or an error, on ref_step */
+static int
+bb_interpret(APEX_Bb_Cache *cache, APEX_Ref *ref, int64_t budget)
+{
+    APEX_Retire retire;
+    int before = ref->insn_completed;
+    int status = REF_OK;
+
+    while (budget-- > 0 && status == REF_OK)
+    {
+        status = ref_step(ref, &retire);
+    }
+    cache->stats.interpreted += ref->insn_completed - before;
+    return status;
+}
+
+static void
+set_flags(APEX_Ref *ref, int a, int b)
+{
+    ref->zero_flag = (a == b);
+    ref->neg_flag = (a < b);
+    ref->pos_flag = (a > b);
+}
+
+/* Writes an ALU result and sets the flags from it */
+static inline void
+write_result(APEX_Ref *ref, int rd, int result)
+{
+    ref->zero_flag = (result == 0);
+    ref->neg_flag = (result < 0);
+    ref->pos_flag = (result > 0);
+    ref->regs[rd] = result;
+}
+
+/*
+ * Runs the whole of block. Returns REF_OK with ref->pc at the next block
+ * and *taken telling which link leads there, REF_HALT, or REF_BAD_ADDRESS
+ * with the state left as it was before the faulting access.
+ */
+static int
+bb_execute(APEX_Ref *ref, const Bb_Block *block, int *taken)
+{
+    const Bb_Op *op = block->op;
+    const Bb_Op *end = op + block->num_ops;
+    int *regs = ref->regs;
+    int pc, rs1, rs2, address;
+
+    *taken = FALSE;
+    for (; op < end; ++op)
+    {
+        rs1 = regs[op->rs1];
+        rs2 = regs[op->rs2];
+
+        switch (op->opcode)
+        {
+            case OPCODE_AND: write_result(ref, op->rd, rs1 & rs2); break;
+            case OPCODE_OR: write_result(ref, op->rd, rs1 | rs2); break;
+            case OPCODE_XOR: write_result(ref, op->rd, rs1 ^ rs2); break;
+            case OPCODE_MOVC: write_result(ref, op->rd, op->imm); break;
+
+            case OPCODE_ADD:
+            {
+                write_result(ref, op->rd, ref_add(rs1, rs2));
+                break;
+            }
+
+            case OPCODE_SUB:
+            {
+                write_result(ref, op->rd, ref_sub(rs1, rs2));
+                break;
+            }
+
+            case OPCODE_MUL:
+            {
+                write_result(ref, op->rd, ref_mul(rs1, rs2));
+                break;
+            }
+
+            case OPCODE_DIV:
+            {
+                write_result(ref, op->rd, ref_div(rs1, rs2));
+                break;
+            }
+
+            case OPCODE_ADDL:
+            {
+                write_result(ref, op->rd, ref_add(rs1, op->imm));
+                break;
+            }
+
+            case OPCODE_SUBL:
+            {
+                write_result(ref, op->rd, ref_sub(rs1, op->imm));
+                break;
+            }
+
+            case OPCODE_CMP: set_flags(ref, rs1, rs2); break;
+            case OPCODE_CML: set_flags(ref, rs1, op->imm); break;
+
+            case OPCODE_LOAD:
+            case OPCODE_LOADP:
+            {
+                address = ref_add(rs1, op->imm);
+                if (!memory_valid(&ref->data_memory, address))
+                {
+                    goto fault;
+                }
+                if (op->opcode == OPCODE_LOADP)
+                {
+                    regs[op->rs1] = ref_add(rs1, 4);
+                }
+                regs[op->rd] = memory_read(&ref->data_memory, address);
+                break;
+            }
+
+            case OPCODE_STORE:
+            case OPCODE_STOREP:
+            {
+                address = ref_add(rs2, op->imm);
+                if (!memory_valid(&ref->data_memory, address))
+                {
+                    goto fault;
+                }
+                memory_write(&ref->data_memory, address, rs1);
+                if (op->opcode == OPCODE_STOREP)
+                {
+                    regs[op->rs2] = ref_add(rs2, 4);
+                }
+                break;
+            }
+
+            case OPCODE_BZ: *taken = ref->zero_flag; break;
+            case OPCODE_BNZ: *taken = !ref->zero_flag; break;
+            case OPCODE_BP: *taken = ref->pos_flag; break;
+            case OPCODE_BNP: *taken = !ref->pos_flag; break;
+            case OPCODE_BN: *taken = ref->neg_flag; break;
+            case OPCODE_BNN: *taken = !ref->neg_flag; break;
+
+            case OPCODE_JUMP:
+            {
+                ref->pc = ref_add(rs1, op->imm);
+                ref->insn_completed += block->num_ops;
+                return REF_OK;
+            }
+
+            case OPCODE_JALR:
+            {
+                pc = block->pc + 4 * (int)(op - block->op);
+                ref->pc = ref_add(rs1, op->imm);
+                regs[op->rd] = pc + 4;
+                ref->insn_completed += block->num_ops;
+                return REF_OK;
+            }
+
+            case OPCODE_HALT:
+            {
+                ref->pc = block->pc + 4 * (int)(op - block->op);
+                ref->insn_completed += block->num_ops;
+                return REF_HALT;
+            }
+        }
+    }
+
+    pc = block->pc + 4 * (block->num_ops - 1);
+    ref->pc = *taken ? pc + end[-1].imm : pc + 4;
+    ref->insn_completed += block->num_ops;
+    return REF_OK;
+
+fault:
+    ref->pc = block->pc + 4 * (int)(op - block->op);
+    ref->insn_completed += (int)(op - block->op);
+    return REF_BAD_ADDRESS;
+}
+
+/*
+ * Runs until HALT, an error, or ref->insn_completed reaches max_insns (0
+ * for no limit). Like ref_run, it always runs at least one instruction and
+ * returns the status of the last one.
+ */
+int
+bb_run(APEX_Bb_Cache *cache, APEX_Ref *ref, int max_insns)
+{
+    APEX_Retire retire;
+    int64_t budget = max_insns ? (int64_t)max_insns - ref->insn_completed
+                               : INT64_MAX;
+    int before = ref->insn_completed;
+    Bb_Block *block, **link;
+    int status = REF_OK;
+    int taken;
+
+    if ((ref->code_memory != cache->code_memory
+         || ref->code_memory_size != cache->code_memory_size)
+        && bb_invalidate(cache, ref->code_memory, ref->code_memory_size))
+    {
+        return ref_run(ref, max_insns);
+    }
+
+    if (budget <= 0)
+    {
+        status = bb_interpret(cache, ref, 1);
+    }
+
+    block = NULL;
+    while (budget > 0)
+    {
+        if (!block && !(block = bb_lookup(cache, ref->pc)))
+        {
+            /* Undecodable, or a pc ref_step will report */
+            budget--;
+            status = bb_interpret(cache, ref, 1);
+            if (status != REF_OK)
+            {
+                break;
+            }
+            continue;
+        }
+
+        if (budget < block->num_ops)
+        {
+            status = bb_interpret(cache, ref, budget);
+            break;
+        }
+        budget -= block->num_ops;
+
+        status = bb_execute(ref, block, &taken);
+        if (status == REF_BAD_ADDRESS)
+        {
+            /* Reports the fault and leaves the state as it is */
+            status = ref_step(ref, &retire);
+            break;
+        }
+        if (status != REF_OK)
+        {
+            break;
+        }
+
+        switch (block->op[block->num_ops - 1].opcode)
+        {
+            case OPCODE_JUMP:
+            case OPCODE_JALR:
+                block = NULL;
+                continue;
+        }
+
+        link = taken ? &block->taken : &block->next;
+        if (!*link && (*link = bb_lookup(cache, ref->pc)))
+        {
+            cache->stats.links++;
+        }
+        block = *link;
+    }
+
+    cache->stats.insns += ref->insn_completed - before;
+    return status;
+}
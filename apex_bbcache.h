@@ -0,0 +1,74 @@
+/*
+ * apex_bbcache.h
+ * Contains declarations of the basic-block cache of the functional engine
+ *
+ * The block interpreter runs APEX code with the semantics of the reference
+ * model, like ref_run, without translating it to host code. Each basic
+ * block, ending at a branch, JUMP, JALR or HALT, is decoded once into an
+ * array of compact micro-ops. A block keeps links to its fall-through and
+ * taken successors, resolved the first time each is followed, so a run
+ * goes from block to block without looking up the pc or re-decoding
+ * instructions; only JUMP and JALR go through the block table.
+ *
+ * Blocks are allocated from an arena and belong to one code memory. Running
+ * on another code memory, or calling bb_invalidate after changing the
+ * instructions in place, discards them all.
+ */
+#ifndef _APEX_BBCACHE_H_
+#define _APEX_BBCACHE_H_
+
+#include <stdint.h>
+
+#include "apex_pool.h"
+#include "apex_ref.h"
+
+/* Instructions in the longest block */
+#define BB_BLOCK_INSNS 64
+
+/* Decoded instruction */
+typedef struct Bb_Op
+{
+    uint8_t opcode;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    int imm;
+} Bb_Op;
+
+typedef struct Bb_Block
+{
+    int pc;                        /* Of the first instruction */
+    int num_ops;
+    struct Bb_Block *next;         /* Fall-through successor, once followed */
+    struct Bb_Block *taken;        /* Branch target, once followed */
+    Bb_Op op[];
+} Bb_Block;
+
+typedef struct APEX_Bb_Stats
+{
+    uint64_t insns;                /* Instructions executed */
+    uint64_t blocks;               /* Blocks decoded */
+    uint64_t block_insns;          /* Instructions in them */
+    uint64_t links;                /* Successor links resolved */
+    uint64_t lookups;              /* Blocks found through the block table */
+    uint64_t interpreted;          /* Instructions run by ref_step instead */
+    uint64_t invalidations;
+} APEX_Bb_Stats;
+
+typedef struct APEX_Bb_Cache
+{
+    const struct APEX_Instruction *code_memory;
+    int code_memory_size;
+    Bb_Block **block;              /* Block starting at each instruction */
+    APEX_Arena arena;              /* Blocks of the current code memory */
+    APEX_Bb_Stats stats;
+} APEX_Bb_Cache;
+
+APEX_Bb_Cache *bb_create(const struct APEX_Instruction *code_memory,
+                         int code_memory_size);
+int bb_invalidate(APEX_Bb_Cache *cache,
+                  const struct APEX_Instruction *code_memory,
+                  int code_memory_size);
+int bb_run(APEX_Bb_Cache *cache, APEX_Ref *ref, int max_insns);
+void bb_destroy(APEX_Bb_Cache *cache);
+#endif
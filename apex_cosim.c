@@ -0,0 +1,154 @@
+/*
+ * apex_cosim.c
+ * Contains the lockstep co-simulation checker
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex_cosim.h"
+#include "apex_cpu.h"
+
+static const char *ref_status_str[] = {
+    "ok", "halt", "pc outside code memory", "address outside data memory",
+};
+
+/* Creates a checker whose reference starts from the CPU's current state */
+APEX_Cosim *
+cosim_create(const APEX_CPU *cpu)
+{
+    APEX_Cosim *cosim = calloc(1, sizeof(APEX_Cosim));
+
+    if (!cosim)
+    {
+        return NULL;
+    }
+
+    if (ref_init(&cosim->ref, cpu->code_memory, cpu->code_memory_size,
+                 &cpu->data_memory))
+    {
+        free(cosim);
+        return NULL;
+    }
+    cosim->ref.pc = cpu->pc;
+    memcpy(cosim->ref.regs, cpu->regs, sizeof(cosim->ref.regs));
+    cosim->ref.zero_flag = cpu->zero_flag;
+    cosim->ref.pos_flag = cpu->pos_flag;
+    cosim->ref.neg_flag = cpu->neg_flag;
+    return cosim;
+}
+
+static void
+print_retire(const char *name, const APEX_Retire *retire)
+{
+    int i;
+
+    printf("%-10s: pc(%d) opcode(%d)", name, retire->pc, retire->opcode);
+    for (i = 0; i < retire->num_reg_writes; ++i)
+    {
+        printf(" R%d=%d", retire->reg[i], retire->reg_value[i]);
+    }
+    if (retire->mem_write)
+    {
+        printf(" MEM[%d]=%d", retire->mem_address, retire->mem_value);
+    }
+    printf("\n");
+}
+
+static void
+print_regs(const char *name, const int *regs, int z, int p, int n)
+{
+    int i;
+
+    printf("%-10s:", name);
+    for (i = 0; i < REG_FILE_SIZE; ++i)
+    {
+        printf(" R%d[%d]", i, regs[i]);
+    }
+    printf(" Z[%d] P[%d] N[%d]\n", z, p, n);
+}
+
+static void
+dump_divergence(const APEX_Cosim *cosim, const APEX_CPU *cpu,
+                const APEX_Retire *expected, const APEX_Retire *actual,
+                const char *reason)
+{
+    printf("APEX_COSIM: Divergence at retirement #%d, cycle %d: %s\n",
+           cosim->checked, cpu->clock, reason);
+    print_retire("Expected", expected);
+    print_retire("Pipeline", actual);
+    print_regs("Reference", cosim->ref.regs, cosim->ref.zero_flag,
+               cosim->ref.pos_flag, cosim->ref.neg_flag);
+    print_regs("Pipeline", cpu->regs, cpu->zero_flag, cpu->pos_flag,
+               cpu->neg_flag);
+}
+
+/*
+ * Steps the reference once and compares it with the instruction retired by
+ * the pipeline. Returns 0 when they agree, nonzero on divergence.
+ */
+int
+cosim_check(APEX_Cosim *cosim, const APEX_CPU *cpu, const APEX_Retire *actual)
+{
+    APEX_Retire expected;
+    const char *reason = NULL;
+    int status, i;
+
+    /* The pipeline drops NOPs in fetch, so they never retire */
+    do
+    {
+        status = ref_step(&cosim->ref, &expected);
+    } while (status == REF_OK && expected.opcode == OPCODE_NOP);
+
+    if (status != REF_OK && status != REF_HALT)
+    {
+        reason = ref_status_str[status];
+    }
+    else if (expected.pc != actual->pc)
+    {
+        reason = "retiring PC differs";
+    }
+    else if (expected.num_reg_writes != actual->num_reg_writes)
+    {
+        reason = "number of register writes differs";
+    }
+    else if (expected.mem_write != actual->mem_write
+             || (expected.mem_write
+                 && (expected.mem_address != actual->mem_address
+                     || expected.mem_value != actual->mem_value)))
+    {
+        reason = "memory write differs";
+    }
+    else
+    {
+        for (i = 0; i < expected.num_reg_writes; ++i)
+        {
+            if (expected.reg[i] != actual->reg[i]
+                || expected.reg_value[i] != actual->reg_value[i])
+            {
+                reason = "register write differs";
+                break;
+            }
+        }
+    }
+
+    cosim->checked++;
+
+    if (reason)
+    {
+        cosim->diverged = TRUE;
+        dump_divergence(cosim, cpu, &expected, actual, reason);
+        return 1;
+    }
+    return 0;
+}
+
+void
+cosim_destroy(APEX_Cosim *cosim)
+{
+    if (cosim)
+    {
+        ref_free(&cosim->ref);
+    }
+    free(cosim);
+}
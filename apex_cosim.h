@@ -0,0 +1,27 @@
+/*
+ * apex_cosim.h
+ * Contains declarations of the lockstep co-simulation checker
+ *
+ * The checker steps the reference model once for every instruction retired
+ * by the pipeline and compares the retiring PC, the register writes and the
+ * memory write. The first mismatch stops the simulation with a state dump.
+ */
+#ifndef _APEX_COSIM_H_
+#define _APEX_COSIM_H_
+
+#include "apex_ref.h"
+
+struct APEX_CPU;
+
+typedef struct APEX_Cosim
+{
+    APEX_Ref ref;        /* Reference model running in lockstep */
+    int checked;         /* Retirements compared so far */
+    int diverged;        /* Set on the first mismatch */
+} APEX_Cosim;
+
+APEX_Cosim *cosim_create(const struct APEX_CPU *cpu);
+int cosim_check(APEX_Cosim *cosim, const struct APEX_CPU *cpu,
+                const APEX_Retire *actual);
+void cosim_destroy(APEX_Cosim *cosim);
+#endif
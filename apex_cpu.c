@@ -6,14 +6,18 @@
  * Copyright (c) 2020, Gaurav Kothari (gkothar1@binghamton.edu)
  * State University of New York at Binghamton
  */
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "apex_cosim.h"
 #include "apex_cpu.h"
+#include "apex_event.h"
 #include "apex_macros.h"
+#include "apex_profile.h"
+#include "apex_system.h"
 
-int oq_ind,entryIndex;
 /* Converts the PC(4000 series) into array index for code memory
  *
  * Note: You are not supposed to edit this function
@@ -25,9 +29,9 @@ get_code_memory_index_from_pc(const int pc)
 }
 
 static void
-print_instruction(const CPU_Stage *stage)
+print_instruction(const APEX_Dyn_Insn *insn)
 {
-    switch (stage->opcode)
+    switch (insn->opcode)
     {
         case OPCODE_ADD:
         case OPCODE_SUB:
@@ -37,43 +41,43 @@ print_instruction(const CPU_Stage *stage)
         case OPCODE_OR:
         case OPCODE_XOR:
         {
-            printf("%s,R%d,R%d,R%d ", stage->opcode_str, stage->rd, stage->rs1,
-                   stage->rs2);
+            printf("%s,R%d,R%d,R%d ", insn->opcode_str, insn->rd, insn->rs1,
+                   insn->rs2);
             break;
         }
 
         case OPCODE_MOVC:
         {
-            printf("%s,R%d,#%d ", stage->opcode_str, stage->rd, stage->imm);
+            printf("%s,R%d,#%d ", insn->opcode_str, insn->rd, insn->imm);
             break;
         }
 
         case OPCODE_LOAD:
         {
-            printf("%s,R%d,R%d,#%d ", stage->opcode_str, stage->rd, stage->rs1,
-                   stage->imm);
+            printf("%s,R%d,R%d,#%d ", insn->opcode_str, insn->rd, insn->rs1,
+                   insn->imm);
             break;
         }
 
         case OPCODE_LOADP:
         {
-            printf("%s,R%d,R%d,#%d ", stage->opcode_str, stage->rd, stage->rs1,
-                stage->imm);
+            printf("%s,R%d,R%d,#%d ", insn->opcode_str, insn->rd, insn->rs1,
+                insn->imm);
             break;
         }
 
 
         case OPCODE_STORE:
         {
-            printf("%s,R%d,R%d,#%d ", stage->opcode_str, stage->rs1, stage->rs2,
-                   stage->imm);
+            printf("%s,R%d,R%d,#%d ", insn->opcode_str, insn->rs1, insn->rs2,
+                   insn->imm);
             break;
         }
 
         case OPCODE_STOREP:
         {
-            printf("%s,R%d,R%d,#%d ", stage->opcode_str, stage->rs1, stage->rs2,
-                   stage->imm);
+            printf("%s,R%d,R%d,#%d ", insn->opcode_str, insn->rs1, insn->rs2,
+                   insn->imm);
             break;
         }
 
@@ -85,56 +89,61 @@ print_instruction(const CPU_Stage *stage)
         case OPCODE_BN:
         case OPCODE_BNN:
         {
-            printf("%s,#%d ", stage->opcode_str, stage->imm);
+            printf("%s,#%d ", insn->opcode_str, insn->imm);
             break;
         }
 
         case OPCODE_HALT:
         {
-            printf("%s", stage->opcode_str);
+            printf("%s", insn->opcode_str);
             break;
         }
 
         case OPCODE_NOP:
         {
-            printf("%s", stage->opcode_str);
+            printf("%s", insn->opcode_str);
             break;
         }
 
         case OPCODE_ADDL:
         case OPCODE_SUBL:
         {
-            printf("%s,R%d,R%d,#%d ", stage->opcode_str, stage->rd, stage->rs1,
-                   stage->imm);
+            printf("%s,R%d,R%d,#%d ", insn->opcode_str, insn->rd, insn->rs1,
+                   insn->imm);
             break;
         }
 
         case OPCODE_CMP:
         {
-            printf("%s,R%d,R%d ", stage->opcode_str, stage->rs1, stage->rs2);
+            printf("%s,R%d,R%d ", insn->opcode_str, insn->rs1, insn->rs2);
             break;
         }
 
         case OPCODE_CML:
         {
-            printf("%s,R%d,#%d ", stage->opcode_str, stage->rs1, stage->imm);
+            printf("%s,R%d,#%d ", insn->opcode_str, insn->rs1, insn->imm);
             break;
         }
 
         case OPCODE_JUMP:
         {
-            printf("%s,R%d,#%d ", stage->opcode_str, stage->rs1, stage->imm);
+            printf("%s,R%d,#%d ", insn->opcode_str, insn->rs1, insn->imm);
             break;
         }
 
         case OPCODE_JALR:
         {
-            printf("%s,R%d,R%d,#%d ", stage->opcode_str, stage->rd, stage->rs1,
-                   stage->imm);
+            printf("%s,R%d,R%d,#%d ", insn->opcode_str, insn->rd, insn->rs1,
+                   insn->imm);
             break;
         }
 
     }
+
+    if (insn->fused)
+    {
+        printf("+ %s,#%d ", insn->branch_str, insn->branch_imm);
+    }
 }
 
 /* Debug function which prints the CPU stage content
@@ -142,10 +151,10 @@ print_instruction(const CPU_Stage *stage)
  * Note: You can edit this function to print in more detail
  */
 static void
-print_stage_content(const char *name, const CPU_Stage *stage)
+print_stage_content(const char *name, const APEX_Dyn_Insn *insn)
 {
-    printf("%-15s: pc(%d) ", name, stage->pc);
-    print_instruction(stage);
+    printf("%-15s: pc(%d) ", name, insn->pc);
+    print_instruction(insn);
     printf("\n");
 }
 
@@ -175,722 +184,1173 @@ print_reg_file(const APEX_CPU *cpu)
     printf("\n");
 }
 
-/* Definition of check_oq_entry function */
-int check_op_queue_entry(APEX_CPU* cpu) {
-    for (int oq_ind = 0; index < Op_QUEUE_SIZE; oq_ind++) {
-        if (!cpu->op_queue.entries[oq_ind].is_valid) {
-            cpu->op_queue.next_free_index = index;
-            return 1;
-        }
-    }
-    return 0;
-}
-
-/* Function to Initialize Operation Queue */
-void initialize_issue_queue(APEX_CPU *cpu) {
-    cpu->op_queue.next_free_index = 0;  // Reset the index of the next free entry
-
-    for (int i = 0; i < Op_QUEUE_SIZE; i++) {
-        cpu->op_queue.entries[i].program_counter = -1;  // Default value for PC
-        cpu->op_queue.entries[i].is_valid = 0;          // 0 indicating invalid/unused entry
-        cpu->op_queue.entries[i].functional_unit_type = 0;  // Default functional unit type
-        cpu->op_queue.entries[i].immediate_value = 0;       // Default immediate value
-        cpu->op_queue.entries[i].source1_ready = 0;         // Source1 not ready
-        cpu->op_queue.entries[i].source1_register = -1;     // Default source1 register
-        cpu->op_queue.entries[i].source1_value = 0;         // Default source1 value
-        cpu->op_queue.entries[i].source2_ready = 0;         // Source2 not ready
-        cpu->op_queue.entries[i].source2_register = -1;     // Default source2 register
-        cpu->op_queue.entries[i].source2_value = 0;         // Default source2 value
-        cpu->op_queue.entries[i].destination_register = -1; // Default destination register
-        cpu->op_queue.entries[i].load_store_queue_index = -1; // Default LSQ index
-    }
-}
-
-
-int add_op_queue_entry(APEX_CPU* cpu, OpQueueEntry* newOpEntry) {
-    // Check if there is a free entry in the OpQueue
-    if (cpu->op_queue.next_free_index < Op_QUEUE_SIZE) {
-        int entryIndex = cpu->op_queue.next_free_index;
-
-        cpu->op_queue.entries[entryIndex].program_counter = newOpEntry->program_counter;
-        cpu->op_queue.entries[entryIndex].is_valid = newOpEntry->is_valid;
-        cpu->op_queue.entries[entryIndex].functional_unit_type = newOpEntry->functional_unit_type;
-        cpu->op_queue.entries[entryIndex].immediate_value = newOpEntry->immediate_value;
-        cpu->op_queue.entries[entryIndex].source1_ready = newOpEntry->source1_ready;
-        cpu->op_queue.entries[entryIndex].source1_register = newOpEntry->source1_register;
-        cpu->op_queue.entries[entryIndex].source1_value = newOpEntry->source1_value;
-        cpu->op_queue.entries[entryIndex].source2_ready = newOpEntry->source2_ready;
-        cpu->op_queue.entries[entryIndex].source2_register = newOpEntry->source2_register;
-        cpu->op_queue.entries[entryIndex].source2_value = newOpEntry->source2_value;
-        cpu->op_queue.entries[entryIndex].destination_register = newOpEntry->destination_register;
-        cpu->op_queue.entries[entryIndex].load_store_queue_index = newOpEntry->load_store_queue_index;
-
-        // Update the index for the next free entry in the OpQueue
-        cpu->op_queue.next_free_index++;
-        return 0;
-    }
-    return -1; // OpQueue is full
+/* Index of the lowest bit set in mask, which must not be 0 */
+static inline int
+mask_first(APEX_Mask mask)
+{
+    return __builtin_ctzll(mask);
 }
 
-int is_op_queue_entry_valid(APEX_CPU* cpu, int numEntries)
+/*
+ * Fills regs with the architectural registers read by an instruction and
+ * returns how many there are
+ */
+static int
+get_source_regs(const APEX_Dyn_Insn *insn, int *regs)
 {
-    for (int i = 0; i < numEntries; i++)
+    switch (insn->opcode)
     {
-        if (cpu->op_queue.entries[i].is_valid && 
-            cpu->op_queue.entries[i].source1_ready && 
-            cpu->op_queue.entries[i].source2_ready)
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_AND:
+        case OPCODE_OR:
+        case OPCODE_XOR:
+        case OPCODE_STORE:
+        case OPCODE_STOREP:
+        case OPCODE_CMP:
+        {
+            regs[0] = insn->rs1;
+            regs[1] = insn->rs2;
+            return 2;
+        }
+
+        case OPCODE_ADDL:
+        case OPCODE_SUBL:
+        case OPCODE_LOAD:
+        case OPCODE_LOADP:
+        case OPCODE_CML:
+        case OPCODE_JUMP:
+        case OPCODE_JALR:
         {
-            update_instruction(cpu, i);
+            regs[0] = insn->rs1;
             return 1;
         }
     }
     return 0;
 }
 
-// void update_instruction(APEX_CPU* cpu, int index)
-// {
-//     // Assuming 'execute' is the next stage after issue/operation queue
-//     cpu->execute.rs1_value = cpu->op_queue.entries[index].source1_value;
-//     cpu->execute.rs2_value = cpu->op_queue.entries[index].source2_value;
-
-//     // Assuming destination register and functional unit type are also needed
-//     cpu->execute.rd = cpu->op_queue.entries[index].destination_register;
-
-//     // You can also copy other necessary fields from the OpQueue entry to the execute stage
-// }
-int update_instruction(APEX_CPU* cpu, int index) {
-    // Check if the index is within the bounds of the issue queue
-    if (index < 0 || index >= Op_QUEUE_SIZE) {
-        // Handle the error case, such as logging an error or returning an error code
-        return -1;
-    }
-
-    // Access the issue queue entry
-    OpQueueEntry* iq_entry = &cpu->op_queue.entries[index];
-
-    // Check if the issue queue entry is valid
-    if (!iq_entry->is_valid) {
-        // The entry is not valid; handle this case appropriately
-        return -1;
-    }
-
-    // Update the execute stage with the source registers and their values from the issue queue entry
-    cpu->execute.rs1 = iq_entry->source1_register;
-    cpu->execute.rs2 = iq_entry->source2_register;
-    cpu->execute.rs1_value = iq_entry->source1_value;
-    cpu->execute.rs2_value = iq_entry->source2_value;
-
-    // Assuming destination register and functional unit type are also needed
-    cpu->execute.rd = cpu->op_queue.entries[index].destination_register;
-
+/*
+ * Fills regs with the architectural registers written by an instruction, in
+ * the order writeback updates them, and returns how many there are
+ */
+static int
+get_dest_regs(const APEX_Dyn_Insn *insn, int *regs)
+{
+    switch (insn->opcode)
+    {
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_AND:
+        case OPCODE_OR:
+        case OPCODE_XOR:
+        case OPCODE_ADDL:
+        case OPCODE_SUBL:
+        case OPCODE_MOVC:
+        case OPCODE_LOAD:
+        case OPCODE_JALR:
+        {
+            regs[0] = insn->rd;
+            return 1;
+        }
 
-    return 0;
-}
+        case OPCODE_LOADP:
+        {
+            regs[0] = insn->rs1;
+            regs[1] = insn->rd;
+            return 2;
+        }
 
-int check_phys_reg_free(APEX_CPU *cpu)
-{
-    for (int phys_index = 0; phys_index < NUM_PHYSICAL_REGS; phys_index++) {
-        if (!cpu->phys_reg[phys_index].status) {  //  status = 0 means free
+        case OPCODE_STOREP:
+        {
+            regs[0] = insn->rs2;
             return 1;
         }
     }
     return 0;
 }
 
-int search_free_phys_reg(APEX_CPU *cpu)
+static int
+is_conditional_branch(int opcode)
 {
-    for (int phys_index_free = 0; phys_index_free < NUM_PHYSICAL_REGS; phys_index_free++) {
-        if (!cpu->phys_reg[phys_index_free].status) {
-            return phys_index_free;
-        }
+    switch (opcode)
+    {
+        case OPCODE_BZ:
+        case OPCODE_BNZ:
+        case OPCODE_BP:
+        case OPCODE_BNP:
+        case OPCODE_BN:
+        case OPCODE_BNN:
+            return TRUE;
     }
-    return -1;
+    return FALSE;
 }
 
-int assign_phys_reg(APEX_CPU *cpu, int arch_reg)
+/* Returns TRUE if opcode ends a basic block */
+static int
+ends_block(int opcode)
 {
-        int free_phys_reg = search_free_phys_reg(cpu);
-        if (free_phys_reg != -1) {
-        cpu->phys_reg[free_phys_reg].status = 1;  // Mark as allocated
-        cpu->phys_reg[free_phys_reg].valid = 0;   // Mark as invalid
-        // Update rename table here if applicable
-        // For example: cpu->rename_table[ArchReg] = freePR;
-    }
-    return free_phys_reg;
+    return is_conditional_branch(opcode) || opcode == OPCODE_JUMP
+           || opcode == OPCODE_JALR || opcode == OPCODE_HALT;
 }
-/* Free a physical register */
-void deallocate_phys_reg(APEX_CPU *cpu, int ph_reg) {
-    if (ph_reg >= 0 && ph_reg < NUM_PHYSICAL_REGS) {
-        cpu->phys_reg[ph_reg].status = 0;  // Mark as free
-        cpu->phys_reg[ph_reg].valid = 0;   // Optionally reset valid bit
+
+/* Returns TRUE if an instruction sets the flags a following branch can test */
+static int
+is_fusible(int opcode)
+{
+    switch (opcode)
+    {
+        case OPCODE_CMP:
+        case OPCODE_CML:
+        case OPCODE_ADDL:
+        case OPCODE_SUBL:
+            return TRUE;
     }
+    return FALSE;
 }
 
-
-/*
- * Fetch Stage of APEX Pipeline
- *
- * Note: You are free to edit this function according to your implementation
- */
-static void
-APEX_fetch(APEX_CPU *cpu)
+/* Returns the mask of n architectural registers */
+static uint32_t
+reg_mask(const int *regs, int n)
 {
-    APEX_Instruction *current_ins;
+    uint32_t mask = 0;
+    int i;
 
-    if (cpu->fetch.has_insn)
+    for (i = 0; i < n; ++i)
     {
-        /* This fetches new branch target instruction from next cycle */
-        if (cpu->fetch_from_next_cycle == TRUE)
+        if (regs[i] >= 0 && regs[i] < REG_FILE_SIZE)
         {
-            cpu->fetch_from_next_cycle = FALSE;
-
-            /* Skip this cycle*/
-            return;
+            mask |= 1u << regs[i];
         }
+    }
+    return mask;
+}
 
+/* Returns TRUE if a source register still has an older write in flight */
+static int
+sources_busy(const APEX_Reg_Status *status, const APEX_Dyn_Insn *insn)
+{
+    return (status->busy & ~status->predicted & insn->src_mask) != 0;
+}
 
-        /* Store current PC in fetch latch */
-        cpu->fetch.pc = cpu->pc;
-
-        /* Index into code memory using this pc and copy all instruction fields
-         * into fetch latch  */
-        current_ins = &cpu->code_memory[get_code_memory_index_from_pc(cpu->pc)];
-        strcpy(cpu->fetch.opcode_str, current_ins->opcode_str);
-        cpu->fetch.opcode = current_ins->opcode;
-        cpu->fetch.rd = current_ins->rd;
-        cpu->fetch.rs1 = current_ins->rs1;
-        cpu->fetch.rs2 = current_ins->rs2;
-        cpu->fetch.imm = current_ins->imm;
-
-        /* Update PC for next instruction */
-        cpu->pc += 4;
+static int
+has_pending_source(const APEX_CPU *cpu, const APEX_Dyn_Insn *insn)
+{
+    return sources_busy(&cpu->register_status, insn);
+}
 
-        /* Copy data from fetch latch to decode latch*/
-        cpu->decode = cpu->fetch;
+/* Adds delta to the in-flight write count of every destination register */
+static void
+update_dest_status(APEX_CPU *cpu, const APEX_Dyn_Insn *insn, int delta)
+{
+    APEX_Reg_Status *status = &cpu->register_status;
+    uint32_t regs;
+    int reg;
 
-        if (ENABLE_DEBUG_MESSAGES)
+    for (regs = insn->dest_mask; regs; regs &= regs - 1)
+    {
+        reg = mask_first(regs);
+        status->writes[reg] += delta;
+        if (status->writes[reg])
         {
-            print_stage_content("Fetch", &cpu->fetch);
+            status->busy |= (APEX_Mask)1 << reg;
         }
-
-        /* Stop fetching new instructions if HALT is fetched */
-        if (cpu->fetch.opcode == OPCODE_HALT)
+        else
         {
-            cpu->fetch.has_insn = FALSE;
+            status->busy &= ~((APEX_Mask)1 << reg);
         }
 
-        if (cpu->fetch.opcode == OPCODE_NOP)
+        /* A predicted value is only read while its load is the youngest
+         * write in flight */
+        if (delta > 0 || !status->writes[reg])
         {
-            cpu->decode.has_insn = FALSE;
+            status->predicted &= ~((APEX_Mask)1 << reg);
         }
     }
 }
 
 /*
- * Decode Stage of APEX Pipeline
- *
- * Note: You are free to edit this function according to your implementation
+ * Reads a source register in decode: from the register file, or the
+ * predicted value of a load still in flight
  */
-static void
-APEX_decode(APEX_CPU *cpu)
+static int
+read_source(APEX_CPU *cpu, int reg)
 {
-    if (cpu->decode.has_insn)
-    {
-        /* Read operands from register file based on the instruction type */
-        switch (cpu->decode.opcode)
-        {
-            case OPCODE_ADD:
-            case OPCODE_ADDL:
-            {
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                break;
-            }
-
-            case OPCODE_SUB:
-            case OPCODE_SUBL:
-            {
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                break;
-            }
+    APEX_Reg_Status *status = &cpu->register_status;
 
-            case OPCODE_OR:
-            case OPCODE_XOR:
-            case OPCODE_AND:
-            {
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                break;
-            }
+    if (status->predicted & ((APEX_Mask)1 << reg))
+    {
+        status->pred_load[reg]->vp_used = TRUE;
+        return status->pred_value[reg];
+    }
+    cpu->energy.count[ENERGY_REG_READ]++;
+    return cpu->regs[reg];
+}
 
-            case OPCODE_MUL:
-            {
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                break;
-            }
+/* Sets the zero, positive and negative flags by comparing a with b */
+static void
+set_condition_flags(APEX_CPU *cpu, int a, int b)
+{
+    cpu->zero_flag = (a == b) ? TRUE : FALSE;
+    cpu->neg_flag = (a < b) ? TRUE : FALSE;
+    cpu->pos_flag = (a > b) ? TRUE : FALSE;
+}
 
-            case OPCODE_LOAD:
-            {
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                printf("hi");
-                // cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                break;
-            }
+/*
+ * Starts the work of an insn in its stage this cycle. Operations longer than
+ * one cycle schedule their completion for the event-driven kernel.
+ */
+static void
+start_stage(APEX_CPU *cpu, APEX_Dyn_Insn *insn, int latency)
+{
+    insn->ready_cycle = cpu->clock + (latency > 1 ? latency : 1) - 1;
+    if (latency > 1)
+    {
+        event_queue_push(&cpu->events, insn->ready_cycle);
+    }
+}
 
-            case OPCODE_STORE:
-            {
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                printf("%d",cpu->decode.rs1_value);
-                printf("%d",cpu->decode.rs2_value);
-                break;
-            }
+/* Drops the instruction in a latch, when a branch flushes it */
+static void
+flush_latch(APEX_CPU *cpu, APEX_Dyn_Insn **latch)
+{
+    if (*latch)
+    {
+        slab_free(&cpu->insn_pool, *latch);
+        *latch = NULL;
+    }
+}
 
-            case OPCODE_STOREP:
-            {
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                // printf("%d",cpu->decode.rs1_value);
-                // printf("%d",cpu->decode.rs2_value);
-                break;
-            }
+/* Returns TRUE if a conditional branch is taken with the current flags */
+static int
+branch_taken(const APEX_CPU *cpu, int opcode)
+{
+    switch (opcode)
+    {
+        case OPCODE_BZ: return cpu->zero_flag == TRUE;
+        case OPCODE_BNZ: return cpu->zero_flag == FALSE;
+        case OPCODE_BP: return cpu->pos_flag == TRUE;
+        case OPCODE_BNP: return cpu->pos_flag == FALSE;
+        case OPCODE_BN: return cpu->neg_flag == TRUE;
+        case OPCODE_BNN: return cpu->neg_flag == FALSE;
+    }
+    return FALSE;
+}
 
-            case OPCODE_LOADP:
-            {
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                cpu->decode.rd_value = cpu->regs[cpu->decode.rd];
-                break;
-            }
+/*
+ * Fills in the record of the instruction at pc from code memory, fused with
+ * the conditional branch after it when fusion is on
+ */
+static void
+build_insn(const APEX_CPU *cpu, APEX_Dyn_Insn *insn, int pc)
+{
+    int index = get_code_memory_index_from_pc(pc);
+    const APEX_Instruction *current_ins = &cpu->code_memory[index];
+    int regs[2];
+    int n;
+
+    memset(insn, 0, sizeof(*insn));
+    insn->pc = pc;
+    insn->opcode_str = current_ins->opcode_str;
+    insn->opcode = current_ins->opcode;
+    insn->rd = current_ins->rd;
+    insn->rs1 = current_ins->rs1;
+    insn->rs2 = current_ins->rs2;
+    insn->imm = current_ins->imm;
+    insn->ready_cycle = -1;
+
+    /* Fuse a flag-setting insn with the conditional branch after it, so
+     * that the pair takes one slot through the pipeline */
+    if (CPU_FUSION(cpu) && is_fusible(insn->opcode)
+        && index + 1 < cpu->code_memory_size
+        && is_conditional_branch(current_ins[1].opcode))
+    {
+        insn->fused = TRUE;
+        insn->branch_opcode = current_ins[1].opcode;
+        insn->branch_str = current_ins[1].opcode_str;
+        insn->branch_imm = current_ins[1].imm;
+    }
 
-            case OPCODE_MOVC:
-            {
-                /* MOVC doesn't have register operands */
-                break;
-            }
+    n = get_source_regs(insn, regs);
+    insn->src_mask = reg_mask(regs, n);
+    n = get_dest_regs(insn, regs);
+    insn->dest_mask = reg_mask(regs, n);
+}
 
-            case OPCODE_CMP:
-            {
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                cpu->decode.rs2_value = cpu->regs[cpu->decode.rs2];
-                break;
-            }
+/*
+ * Takes the loop closed by a taken backward branch at branch_pc into the
+ * loop buffer, unless it is too long or already there
+ */
+static void
+capture_loop(APEX_CPU *cpu, int start_pc, int branch_pc)
+{
+    APEX_Loop_Buffer *lsd = &cpu->lsd;
+    int pc, i;
 
-            case OPCODE_CML:
-            {
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                break;
-            }
+    if (start_pc < 4000 || (branch_pc - start_pc) % 4
+        || (branch_pc - start_pc) / 4 >= LOOP_BUFFER_SIZE
+        || (lsd->valid && lsd->start_pc == start_pc
+            && lsd->end_pc == branch_pc))
+    {
+        return;
+    }
 
-            case OPCODE_JUMP:
-            {
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                break;
-            }
+    for (pc = start_pc, i = 0; pc <= branch_pc; pc += 4, ++i)
+    {
+        build_insn(cpu, &lsd->insn[i], pc);
 
-            case OPCODE_JALR:
-            {
-                cpu->decode.rs1_value = cpu->regs[cpu->decode.rs1];
-                cpu->decode.rd_value = cpu->regs[cpu->decode.rd];
-                break;
-            }
+        /* The loop branch, on its own or fused, goes back to the start */
+        if (pc + 4 * lsd->insn[i].fused == branch_pc)
+        {
+            lsd->insn[i].pred_taken = TRUE;
         }
+    }
 
-        if(check_op_queue_entry(cpu) && check_phys_reg_free(cpu)){
-            OpQueueEntry* opqf = malloc(sizeof(*opqf));
-
-            add_op_queue_entry(cpu,opqf);
+    lsd->valid = TRUE;
+    lsd->start_pc = start_pc;
+    lsd->end_pc = branch_pc;
+    cpu->stats.loops_captured++;
+}
 
-            cpu->decode.has_insn = FALSE;
-        }
-        else{
-            cpu->stall;
-        }
+/* Flushes decode and restarts fetch at pc */
+static void
+redirect_fetch(APEX_CPU *cpu, int pc)
+{
+    cpu->pc = pc;
 
-        /* Copy data from decode latch to execute latch*/
-        cpu->execute = cpu->decode;
-        cpu->decode.has_insn = FALSE;
+    /* Since we are using reverse callbacks for pipeline stages,
+     * this will prevent the new instruction from being fetched in the current cycle*/
+    cpu->fetch_from_next_cycle = TRUE;
 
-        if (ENABLE_DEBUG_MESSAGES)
-        {
-            print_stage_content("Decode/RF", &cpu->decode);
-        }
+    /* Flush previous stages. Nothing younger has left decode, so nothing
+     * else holds speculative state to restore */
+    if (cpu->decode)
+    {
+        cpu->stats.flushed_insns += 1 + cpu->decode->fused;
     }
+    flush_latch(cpu, &cpu->decode);
+
+    /* Make sure fetch stage is enabled to start fetching from new PC */
+    cpu->fetch_enabled = TRUE;
 }
 
 /*
- * Execute Stage of APEX Pipeline
- *
- * Note: You are free to edit this function according to your implementation
+ * Resolves the conditional branch at branch_pc. Fetch is redirected when
+ * the outcome differs from the way fetch went on: to the next instruction,
+ * or to the target for the loop branch of the loop buffer.
  */
 static void
-APEX_execute(APEX_CPU *cpu)
+resolve_branch(APEX_CPU *cpu, const APEX_Dyn_Insn *insn, int branch_pc,
+               int imm, int taken)
 {
-    if (cpu->execute.has_insn)
+    cpu->stats.branches++;
+    if (taken && imm < 0 && CPU_LOOP_BUFFER(cpu))
     {
-        /* Execute logic based on instruction type */
-        switch (cpu->execute.opcode)
-        {
-            case OPCODE_ADD:
-            {
-                cpu->execute.result_buffer
-                    = cpu->execute.rs1_value + cpu->execute.rs2_value;
+        capture_loop(cpu, branch_pc + imm, branch_pc);
+    }
 
-                /* Set the zero flag based on the result buffer */
-                if (cpu->execute.result_buffer == 0)
-                {
-                    cpu->zero_flag = TRUE;
-                } 
-                else 
-                {
-                    cpu->zero_flag = FALSE;
-                }
-                break;
-            }
+    if (taken == insn->pred_taken)
+    {
+        return;
+    }
 
-            case OPCODE_ADDL:
+    if (insn->pred_taken)
+    {
+        cpu->stats.loop_exits++;
+    }
+    cpu->stats.branch_redirects++;
+    redirect_fetch(cpu, taken ? branch_pc + imm : branch_pc + 4);
+}
+
+/*
+ * Data memory accesses go to the shared memory of the system when the CPU
+ * is one of its cores. Both return the latency of the access in cycles.
+ */
+static int
+read_data_memory(APEX_CPU *cpu, int address, int *value)
+{
+    cpu->energy.count[ENERGY_DATA_MEMORY]++;
+    if (cpu->system)
+    {
+        return system_access(cpu->system, cpu->core_id, address, FALSE, value);
+    }
+    *value = memory_read(&cpu->data_memory, address);
+    return CPU_MEM_LATENCY(cpu);
+}
+
+static int
+write_data_memory(APEX_CPU *cpu, int address, int value)
+{
+    cpu->energy.count[ENERGY_DATA_MEMORY]++;
+    if (cpu->system)
+    {
+        return system_access(cpu->system, cpu->core_id, address, TRUE, &value);
+    }
+    memory_write(&cpu->data_memory, address, value);
+    return CPU_MEM_LATENCY(cpu);
+}
+
+/*
+ * Stops the simulation if the address of the load or store in memory is
+ * at or above the limit of data memory. Returns TRUE if it did.
+ */
+static int
+data_address_trap(APEX_CPU *cpu)
+{
+    const APEX_Memory *mem
+        = cpu->system ? &cpu->system->memory : &cpu->data_memory;
+
+    if (memory_valid(mem, cpu->memory->memory_address))
+    {
+        return FALSE;
+    }
+
+    printf("APEX_CPU: Data memory access out of bounds, pc(%d) address = %d\n",
+           cpu->memory->pc, cpu->memory->memory_address);
+    cpu->stopped = TRUE;
+    return TRUE;
+}
+
+/*
+ * Lets the load in execute read memory while the store ahead of it is still
+ * busy in memory, as if the store waited in a store buffer. The store's
+ * address is known by then, so the load is held only when it names the same
+ * address; there are no false dependences and no order violations to
+ * recover from. A load to an invalid address is left for memory to report.
+ */
+static void
+bypass_store(APEX_CPU *cpu, APEX_Dyn_Insn *insn)
+{
+    const APEX_Dyn_Insn *store = cpu->memory;
+    const APEX_Memory *mem
+        = cpu->system ? &cpu->system->memory : &cpu->data_memory;
+    int latency;
+
+    if ((insn->opcode != OPCODE_LOAD && insn->opcode != OPCODE_LOADP)
+        || (store->opcode != OPCODE_STORE && store->opcode != OPCODE_STOREP)
+        || cpu->clock >= store->ready_cycle)
+    {
+        return;
+    }
+
+    /* Threads have data memories of their own */
+    insn->bypass = -1;
+    if (insn->thread == store->thread
+        && insn->memory_address == store->memory_address)
+    {
+        cpu->stats.bypass_aliases++;
+        return;
+    }
+    if (!memory_valid(mem, insn->memory_address))
+    {
+        return;
+    }
+
+    latency = read_data_memory(cpu, insn->memory_address,
+                               &insn->result_buffer);
+    insn->bypass = TRUE;
+    insn->bypass_ready = cpu->clock + (latency > 1 ? latency : 1) - 1;
+    if (latency > 1)
+    {
+        event_queue_push(&cpu->events, insn->bypass_ready);
+    }
+    cpu->stats.loads_bypassed++;
+}
+
+/*
+ * Simultaneous multithreading. The CPU fields that APEX_Thread mirrors hold
+ * the state of one thread, cpu->thread, and the other threads wait in
+ * cpu->threads. Writeback, memory and execute switch to the thread of their
+ * instruction, decode to the thread it issues from and fetch to the thread
+ * its policy picks, so the stage code only ever sees one thread. Execute,
+ * memory and writeback are shared; between cycles thread 0 is in the CPU.
+ */
+static void
+smt_save(const APEX_CPU *cpu, APEX_Thread *thread)
+{
+    thread->pc = cpu->pc;
+    memcpy(thread->regs, cpu->regs, sizeof(thread->regs));
+    thread->code_memory = cpu->code_memory;
+    thread->code_memory_size = cpu->code_memory_size;
+    thread->data_memory = cpu->data_memory;
+    thread->register_status = cpu->register_status;
+    thread->zero_flag = cpu->zero_flag;
+    thread->pos_flag = cpu->pos_flag;
+    thread->neg_flag = cpu->neg_flag;
+    thread->cc = cpu->cc;
+    thread->fetch_enabled = cpu->fetch_enabled;
+    thread->fetch_from_next_cycle = cpu->fetch_from_next_cycle;
+    thread->decode = cpu->decode;
+}
+
+static void
+smt_load(APEX_CPU *cpu, const APEX_Thread *thread)
+{
+    cpu->pc = thread->pc;
+    memcpy(cpu->regs, thread->regs, sizeof(cpu->regs));
+    cpu->code_memory = thread->code_memory;
+    cpu->code_memory_size = thread->code_memory_size;
+    cpu->data_memory = thread->data_memory;
+    cpu->register_status = thread->register_status;
+    cpu->zero_flag = thread->zero_flag;
+    cpu->pos_flag = thread->pos_flag;
+    cpu->neg_flag = thread->neg_flag;
+    cpu->cc = thread->cc;
+    cpu->fetch_enabled = thread->fetch_enabled;
+    cpu->fetch_from_next_cycle = thread->fetch_from_next_cycle;
+    cpu->decode = thread->decode;
+}
+
+/* Puts the state of thread in the CPU fields */
+static void
+smt_switch(APEX_CPU *cpu, int thread)
+{
+    if (thread != cpu->thread)
+    {
+        smt_save(cpu, &cpu->threads[cpu->thread]);
+        smt_load(cpu, &cpu->threads[thread]);
+        cpu->thread = thread;
+    }
+}
+
+/* Switches to the thread of the insn a stage works on */
+static inline void
+smt_enter(APEX_CPU *cpu, const APEX_Dyn_Insn *insn)
+{
+    if (cpu->num_threads > 1 && insn)
+    {
+        smt_switch(cpu, insn->thread);
+    }
+}
+
+/* State of a thread that fetch and decode choose by, wherever it is */
+static APEX_Dyn_Insn *
+thread_decode(const APEX_CPU *cpu, int thread)
+{
+    return thread == cpu->thread ? cpu->decode : cpu->threads[thread].decode;
+}
+
+static const APEX_Reg_Status *
+thread_status(const APEX_CPU *cpu, int thread)
+{
+    return thread == cpu->thread ? &cpu->register_status
+                                 : &cpu->threads[thread].register_status;
+}
+
+/* Instructions of thread past decode, which ICOUNT fetches by */
+static int
+smt_in_flight(const APEX_CPU *cpu, int thread)
+{
+    return (cpu->execute && cpu->execute->thread == thread)
+           + (cpu->memory && cpu->memory->thread == thread)
+           + (cpu->writeback && cpu->writeback->thread == thread);
+}
+
+/*
+ * Switches to the thread fetch goes on with this cycle: the first one after
+ * the last thread fetched that has an empty decode latch, or of those, the
+ * one with the fewest instructions in flight for ICOUNT. A thread redirected
+ * this cycle sits it out, as a single thread does. Returns FALSE if no
+ * thread can fetch.
+ */
+static int
+smt_select_fetch(APEX_CPU *cpu)
+{
+    int i, t, count, best = -1, best_count = 0, stalled = FALSE;
+    int *enabled, *next_cycle;
+
+    for (i = 1; i <= cpu->num_threads; ++i)
+    {
+        t = (cpu->last_fetch + i) % cpu->num_threads;
+        enabled = t == cpu->thread ? &cpu->fetch_enabled
+                                   : &cpu->threads[t].fetch_enabled;
+        next_cycle = t == cpu->thread ? &cpu->fetch_from_next_cycle
+                                      : &cpu->threads[t].fetch_from_next_cycle;
+        if (!*enabled)
+        {
+            continue;
+        }
+        if (*next_cycle)
+        {
+            *next_cycle = FALSE;
+            continue;
+        }
+        if (thread_decode(cpu, t))
+        {
+            stalled = TRUE;
+            continue;
+        }
+
+        count = smt_in_flight(cpu, t);
+        if (best < 0
+            || (cpu->fetch_policy == SMT_FETCH_ICOUNT && count < best_count))
+        {
+            best = t;
+            best_count = count;
+        }
+    }
+
+    if (best < 0)
+    {
+        cpu->stats.fetch_stalls += stalled;
+        return FALSE;
+    }
+    smt_switch(cpu, best);
+    cpu->last_fetch = best;
+    return TRUE;
+}
+
+/*
+ * Switches to the thread decode issues from this cycle: the first one after
+ * the last thread issued whose instruction has its sources ready, or when
+ * none can issue, the first one holding an instruction, to stall it
+ */
+static void
+smt_select_decode(APEX_CPU *cpu)
+{
+    const APEX_Dyn_Insn *insn;
+    int i, t, waiting = -1;
+
+    for (i = 1; i <= cpu->num_threads; ++i)
+    {
+        t = (cpu->last_issue + i) % cpu->num_threads;
+        insn = thread_decode(cpu, t);
+        if (!insn)
+        {
+            continue;
+        }
+        if (!cpu->execute && !sources_busy(thread_status(cpu, t), insn))
+        {
+            smt_switch(cpu, t);
+            cpu->last_issue = t;
+            return;
+        }
+        if (waiting < 0)
+        {
+            waiting = t;
+        }
+    }
+
+    if (waiting >= 0)
+    {
+        smt_switch(cpu, waiting);
+    }
+}
+
+/*
+ * Fetch Stage of APEX Pipeline
+ *
+ * Note: You are free to edit this function according to your implementation
+ */
+static void
+APEX_fetch(APEX_CPU *cpu)
+{
+    APEX_Dyn_Insn *insn;
+
+    if (cpu->num_threads > 1 && !smt_select_fetch(cpu))
+    {
+        return;
+    }
+
+    if (cpu->fetch_enabled)
+    {
+        /* This fetches new branch target instruction from next cycle */
+        if (cpu->fetch_from_next_cycle == TRUE)
+        {
+            cpu->fetch_from_next_cycle = FALSE;
+
+            /* Skip this cycle*/
+            return;
+        }
+
+        /* Decode is still occupied, hold the PC */
+        if (cpu->decode)
+        {
+            cpu->stats.fetch_stalls++;
+            return;
+        }
+
+        insn = slab_alloc(&cpu->insn_pool);
+        if (!insn)
+        {
+            fprintf(stderr, "APEX_CPU: Unable to allocate an instruction record\n");
+            cpu->stopped = TRUE;
+            return;
+        }
+
+        /* A loop held by the loop buffer comes ready-built, anything else is
+         * read from code memory */
+        if (cpu->lsd.valid && cpu->pc >= cpu->lsd.start_pc
+            && cpu->pc <= cpu->lsd.end_pc)
+        {
+            *insn = cpu->lsd.insn[(cpu->pc - cpu->lsd.start_pc) / 4];
+            cpu->stats.loop_buffer_fetches++;
+            cpu->energy.count[ENERGY_LOOP_BUFFER]++;
+        }
+        else
+        {
+            build_insn(cpu, insn, cpu->pc);
+            cpu->energy.count[ENERGY_FETCH]++;
+        }
+        insn->seq = ++cpu->insn_seq;
+        insn->fetch_cycle = cpu->clock;
+        insn->thread = cpu->thread;
+
+        /* Update PC for next instruction, back to the start of the loop
+         * after the loop branch */
+        if (insn->pred_taken)
+        {
+            cpu->pc = cpu->lsd.start_pc;
+        }
+        else
+        {
+            cpu->pc += insn->fused ? 8 : 4;
+        }
+
+        if (ENABLE_DEBUG_MESSAGES)
+        {
+            print_stage_content("Fetch", insn);
+        }
+
+        /* Stop fetching new instructions if HALT is fetched */
+        if (insn->opcode == OPCODE_HALT)
+        {
+            cpu->fetch_enabled = FALSE;
+        }
+
+        /* NOPs end here, everything else is passed on to decode */
+        if (insn->opcode == OPCODE_NOP)
+        {
+            slab_free(&cpu->insn_pool, insn);
+        }
+        else
+        {
+            cpu->decode = insn;
+            cpu->energy.count[ENERGY_LATCH]++;
+        }
+    }
+}
+
+/*
+ * Predicts the value a load leaving decode will return, so that dependents
+ * can read it instead of waiting for its writeback. All older instructions
+ * have executed and no younger one has, so the flags are saved here for a
+ * squash to restore.
+ */
+static void
+predict_load(APEX_CPU *cpu, APEX_Dyn_Insn *insn)
+{
+    APEX_Reg_Status *status = &cpu->register_status;
+
+    if ((insn->opcode != OPCODE_LOAD && insn->opcode != OPCODE_LOADP)
+        || !vpred_lookup(&cpu->vpred, CPU_VALUE_PREDICT(cpu), insn->pc,
+                         &insn->vp_value))
+    {
+        return;
+    }
+
+    insn->vp_predicted = TRUE;
+    insn->vp_flags[0] = cpu->zero_flag;
+    insn->vp_flags[1] = cpu->pos_flag;
+    insn->vp_flags[2] = cpu->neg_flag;
+    status->predicted |= (APEX_Mask)1 << insn->rd;
+    status->pred_value[insn->rd] = insn->vp_value;
+    status->pred_load[insn->rd] = insn;
+    cpu->stats.vp_predicted++;
+}
+
+/* Stops dependents from reading the predicted value of a load */
+static void
+drop_prediction(APEX_CPU *cpu, const APEX_Dyn_Insn *insn)
+{
+    APEX_Reg_Status *status = &cpu->register_status;
+
+    if (insn->vp_predicted && status->pred_load[insn->rd] == insn)
+    {
+        status->predicted &= ~((APEX_Mask)1 << insn->rd);
+    }
+}
+
+/*
+ * Squashes the instructions younger than a load whose wrong predicted value
+ * was used and replays them from the instruction after it. A load returns
+ * its value in memory before any younger instruction can leave execute, so
+ * only execute and decode hold them, and the flags are the only state they
+ * may have changed.
+ */
+static void
+squash_after_load(APEX_CPU *cpu, const APEX_Dyn_Insn *load)
+{
+    APEX_Dyn_Insn *insn = cpu->execute;
+
+    /* With SMT, execute may hold another thread's instruction */
+    if (insn && insn->thread == load->thread)
+    {
+        drop_prediction(cpu, insn);
+        update_dest_status(cpu, insn, -1);
+        cpu->stats.vp_squashed_insns += 1 + insn->fused;
+        flush_latch(cpu, &cpu->execute);
+    }
+    if (cpu->decode)
+    {
+        cpu->stats.vp_squashed_insns += 1 + cpu->decode->fused;
+    }
+
+    cpu->zero_flag = load->vp_flags[0];
+    cpu->pos_flag = load->vp_flags[1];
+    cpu->neg_flag = load->vp_flags[2];
+    cpu->stats.vp_squashes++;
+    redirect_fetch(cpu, load->pc + 4);
+}
+
+/*
+ * Trains the value predictor with the value a load returned and checks its
+ * prediction, squashing the dependents that read a wrong one
+ */
+static void
+verify_load(APEX_CPU *cpu, APEX_Dyn_Insn *insn)
+{
+    cpu->stats.vp_loads++;
+    vpred_train(&cpu->vpred, CPU_VALUE_PREDICT(cpu), insn->pc,
+                insn->result_buffer);
+    if (!insn->vp_predicted)
+    {
+        return;
+    }
+
+    cpu->stats.vp_used += insn->vp_used;
+    if (insn->vp_value == insn->result_buffer)
+    {
+        cpu->stats.vp_correct++;
+        return;
+    }
+
+    /* Dependents wait for the writeback from now on */
+    drop_prediction(cpu, insn);
+    if (insn->vp_used)
+    {
+        squash_after_load(cpu, insn);
+    }
+}
+
+/*
+ * Decode Stage of APEX Pipeline
+ *
+ * Note: You are free to edit this function according to your implementation
+ */
+static void
+APEX_decode(APEX_CPU *cpu)
+{
+    APEX_Dyn_Insn *insn;
+
+    if (cpu->num_threads > 1)
+    {
+        smt_select_decode(cpu);
+    }
+
+    insn = cpu->decode;
+    if (insn)
+    {
+        /* Stall until every source register has been written back and
+         * execute is free of a multi-cycle operation */
+        if (has_pending_source(cpu, insn) || cpu->execute)
+        {
+            insn->stall = TRUE;
+            cpu->stats.decode_stalls++;
+
+            if (ENABLE_DEBUG_MESSAGES)
             {
-                cpu->execute.result_buffer = cpu->execute.rs1_value + cpu->execute.imm;
-                /* Set the zero flag based on the result buffer */
-                if (cpu->execute.result_buffer == 0)
-                {
-                    cpu->zero_flag = TRUE;
-                } 
-                else 
-                {
-                    cpu->zero_flag = FALSE;
-                }
-                break;
+                print_stage_content("Decode/RF", insn);
             }
-            
+            return;
+        }
+        insn->stall = FALSE;
+
+        /* Read operands from register file based on the instruction type */
+        switch (insn->opcode)
+        {
+            case OPCODE_ADD:
             case OPCODE_SUB:
+            case OPCODE_MUL:
+            case OPCODE_DIV:
+            case OPCODE_OR:
+            case OPCODE_XOR:
+            case OPCODE_AND:
+            case OPCODE_CMP:
+            case OPCODE_STORE:
+            case OPCODE_STOREP:
             {
-                cpu->execute.result_buffer
-                    = cpu->execute.rs1_value - cpu->execute.rs2_value;
-
-                /* Set the zero flag based on the result buffer */
-                if (cpu->execute.result_buffer == 0)
-                {
-                    cpu->zero_flag = TRUE;
-                } 
-                else 
-                {
-                    cpu->zero_flag = FALSE;
-                }
+                insn->rs1_value = read_source(cpu, insn->rs1);
+                insn->rs2_value = read_source(cpu, insn->rs2);
                 break;
             }
 
+            case OPCODE_ADDL:
             case OPCODE_SUBL:
+            case OPCODE_LOAD:
+            case OPCODE_LOADP:
+            case OPCODE_CML:
+            case OPCODE_JUMP:
+            case OPCODE_JALR:
             {
-                cpu->execute.result_buffer
-                    = cpu->execute.rs1_value - cpu->execute.imm;
-                    
-                /* Set the zero flag based on the result buffer */
-                if (cpu->execute.result_buffer == 0)
-                {
-                    cpu->zero_flag = TRUE;
-                } 
-                else 
-                {
-                    cpu->zero_flag = FALSE;
-                }
+                insn->rs1_value = read_source(cpu, insn->rs1);
                 break;
             }
 
-            case OPCODE_MUL:
+            case OPCODE_MOVC:
             {
-                cpu->execute.result_buffer
-                    = cpu->execute.rs1_value - cpu->execute.rs2_value;
+                /* MOVC doesn't have register operands */
                 break;
             }
+        }
 
-            case OPCODE_LOAD:
+
+        /* Destinations are busy until this instruction writes them back */
+        update_dest_status(cpu, insn, 1);
+        if (CPU_VALUE_PREDICT(cpu))
+        {
+            predict_load(cpu, insn);
+        }
+
+        /* Pass the instruction on to execute */
+        insn->ready_cycle = -1;
+        insn->execute_cycle = cpu->clock + 1;
+        cpu->execute = insn;
+        cpu->decode = NULL;
+        cpu->energy.count[ENERGY_LATCH]++;
+
+        if (ENABLE_DEBUG_MESSAGES)
+        {
+            print_stage_content("Decode/RF", insn);
+        }
+    }
+}
+
+/*
+ * Execute Stage of APEX Pipeline
+ *
+ * Note: You are free to edit this function according to your implementation
+ */
+static void
+APEX_execute(APEX_CPU *cpu)
+{
+    APEX_Dyn_Insn *insn = cpu->execute;
+
+    smt_enter(cpu, insn);
+
+    /* The operation is performed in the first cycle, later cycles only
+     * model its latency */
+    if (insn && insn->ready_cycle < 0)
+    {
+        /* Execute logic based on instruction type */
+        switch (insn->opcode)
+        {
+            case OPCODE_ADD:
             {
-                cpu->execute.memory_address = cpu->execute.rs1_value + cpu->execute.imm;
-                printf("%d",cpu->execute.memory_address);
+                insn->result_buffer
+                    = ref_add(insn->rs1_value, insn->rs2_value);
+                set_condition_flags(cpu, insn->result_buffer, 0);
                 break;
             }
 
-            case OPCODE_LOADP:
+            case OPCODE_ADDL:
             {
-                /* Calculate the memory address by adding rs1_value and rs2_value */
-                cpu->execute.memory_address = cpu->execute.rs1_value + cpu->execute.imm;
-                cpu->execute.rd = cpu->execute.rd_value + 4 ;
+                insn->result_buffer = ref_add(insn->rs1_value, insn->imm);
+                set_condition_flags(cpu, insn->result_buffer, 0);
                 break;
             }
             
-            case OPCODE_STORE:
+            case OPCODE_SUB:
             {
-                cpu->execute.memory_address = cpu->execute.rs1_value + cpu->execute.imm;
-                cpu->execute.result_buffer = cpu->execute.rs2_value;
-                printf("%d",cpu->execute.result_buffer);
-                printf("%d",cpu->execute.memory_address);
+                insn->result_buffer
+                    = ref_sub(insn->rs1_value, insn->rs2_value);
+                set_condition_flags(cpu, insn->result_buffer, 0);
                 break;
             }
 
-            case OPCODE_STOREP:
+            case OPCODE_SUBL:
             {
-                cpu->execute.memory_address = cpu->execute.rs1_value + cpu->execute.imm;
-                cpu->execute.result_buffer = cpu->execute.rs2_value;
-                // printf("%d",cpu->execute.result_buffer);
-                // printf("%d",cpu->execute.memory_address);
+                insn->result_buffer
+                    = ref_sub(insn->rs1_value, insn->imm);
+                set_condition_flags(cpu, insn->result_buffer, 0);
                 break;
             }
 
-            case OPCODE_JUMP:
+            case OPCODE_MUL:
             {
-                cpu->execute.result_buffer = cpu->execute.rs1_value + cpu->execute.imm;
-
-                cpu->pc = cpu->execute.result_buffer;
-
-                cpu->fetch_from_next_cycle = TRUE;
-
-                cpu->decode.has_insn = FALSE;
-
-                cpu->fetch.has_insn = TRUE;
-
+                insn->result_buffer
+                    = ref_mul(insn->rs1_value, insn->rs2_value);
+                set_condition_flags(cpu, insn->result_buffer, 0);
                 break;
             }
 
-            case OPCODE_JALR: 
+            case OPCODE_DIV:
             {
-                cpu->execute.result_buffer = cpu->execute.rs1_value + cpu->execute.imm;
-
-                cpu->pc = cpu->execute.result_buffer;
-
-                cpu->regs[cpu->execute.rd_value] = cpu->execute.pc + 4;
-
-                cpu->fetch_from_next_cycle = TRUE;
-
-                cpu->decode.has_insn = FALSE;
-
-                cpu->fetch.has_insn = TRUE;
-
+                /* Division by zero produces 0, INT_MIN / -1 INT_MIN */
+                insn->result_buffer = ref_div(insn->rs1_value, insn->rs2_value);
+                set_condition_flags(cpu, insn->result_buffer, 0);
                 break;
             }
 
-
-            case OPCODE_BZ:
+            case OPCODE_LOAD:
             {
-                if (cpu->zero_flag == TRUE)
-                {
-                    /* Calculate new PC, and send it to fetch unit */
-                    cpu->pc = cpu->execute.pc + cpu->execute.imm;
-                    
-                    /* Since we are using reverse callbacks for pipeline stages, 
-                     * this will prevent the new instruction from being fetched in the current cycle*/
-                    cpu->fetch_from_next_cycle = TRUE;
-
-                    /* Flush previous stages */
-                    cpu->decode.has_insn = FALSE;
-
-                    /* Make sure fetch stage is enabled to start fetching from new PC */
-                    cpu->fetch.has_insn = TRUE;
-                }
+                insn->memory_address = ref_add(insn->rs1_value, insn->imm);
                 break;
             }
 
-            case OPCODE_BNZ:
+            case OPCODE_LOADP:
             {
-                if (cpu->zero_flag == FALSE)
-                {
-                    /* Calculate new PC, and send it to fetch unit */
-                    cpu->pc = cpu->execute.pc + cpu->execute.imm;
-                    
-                    /* Since we are using reverse callbacks for pipeline stages, 
-                     * this will prevent the new instruction from being fetched in the current cycle*/
-                    cpu->fetch_from_next_cycle = TRUE;
-
-                    /* Flush previous stages */
-                    cpu->decode.has_insn = FALSE;
-
-                    /* Make sure fetch stage is enabled to start fetching from new PC */
-                    cpu->fetch.has_insn = TRUE;
-                }
+                /* Calculate the memory address by adding rs1_value and rs2_value */
+                insn->memory_address = ref_add(insn->rs1_value, insn->imm);
+
+                /* Base register is post-incremented */
+                insn->ptr_value = ref_add(insn->rs1_value, 4);
+                break;
+            }
+            
+            case OPCODE_STORE:
+            {
+                /* rs1 holds the data, rs2 the base address */
+                insn->memory_address = ref_add(insn->rs2_value, insn->imm);
+                insn->data_of_store = insn->rs1_value;
                 break;
             }
 
-            case OPCODE_BP:
+            case OPCODE_STOREP:
             {
-                if (cpu->pos_flag == TRUE)
-                {
-                    /* Calculate new PC, and send it to fetch unit */
-                    cpu->pc = cpu->execute.pc + cpu->execute.imm;
-                    
-                    /* Since we are using reverse callbacks for pipeline stages, 
-                     * this will prevent the new instruction from being fetched in the current cycle*/
-                    cpu->fetch_from_next_cycle = TRUE;
-
-                    /* Flush previous stages */
-                    cpu->decode.has_insn = FALSE;
-
-                    /* Make sure fetch stage is enabled to start fetching from new PC */
-                    cpu->fetch.has_insn = TRUE;
-                }
+                insn->memory_address = ref_add(insn->rs2_value, insn->imm);
+                insn->data_of_store = insn->rs1_value;
+
+                /* Base register is post-incremented */
+                insn->ptr_value = ref_add(insn->rs2_value, 4);
                 break;
             }
 
-            case OPCODE_BNP:
+            case OPCODE_JUMP:
             {
-                if (cpu->pos_flag == FALSE)
-                {
-                    /* Calculate new PC, and send it to fetch unit */
-                    cpu->pc = cpu->execute.pc + cpu->execute.imm;
-                    
-                    /* Since we are using reverse callbacks for pipeline stages, 
-                     * this will prevent the new instruction from being fetched in the current cycle*/
-                    cpu->fetch_from_next_cycle = TRUE;
-
-                    /* Flush previous stages */
-                    cpu->decode.has_insn = FALSE;
-
-                    /* Make sure fetch stage is enabled to start fetching from new PC */
-                    cpu->fetch.has_insn = TRUE;
-                }
+                insn->result_buffer = ref_add(insn->rs1_value, insn->imm);
+                cpu->stats.jump_redirects++;
+                redirect_fetch(cpu, insn->result_buffer);
                 break;
             }
 
-            case OPCODE_BN:
+            case OPCODE_JALR: 
             {
-                if (cpu->neg_flag == TRUE)
-                {
-                    /* Calculate new PC, and send it to fetch unit */
-                    cpu->pc = cpu->execute.pc + cpu->execute.imm;
-                    
-                    /* Since we are using reverse callbacks for pipeline stages, 
-                     * this will prevent the new instruction from being fetched in the current cycle*/
-                    cpu->fetch_from_next_cycle = TRUE;
-
-                    /* Flush previous stages */
-                    cpu->decode.has_insn = FALSE;
-
-                    /* Make sure fetch stage is enabled to start fetching from new PC */
-                    cpu->fetch.has_insn = TRUE;
-                }
+                /* Return address is written to rd in writeback */
+                insn->result_buffer = insn->pc + 4;
+                cpu->stats.jump_redirects++;
+                redirect_fetch(cpu, ref_add(insn->rs1_value, insn->imm));
                 break;
             }
 
+            case OPCODE_BZ:
+            case OPCODE_BNZ:
+            case OPCODE_BP:
+            case OPCODE_BNP:
+            case OPCODE_BN:
             case OPCODE_BNN:
             {
-                if (cpu->neg_flag == FALSE)
-                {
-                    /* Calculate new PC, and send it to fetch unit */
-                    cpu->pc = cpu->execute.pc + cpu->execute.imm;
-                    
-                    /* Since we are using reverse callbacks for pipeline stages, 
-                     * this will prevent the new instruction from being fetched in the current cycle*/
-                    cpu->fetch_from_next_cycle = TRUE;
-
-                    /* Flush previous stages */
-                    cpu->decode.has_insn = FALSE;
-
-                    /* Make sure fetch stage is enabled to start fetching from new PC */
-                    cpu->fetch.has_insn = TRUE;
-                }
+                resolve_branch(cpu, insn, insn->pc, insn->imm,
+                               branch_taken(cpu, insn->opcode));
                 break;
             }
 
             case OPCODE_CMP:
             {
-                if (cpu->execute.rs1_value == cpu->execute.rs2_value)
-                {
-                    cpu->zero_flag = TRUE;
-                    cpu->neg_flag = FALSE;
-                    cpu->pos_flag = FALSE;
-                }
-
-                else if (cpu->execute.rs1_value < cpu->execute.rs2_value)
-                {
-                    cpu->zero_flag = FALSE;
-                    cpu->neg_flag = TRUE;
-                    cpu->pos_flag = FALSE;
-                }
-
-                else
-                {
-                    cpu->zero_flag = FALSE;
-                    cpu->neg_flag = FALSE;
-                    cpu->pos_flag = TRUE;
-                }
+                set_condition_flags(cpu, insn->rs1_value,
+                                    insn->rs2_value);
+                break;
             }
 
             case OPCODE_CML:
             {
-                if (cpu->execute.rs1_value == cpu->execute.imm)
-                {
-                    cpu->zero_flag = TRUE;
-                    cpu->neg_flag = FALSE;
-                    cpu->pos_flag = FALSE;
-                }
-
-                else if (cpu->execute.rs1_value < cpu->execute.imm)
-                {
-                    cpu->zero_flag = FALSE;
-                    cpu->neg_flag = TRUE;
-                    cpu->pos_flag = FALSE;
-                }
-
-                else
-                {
-                    cpu->zero_flag = FALSE;
-                    cpu->neg_flag = FALSE;
-                    cpu->pos_flag = TRUE;
-                }
+                set_condition_flags(cpu, insn->rs1_value,
+                                    insn->imm);
+                break;
             }
 
             case OPCODE_MOVC: 
             {
-                cpu->execute.result_buffer = cpu->execute.imm;
-
-                /* Set the zero flag based on the result buffer */
-                if (cpu->execute.result_buffer == 0)
-                {
-                    cpu->zero_flag = TRUE;
-                } 
-                else 
-                {
-                    cpu->zero_flag = FALSE;
-                }
+                insn->result_buffer = insn->imm;
+                set_condition_flags(cpu, insn->result_buffer, 0);
                 break;
             }
 
             case OPCODE_OR:
             {
-                cpu->execute.result_buffer = cpu->execute.rs1_value | cpu->execute.rs2_value;
+                insn->result_buffer = insn->rs1_value | insn->rs2_value;
+                set_condition_flags(cpu, insn->result_buffer, 0);
                 break;
             }
 
             case OPCODE_XOR:
             {
-                cpu->execute.result_buffer = cpu->execute.rs1_value ^ cpu->execute.rs2_value;
+                insn->result_buffer = insn->rs1_value ^ insn->rs2_value;
+                set_condition_flags(cpu, insn->result_buffer, 0);
                 break;
             }
 
             case OPCODE_AND:
             {
-                cpu->execute.result_buffer = cpu->execute.rs1_value & cpu->execute.rs2_value;
-
-                /* Set the zero flag based on the result buffer */
-                if (cpu->execute.result_buffer == 0)
-                {
-                    cpu->zero_flag = TRUE;
-                } 
-                else 
-                {
-                    cpu->zero_flag = FALSE;
-                }
+                insn->result_buffer = insn->rs1_value & insn->rs2_value;
+                set_condition_flags(cpu, insn->result_buffer, 0);
                 break;
             }
         }
 
-        /* Copy data from execute latch to memory latch*/
-        cpu->memory = cpu->execute;
-        cpu->execute.has_insn = FALSE;
+        /* The fused branch sits right after the insn and tests its flags */
+        if (insn->fused)
+        {
+            resolve_branch(cpu, insn, insn->pc + 4, insn->branch_imm,
+                           branch_taken(cpu, insn->branch_opcode));
+        }
+
+        if (insn->opcode == OPCODE_MUL || insn->opcode == OPCODE_DIV)
+        {
+            cpu->energy.count[ENERGY_MUL]++;
+        }
+        else if (insn->opcode != OPCODE_HALT)
+        {
+            cpu->energy.count[ENERGY_ALU]++;
+        }
+
+        start_stage(cpu, insn,
+                    insn->opcode == OPCODE_MUL ? CPU_MUL_LATENCY(cpu) : 1);
+    }
+
+    if (insn)
+    {
+        if (CPU_LOAD_BYPASS(cpu) && cpu->memory && !insn->bypass
+            && cpu->clock >= insn->ready_cycle)
+        {
+            bypass_store(cpu, insn);
+        }
+
+        /* Hold the insn until its latency elapsed and memory is free */
+        if (cpu->clock < insn->ready_cycle || cpu->memory)
+        {
+            cpu->stats.execute_stalls++;
+
+            if (ENABLE_DEBUG_MESSAGES)
+            {
+                print_stage_content("Execute", insn);
+            }
+            return;
+        }
+
+        /* Pass the instruction on to memory */
+        insn->ready_cycle = -1;
+        insn->memory_cycle = cpu->clock + 1;
+        cpu->memory = insn;
+        cpu->execute = NULL;
+        cpu->energy.count[ENERGY_LATCH]++;
 
         if (ENABLE_DEBUG_MESSAGES)
         {
-            print_stage_content("Execute", &cpu->execute);
+            print_stage_content("Execute", insn);
         }
     }
 }
@@ -903,9 +1363,16 @@ APEX_execute(APEX_CPU *cpu)
 static void
 APEX_memory(APEX_CPU *cpu)
 {
-    if (cpu->memory.has_insn)
+    APEX_Dyn_Insn *insn = cpu->memory;
+    int latency = 1;
+
+    smt_enter(cpu, insn);
+
+    /* The access is performed in the first cycle, later cycles only model
+     * its latency */
+    if (insn && insn->ready_cycle < 0)
     {
-        switch (cpu->memory.opcode)
+        switch (insn->opcode)
         {
             case OPCODE_ADD:
             {
@@ -914,49 +1381,117 @@ APEX_memory(APEX_CPU *cpu)
             }
 
             case OPCODE_LOAD:
-            {
-                /* Read from data memory */
-                cpu->memory.result_buffer
-                    = cpu->data_memory[cpu->memory.memory_address];
-                printf("%d",cpu->memory.result_buffer);
-                break;
-            }
             case OPCODE_LOADP:
             {
+                if (insn->bypass > 0)
+                {
+                    /* Read in execute, only the rest of its latency is left */
+                    latency = insn->bypass_ready - cpu->clock + 1;
+                    break;
+                }
+
+                if (data_address_trap(cpu))
+                {
+                    return;
+                }
+
                 /* Read from data memory */
-                cpu->memory.result_buffer
-                    = cpu->data_memory[cpu->memory.memory_address];
-                // printf("%d",cpu->memory.result_buffer);
+                latency = read_data_memory(cpu, insn->memory_address,
+                                           &insn->result_buffer);
                 break;
             }
 
             case OPCODE_STORE:
+            case OPCODE_STOREP:
             {
+                if (data_address_trap(cpu))
+                {
+                    return;
+                }
+
                 /* Write to data memory */
-                cpu->data_memory[cpu->memory.memory_address] = cpu->memory.result_buffer;
+                latency = write_data_memory(cpu, insn->memory_address,
+                                            insn->data_of_store);
                 break;
             }
+        }
 
-            case OPCODE_STOREP:
-            {
-                int data_to_store = cpu->memory.result_buffer;
+        start_stage(cpu, insn, latency);
+    }
 
-                cpu->data_memory[cpu->memory.memory_address] = data_to_store;
-                break;
-            }
+    if (insn)
+    {
+        if (cpu->clock < insn->ready_cycle)
+        {
+            cpu->stats.memory_stalls++;
 
+            if (ENABLE_DEBUG_MESSAGES)
+            {
+                print_stage_content("Memory", insn);
+            }
+            return;
+        }
 
+        if (CPU_VALUE_PREDICT(cpu)
+            && (insn->opcode == OPCODE_LOAD || insn->opcode == OPCODE_LOADP))
+        {
+            verify_load(cpu, insn);
         }
 
-        /* Copy data from memory latch to writeback latch*/
-        cpu->writeback = cpu->memory;
-        cpu->memory.has_insn = FALSE;
+        /* Pass the instruction on to writeback */
+        insn->writeback_cycle = cpu->clock + 1;
+        cpu->writeback = insn;
+        cpu->memory = NULL;
+        cpu->energy.count[ENERGY_LATCH]++;
 
         if (ENABLE_DEBUG_MESSAGES)
         {
-            print_stage_content("Memory", &cpu->memory);
+            print_stage_content("Memory", insn);
+        }
+    }
+}
+
+/*
+ * Describes the architectural effects of an instruction, or with branch set,
+ * of the conditional branch fused into it
+ */
+static void
+make_retire_record(const APEX_Dyn_Insn *insn, int branch, APEX_Retire *retire)
+{
+    int i;
+
+    memset(retire, 0, sizeof(*retire));
+    if (branch)
+    {
+        retire->pc = insn->pc + 4;
+        retire->opcode = insn->branch_opcode;
+        return;
+    }
+
+    retire->pc = insn->pc;
+    retire->opcode = insn->opcode;
+    retire->num_reg_writes = get_dest_regs(insn, retire->reg);
+
+    for (i = 0; i < retire->num_reg_writes; ++i)
+    {
+        /* LOADP and STOREP list their base register first */
+        if (i == 0 && (insn->opcode == OPCODE_LOADP
+                       || insn->opcode == OPCODE_STOREP))
+        {
+            retire->reg_value[i] = insn->ptr_value;
+        }
+        else
+        {
+            retire->reg_value[i] = insn->result_buffer;
         }
     }
+
+    if (insn->opcode == OPCODE_STORE || insn->opcode == OPCODE_STOREP)
+    {
+        retire->mem_write = TRUE;
+        retire->mem_address = insn->memory_address;
+        retire->mem_value = insn->data_of_store;
+    }
 }
 
 /*
@@ -967,82 +1502,150 @@ APEX_memory(APEX_CPU *cpu)
 static int
 APEX_writeback(APEX_CPU *cpu)
 {
-    if (cpu->writeback.has_insn)
+    APEX_Dyn_Insn *insn = cpu->writeback;
+    int part;
+
+    smt_enter(cpu, insn);
+    if (insn)
     {
         /* Write result to register file based on instruction type */
-        switch (cpu->writeback.opcode)
+        switch (insn->opcode)
         {
             case OPCODE_ADD:
             case OPCODE_ADDL:
             {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_buffer;
+                cpu->regs[insn->rd] = insn->result_buffer;
                 break;
             }
 
             case OPCODE_SUB:
             case OPCODE_SUBL:
             {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_buffer;
+                cpu->regs[insn->rd] = insn->result_buffer;
                 break;
             }
 
             case OPCODE_MUL:
+            case OPCODE_DIV:
             {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_buffer;
+                cpu->regs[insn->rd] = insn->result_buffer;
                 break;
             }
 
             case OPCODE_LOAD:
             {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_buffer;
+                cpu->regs[insn->rd] = insn->result_buffer;
+                break;
+            }
+
+            case OPCODE_STOREP:
+            {
+                cpu->regs[insn->rs2] = insn->ptr_value;
                 break;
             }
 
             case OPCODE_LOADP:
             {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_buffer;
+                cpu->regs[insn->rs1] = insn->ptr_value;
+                cpu->regs[insn->rd] = insn->result_buffer;
                 break;
             }
 
             case OPCODE_MOVC: 
             {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_buffer;
-                break;
+                cpu->regs[insn->rd] = insn->result_buffer;
+                break;
+            }
+
+            case OPCODE_OR:
+            case OPCODE_XOR:
+            {
+                cpu->regs[insn->rd] = insn->result_buffer;
+                break;
+            }
+
+            case OPCODE_JALR:
+            {
+                cpu->regs[insn->rd] = insn->result_buffer;
+                break;
+            }
+
+            case OPCODE_AND:
+            {
+                cpu->regs[insn->rd] = insn->result_buffer;
+                break;
+            }
+        }
+
+        /* Destinations can now be read by younger instructions */
+        update_dest_status(cpu, insn, -1);
+        /* There are at most two, LOADP writes its base register too */
+        cpu->energy.count[ENERGY_REG_WRITE]
+            += (insn->dest_mask != 0)
+               + ((insn->dest_mask & (insn->dest_mask - 1)) != 0);
+
+        /* A fused pair retires as its two instructions, the branch second */
+        for (part = 0; part <= insn->fused; ++part)
+        {
+            if (cpu->cosim)
+            {
+                APEX_Retire retire;
+
+                make_retire_record(insn, part, &retire);
+                if (cosim_check(cpu->cosim, cpu, &retire))
+                {
+                    /* Stop at the first divergence */
+                    flush_latch(cpu, &cpu->writeback);
+                    cpu->stopped = TRUE;
+                    return TRUE;
+                }
             }
 
-            case OPCODE_OR:
-            case OPCODE_XOR:
+            cpu->insn_completed++;
+            cpu->threads[cpu->thread].insn_completed++;
+            cpu->retired_pc = insn->pc + 4 * part;
+            if (cpu->retired_pc == cpu->target_pc)
             {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_buffer;
-                break;
+                /* Both parts of a fused pair retire in this cycle */
+                cpu->target_hit = TRUE;
             }
 
-            case OPCODE_JALR:
+            if (ENABLE_DEBUG_MESSAGES && part == 0)
             {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_buffer;
-                break;
+                print_stage_content("Writeback", insn);
             }
 
-            case OPCODE_AND:
+            if (cpu->retire_callback)
             {
-                cpu->regs[cpu->writeback.rd] = cpu->writeback.result_buffer;
-                break;
+                APEX_Retire retire;
+
+                make_retire_record(insn, part, &retire);
+                if (cpu->retire_callback(cpu, &retire, cpu->retire_callback_arg))
+                {
+                    cpu->stopped = TRUE;
+                }
             }
         }
+        cpu->writeback = NULL;
+        cpu->stats.fused_pairs += insn->fused;
 
-        cpu->insn_completed++;
-        cpu->writeback.has_insn = FALSE;
-
-        if (ENABLE_DEBUG_MESSAGES)
+        if (cpu->interval.bbv)
         {
-            print_stage_content("Writeback", &cpu->writeback);
+            /* A fused pair ends with its branch */
+            interval_retire(&cpu->interval, insn->pc, 1 + insn->fused,
+                            insn->fused || ends_block(insn->opcode));
         }
 
-        if (cpu->writeback.opcode == OPCODE_HALT)
+        if (insn->opcode == OPCODE_HALT)
         {
-            /* Stop the APEX simulator */
-            return TRUE;
+            /* Stop the APEX simulator once every thread has halted */
+            cpu->threads[cpu->thread].halted = TRUE;
+            cpu->halted = ++cpu->threads_halted == cpu->num_threads;
         }
+
+        slab_free(&cpu->insn_pool, insn);
+
+        return cpu->halted || cpu->stopped;
     }
 
     /* Default */
@@ -1050,17 +1653,255 @@ APEX_writeback(APEX_CPU *cpu)
 }
 
 /*
- * This function creates and initializes APEX cpu.
- *
- * Note: You are free to edit this function according to your implementation
+ * Runs one cycle of all pipeline stages while timing each of them. Returns
+ * TRUE when HALT retires, same as APEX_writeback.
+ */
+static int
+APEX_cpu_profiled_cycle(APEX_CPU *cpu)
+{
+    uint64_t stamps[PROF_NUM_STAGES + 1];
+
+    stamps[0] = profile_now_ns();
+    if (APEX_writeback(cpu))
+    {
+        stamps[1] = profile_now_ns();
+        profile_sample(&cpu->profile, cpu->clock, stamps, 1);
+        return TRUE;
+    }
+    stamps[1] = profile_now_ns();
+
+    APEX_memory(cpu);
+    stamps[2] = profile_now_ns();
+    APEX_execute(cpu);
+    stamps[3] = profile_now_ns();
+    APEX_decode(cpu);
+    stamps[4] = profile_now_ns();
+    APEX_fetch(cpu);
+    stamps[5] = profile_now_ns();
+
+    profile_sample(&cpu->profile, cpu->clock, stamps, PROF_NUM_STAGES);
+    return FALSE;
+}
+
+/*
+ * Returns TRUE if no stage can make progress this cycle, so that ticking it
+ * would only add to the stall counters. Mirrors the stall conditions of the
+ * stage functions.
+ */
+static int
+APEX_cpu_is_idle(const APEX_CPU *cpu)
+{
+    /* The threads not in the CPU are not looked at, so never skip with SMT */
+    if (cpu->writeback || cpu->num_threads > 1)
+    {
+        return FALSE;
+    }
+
+    if (cpu->memory && cpu->clock >= cpu->memory->ready_cycle)
+    {
+        return FALSE;
+    }
+
+    if (cpu->execute
+        && (cpu->execute->ready_cycle < 0
+            || (cpu->clock >= cpu->execute->ready_cycle
+                && !cpu->memory)))
+    {
+        return FALSE;
+    }
+
+    if (cpu->decode && !cpu->execute
+        && !has_pending_source(cpu, cpu->decode))
+    {
+        return FALSE;
+    }
+
+    if (cpu->fetch_enabled
+        && (cpu->fetch_from_next_cycle || !cpu->decode))
+    {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Accounts for idle cycles that are skipped, as if each of them had been
+ * ticked through the stage functions
+ */
+static void
+APEX_cpu_skip_idle_cycles(APEX_CPU *cpu, int cycles)
+{
+    if (cpu->fetch_enabled && cpu->decode)
+    {
+        cpu->stats.fetch_stalls += cycles;
+    }
+    if (cpu->decode)
+    {
+        cpu->stats.decode_stalls += cycles;
+    }
+    if (cpu->execute)
+    {
+        cpu->stats.execute_stalls += cycles;
+    }
+    if (cpu->memory)
+    {
+        cpu->stats.memory_stalls += cycles;
+    }
+
+    cpu->stats.skipped_cycles += cycles;
+    cpu->clock += cycles;
+
+    if (ENABLE_DEBUG_MESSAGES)
+    {
+        printf("APEX_CPU: Skipped %d idle cycles\n", cycles);
+    }
+}
+
+/*
+ * Jumps to the next completion when skip_idle is set and every stage is
+ * waiting on one, but never past limit (0 for none). Returns TRUE if cycles
+ * were skipped.
+ */
+static int
+APEX_cpu_skip_to_next_event(APEX_CPU *cpu, int limit)
+{
+    int next_event;
+
+    if (!CPU_SKIP_IDLE(cpu) || cpu->single_step || !APEX_cpu_is_idle(cpu))
+    {
+        return FALSE;
+    }
+
+    next_event = event_queue_next(&cpu->events, cpu->clock);
+    if (limit && next_event > limit)
+    {
+        next_event = limit;
+    }
+    if (next_event > cpu->clock)
+    {
+        APEX_cpu_skip_idle_cycles(cpu, next_event - cpu->clock);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * Host allocations of the data memories of all threads; the memory of the
+ * thread in the CPU is in cpu->data_memory, its saved copy is stale
+ */
+static uint64_t
+data_memory_allocations(const APEX_CPU *cpu)
+{
+    uint64_t allocations = cpu->data_memory.allocations;
+    int i;
+
+    for (i = 0; i < cpu->num_threads; ++i)
+    {
+        if (i != cpu->thread)
+        {
+            allocations += cpu->threads[i].data_memory.allocations;
+        }
+    }
+    return allocations;
+}
+
+/* Reports the instructions and IPC of each SMT thread */
+static void
+print_threads(const APEX_CPU *cpu)
+{
+    int i;
+
+    for (i = 0; i < cpu->num_threads; ++i)
+    {
+        printf("APEX_CPU: thread %d: instructions = %d IPC = %.4f%s\n", i,
+               cpu->threads[i].insn_completed,
+               cpu->clock ? (double)cpu->threads[i].insn_completed / cpu->clock
+                          : 0.0,
+               cpu->threads[i].halted ? "" : " (not halted)");
+    }
+    printf("APEX_CPU: %d threads (%s fetch): cycles = %d instructions = %d "
+           "IPC = %.4f\n",
+           cpu->num_threads,
+           cpu->fetch_policy == SMT_FETCH_ICOUNT ? "ICOUNT" : "round-robin",
+           cpu->clock, cpu->insn_completed,
+           cpu->clock ? (double)cpu->insn_completed / cpu->clock : 0.0);
+}
+
+static void
+print_stats(const APEX_CPU *cpu)
+{
+    printf("APEX_CPU: Stall cycles: fetch = %d decode = %d execute = %d memory = %d\n",
+           cpu->stats.fetch_stalls, cpu->stats.decode_stalls,
+           cpu->stats.execute_stalls, cpu->stats.memory_stalls);
+    if (CPU_SKIP_IDLE(cpu))
+    {
+        printf("APEX_CPU: Idle cycles skipped = %d\n",
+               cpu->stats.skipped_cycles);
+    }
+    if (CPU_FUSION(cpu))
+    {
+        printf("APEX_CPU: Fused pairs = %d (%.1f%% of instructions retired fused)\n",
+               cpu->stats.fused_pairs,
+               cpu->insn_completed
+                   ? 200.0 * cpu->stats.fused_pairs / cpu->insn_completed
+                   : 0.0);
+    }
+    if (CPU_LOOP_BUFFER(cpu))
+    {
+        printf("APEX_CPU: Loop buffer: loops captured = %d, fetch cycles supplied = %d (%.1f%% of fetches), exits redirected = %d\n",
+               cpu->stats.loops_captured, cpu->stats.loop_buffer_fetches,
+               cpu->insn_seq
+                   ? 100.0 * cpu->stats.loop_buffer_fetches / cpu->insn_seq
+                   : 0.0,
+               cpu->stats.loop_exits);
+    }
+    if (CPU_VALUE_PREDICT(cpu))
+    {
+        printf("APEX_CPU: Value prediction (%s): loads = %d, predicted = %d (%.1f%% coverage), "
+               "correct = %d (%.1f%% accuracy), used = %d, squashes = %d, "
+               "instructions squashed = %d\n",
+               vpred_kind_str(CPU_VALUE_PREDICT(cpu)), cpu->stats.vp_loads,
+               cpu->stats.vp_predicted,
+               cpu->stats.vp_loads
+                   ? 100.0 * cpu->stats.vp_predicted / cpu->stats.vp_loads
+                   : 0.0,
+               cpu->stats.vp_correct,
+               cpu->stats.vp_predicted
+                   ? 100.0 * cpu->stats.vp_correct / cpu->stats.vp_predicted
+                   : 0.0,
+               cpu->stats.vp_used, cpu->stats.vp_squashes,
+               cpu->stats.vp_squashed_insns);
+    }
+    if (CPU_LOAD_BYPASS(cpu))
+    {
+        printf("APEX_CPU: Load bypass: loads past a busy store = %d, "
+               "held by a store to their address = %d\n",
+               cpu->stats.loads_bypassed, cpu->stats.bypass_aliases);
+    }
+    printf("APEX_CPU: Branch recovery: branches = %d, redirected = %d, "
+           "jumps = %d, instructions flushed = %d\n",
+           cpu->stats.branches, cpu->stats.branch_redirects, cpu->stats.jump_redirects,
+           cpu->stats.flushed_insns);
+    printf("APEX_CPU: Host allocations: arena blocks = %llu, data memory = %llu "
+           "(%d during the run), pooled instructions = %d\n",
+           (unsigned long long)cpu->arena.allocations,
+           (unsigned long long)data_memory_allocations(cpu),
+           cpu->stats.run_allocations, cpu->insn_pool.capacity);
+}
+
+/*
+ * This function creates and initializes APEX cpu around an already built
+ * code memory. The CPU takes ownership of code_memory, which must come from
+ * malloc, and frees it in APEX_cpu_stop (also on failure).
  */
 APEX_CPU *
-APEX_cpu_init(const char *filename)
+APEX_cpu_init_from_code(APEX_Instruction *code_memory, int code_memory_size)
 {
     int i;
     APEX_CPU *cpu;
 
-    if (!filename)
+    if (!code_memory)
     {
         return NULL;
     }
@@ -1069,28 +1910,46 @@ APEX_cpu_init(const char *filename)
 
     if (!cpu)
     {
+        free(code_memory);
         return NULL;
     }
 
-    /* Initialize PC, Registers and all pipeline stages */
-    cpu->pc = 4000;
-    memset(cpu->regs, 0, sizeof(int) * REG_FILE_SIZE);
-    memset(cpu->data_memory, 0, sizeof(int) * DATA_MEMORY_SIZE);
-    cpu->single_step = ENABLE_SINGLE_STEP;
-
-    /* Parse input file and create code memory */
-    cpu->code_memory = create_code_memory(filename, &cpu->code_memory_size);
-    if (!cpu->code_memory)
+    /* Data memory starts empty, pages are allocated as they are written */
+    if (memory_init(&cpu->data_memory, 0))
     {
+        free(code_memory);
         free(cpu);
         return NULL;
     }
 
-    for (int i = 0; i < NUM_PHYSICAL_REGS; i++) {
-    cpu->phys_reg[i].status = 0;
-    cpu->phys_reg[i].valid = 0;
+    /* The first chunk of the pool covers all records that can be in flight */
+    arena_init(&cpu->arena);
+    if (slab_init(&cpu->insn_pool, &cpu->arena, sizeof(APEX_Dyn_Insn),
+                  INSN_POOL_CHUNK))
+    {
+        arena_free(&cpu->arena);
+        memory_free(&cpu->data_memory);
+        free(code_memory);
+        free(cpu);
+        return NULL;
     }
-    initialize_issue_queue(cpu);
+
+    /* Initialize PC, Registers and all pipeline stages */
+    cpu->pc = 4000;
+    memset(cpu->regs, 0, sizeof(int) * REG_FILE_SIZE);
+    cpu->single_step = ENABLE_SINGLE_STEP;
+    cpu->mul_latency = CONFIG_MUL_LATENCY >= 0 ? CONFIG_MUL_LATENCY : 1;
+    cpu->mem_latency = CONFIG_MEM_LATENCY >= 0 ? CONFIG_MEM_LATENCY : 1;
+    cpu->skip_idle = CONFIG_SKIP_IDLE > 0;
+    cpu->fusion = CONFIG_FUSION > 0;
+    cpu->loop_buffer = CONFIG_LOOP_BUFFER > 0;
+    cpu->value_predict = CONFIG_VALUE_PREDICT > 0 ? CONFIG_VALUE_PREDICT
+                                                  : VPRED_NONE;
+    cpu->load_bypass = CONFIG_LOAD_BYPASS > 0;
+    cpu->num_threads = 1;
+    cpu->energy.next_sample = INT_MAX;
+    cpu->code_memory = code_memory;
+    cpu->code_memory_size = code_memory_size;
 
 
     if (ENABLE_DEBUG_MESSAGES)
@@ -1112,56 +1971,232 @@ APEX_cpu_init(const char *filename)
     }
 
     /* To start fetch stage */
-    cpu->fetch.has_insn = TRUE;
+    cpu->fetch_enabled = TRUE;
     return cpu;
 }
 
 /*
- * APEX CPU simulation loop
+ * This function creates and initializes APEX cpu.
  *
  * Note: You are free to edit this function according to your implementation
  */
-void
-APEX_cpu_run(APEX_CPU *cpu)
+APEX_CPU *
+APEX_cpu_init(const char *filename)
+{
+    APEX_Instruction *code_memory;
+    int code_memory_size = 0;
+
+    if (!filename)
+    {
+        return NULL;
+    }
+
+    /* Parse input file and create code memory */
+    code_memory = create_code_memory(filename, &code_memory_size);
+    return APEX_cpu_init_from_code(code_memory, code_memory_size);
+}
+
+/*
+ * Adds a hardware thread running code_memory on the pipeline of cpu, from
+ * PC 4000 with its own registers and an empty data memory limited like
+ * that of cpu. The CPU takes ownership of code_memory, which must come
+ * from malloc (also on failure). Call it before the simulation starts.
+ * Returns 0, or -1 when out of memory or SMT_MAX_THREADS are running.
+ */
+int
+APEX_cpu_add_thread_from_code(APEX_CPU *cpu, APEX_Instruction *code_memory,
+                              int code_memory_size)
+{
+    APEX_Thread *thread = &cpu->threads[cpu->num_threads];
+
+    if (cpu->num_threads == SMT_MAX_THREADS || !code_memory)
+    {
+        free(code_memory);
+        return -1;
+    }
+
+    memset(thread, 0, sizeof(*thread));
+    if (memory_init(&thread->data_memory, cpu->data_memory.limit))
+    {
+        free(code_memory);
+        return -1;
+    }
+
+    thread->code_memory = code_memory;
+    thread->code_memory_size = code_memory_size;
+    thread->pc = 4000;
+    thread->fetch_enabled = TRUE;
+    cpu->num_threads++;
+    return 0;
+}
+
+/* Same as APEX_cpu_add_thread_from_code, with the program in filename */
+int
+APEX_cpu_add_thread(APEX_CPU *cpu, const char *filename)
+{
+    APEX_Instruction *code_memory;
+    int code_memory_size;
+
+    if (!filename)
+    {
+        return -1;
+    }
+    code_memory = create_code_memory(filename, &code_memory_size);
+    return APEX_cpu_add_thread_from_code(cpu, code_memory, code_memory_size);
+}
+
+/*
+ * Simulates one cycle. When skip_idle is set and no stage can make
+ * progress, jumps over the idle cycles instead, but never past limit
+ * (an absolute cycle, 0 for none). Returns TRUE once the simulation has
+ * ended: HALT retired, or the co-simulation checker, a retire callback or
+ * the single-step prompt stopped it.
+ */
+int
+APEX_cpu_cycle(APEX_CPU *cpu, int limit)
 {
     char user_prompt_val;
+    int halted;
 
-    while (TRUE)
+    if (cpu->halted || cpu->stopped)
     {
-        if (ENABLE_DEBUG_MESSAGES)
-        {
-            printf("--------------------------------------------\n");
-            printf("Clock Cycle #: %d\n", cpu->clock);
-            printf("--------------------------------------------\n");
-        }
+        return TRUE;
+    }
+
+    if (APEX_cpu_skip_to_next_event(cpu, limit))
+    {
+        return FALSE;
+    }
+
+    if (ENABLE_DEBUG_MESSAGES)
+    {
+        printf("--------------------------------------------\n");
+        printf("Clock Cycle #: %d\n", cpu->clock);
+        printf("--------------------------------------------\n");
+    }
 
-        if (APEX_writeback(cpu))
+    if (cpu->profile.enabled
+        && (cpu->clock % cpu->profile.sample_period) == 0)
+    {
+        halted = APEX_cpu_profiled_cycle(cpu);
+    }
+    else
+    {
+        halted = APEX_writeback(cpu);
+        if (!halted)
         {
-            /* Halt in writeback stage */
-            printf("APEX_CPU: Simulation Complete, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
-            break;
+            APEX_memory(cpu);
+            APEX_execute(cpu);
+            APEX_decode(cpu);
+            APEX_fetch(cpu);
         }
+    }
+
+    if (cpu->num_threads > 1)
+    {
+        smt_switch(cpu, 0);
+    }
 
-        APEX_memory(cpu);
-        APEX_execute(cpu);
-        APEX_decode(cpu);
-        APEX_fetch(cpu);
+    if (halted)
+    {
+        return TRUE;
+    }
 
+    if (ENABLE_DEBUG_MESSAGES)
+    {
         print_reg_file(cpu);
+    }
+
+    if (cpu->single_step)
+    {
+        printf("Press any key to advance CPU Clock or <q> to quit:\n");
+        scanf("%c", &user_prompt_val);
 
-        if (cpu->single_step)
+        if ((user_prompt_val == 'Q') || (user_prompt_val == 'q'))
         {
-            printf("Press any key to advance CPU Clock or <q> to quit:\n");
-            scanf("%c", &user_prompt_val);
+            printf("APEX_CPU: Simulation Stopped, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
+            cpu->stopped = TRUE;
+            return TRUE;
+        }
+    }
 
-            if ((user_prompt_val == 'Q') || (user_prompt_val == 'q'))
-            {
-                printf("APEX_CPU: Simulation Stopped, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
-                break;
-            }
+    cpu->clock++;
+    if (cpu->clock >= cpu->energy.next_sample)
+    {
+        energy_sample(&cpu->energy, cpu->clock, cpu->insn_completed);
+    }
+    if (cpu->interval.enabled)
+    {
+        interval_tick(cpu);
+    }
+    return FALSE;
+}
+
+/*
+ * APEX CPU simulation loop
+ *
+ * Note: You are free to edit this function according to your implementation
+ */
+void
+APEX_cpu_run(APEX_CPU *cpu)
+{
+    uint64_t allocations
+        = cpu->arena.allocations + data_memory_allocations(cpu);
+
+    if (cpu->profile.enabled)
+    {
+        cpu->profile.run_start_ns = profile_now_ns();
+    }
+
+    while (!cpu->max_cycles || cpu->clock < cpu->max_cycles)
+    {
+        if (APEX_cpu_cycle(cpu, cpu->max_cycles))
+        {
+            break;
         }
+    }
+
+    if (cpu->cosim && cpu->cosim->diverged)
+    {
+        printf("APEX_CPU: Simulation Stopped on co-simulation divergence, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
+    }
+    else if (cpu->halted)
+    {
+        /* Halt in writeback stage */
+        printf("APEX_CPU: Simulation Complete, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
+    }
+    else if (!cpu->stopped)
+    {
+        printf("APEX_CPU: Simulation Stopped, cycles = %d instructions = %d\n", cpu->clock, cpu->insn_completed);
+    }
+
+    if (cpu->num_threads > 1)
+    {
+        print_threads(cpu);
+    }
+
+    cpu->stats.run_allocations = (int)(cpu->arena.allocations
+                                       + data_memory_allocations(cpu)
+                                       - allocations);
+    if (cpu->print_stats)
+    {
+        print_stats(cpu);
+    }
+
+    if (cpu->interval.enabled)
+    {
+        interval_finish(cpu);
+    }
+
+    if (cpu->energy.enabled)
+    {
+        energy_report(&cpu->energy, cpu->clock, cpu->insn_completed);
+    }
 
-        cpu->clock++;
+    if (cpu->profile.enabled)
+    {
+        cpu->profile.run_ns = profile_now_ns() - cpu->profile.run_start_ns;
+        profile_report(&cpu->profile, cpu->clock, cpu->insn_completed);
     }
 }
 
@@ -1173,6 +2208,24 @@ APEX_cpu_run(APEX_CPU *cpu)
 void
 APEX_cpu_stop(APEX_CPU *cpu)
 {
+    int i;
+
+    if (cpu->num_threads > 1)
+    {
+        smt_switch(cpu, 0);
+    }
+    for (i = 1; i < cpu->num_threads; ++i)
+    {
+        memory_free(&cpu->threads[i].data_memory);
+        free(cpu->threads[i].code_memory);
+    }
+
+    profile_close(&cpu->profile);
+    energy_close(&cpu->energy);
+    interval_close(&cpu->interval);
+    cosim_destroy(cpu->cosim);
+    memory_free(&cpu->data_memory);
+    arena_free(&cpu->arena);
     free(cpu->code_memory);
     free(cpu);
 }
\ No newline at end of file
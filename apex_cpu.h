@@ -9,7 +9,15 @@
 #ifndef _APEX_CPU_H_
 #define _APEX_CPU_H_
 
+#include "apex_cosim.h"
+#include "apex_energy.h"
+#include "apex_interval.h"
+#include "apex_event.h"
 #include "apex_macros.h"
+#include "apex_memory.h"
+#include "apex_pool.h"
+#include "apex_profile.h"
+#include "apex_vpred.h"
 
 /* Format of an APEX instruction  */
 typedef struct APEX_Instruction
@@ -25,62 +33,164 @@ typedef struct APEX_Instruction
     int stall;
 } APEX_Instruction;
 
-/* Model of CPU stage latch */
-typedef struct CPU_Stage
+/* Records in the first chunk of the instruction pool, more than can be in flight */
+#define INSN_POOL_CHUNK 8
+
+/*
+ * In-flight instruction record. Fetch allocates one per instruction from
+ * the CPU's pool, the pipeline latches only hold pointers to it, and it is
+ * freed when the instruction retires or is flushed.
+ */
+typedef struct APEX_Dyn_Insn
 {
+    uint64_t seq;            /* Fetch order, starting at 1 */
     int pc;
-    char opcode_str[128];
+    const char *opcode_str;  /* Points into code memory */
     int opcode;
     int rs1;
     int rs2;
     int rd;
     int imm;
-    int is_lit;
     int rs1_value;
     int rs2_value;
-    int rd_value;
     int result_buffer;
     int memory_address;
-    int has_insn;
+    int ptr_value;     /* Incremented base register of LOADP/STOREP */
     int data_of_store;
-    int stall;
-} CPU_Stage;
+    int fused;         /* A conditional branch was fused into this insn */
+    int branch_opcode; /* Opcode, mnemonic and offset of the fused branch */
+    const char *branch_str;
+    int branch_imm;
+    int pred_taken;    /* Fetch went on at the target of its branch */
+    int thread;        /* SMT thread it belongs to */
+    uint32_t src_mask; /* Registers it reads and writes, a bit each */
+    uint32_t dest_mask;
+    int vp_predicted;  /* Dependents may read vp_value before it returns */
+    int vp_value;
+    int vp_used;       /* A dependent read vp_value */
+    int vp_flags[3];   /* Zero, positive and negative flags before younger
+                          instructions executed, restored by a squash */
+    int bypass;        /* Load read memory in execute past a busy store, or
+                          -1 when it may not */
+    int bypass_ready;  /* Cycle that early access finishes */
+    int stall;         /* Held in decode by a busy source or execute */
+    int ready_cycle;   /* Cycle its stage finishes it, -1 until started */
+    int fetch_cycle;   /* Cycle it was fetched */
+    int execute_cycle; /* First cycle in execute, memory and writeback */
+    int memory_cycle;
+    int writeback_cycle;
+} APEX_Dyn_Insn;
 
-typedef struct OpQueueEntry
-{
-    int program_counter;
-    int is_valid;             // Indicates if the entry is valid
-    int functional_unit_type; // Type of functional unit needed
-    int immediate_value;      // Immediate value for the instruction
-    int source1_ready;        // Flag indicating if source1 is ready
-    int source1_register;     // Source1 register ID
-    int source1_value;        // Source1 value
-    int source2_ready;        // Flag indicating if source2 is ready
-    int source2_register;     // Source2 register ID
-    int source2_value;        // Source2 value
-    int destination_register; // Destination register ID
-    int load_store_queue_index; // Index in the Load Store Queue (if applicable)
-    // Additional fields as needed
-} OpQueueEntry;
-
-typedef struct OpQueue
-{
-    OpQueueEntry entries[Op_QUEUE_SIZE];
-    int next_free_index; // Index of the next free entry in the queue
-} OpQueue;
+/* Instructions the loop buffer holds, the longest loop body it captures */
+#define LOOP_BUFFER_SIZE 16
 
-typedef struct APEX_Reg_Status 
+/*
+ * Loop stream detector. When a short backward branch is taken, the loop
+ * body is captured as ready-built records. From then on fetch supplies the
+ * loop from the buffer instead of code memory and follows the loop branch
+ * as taken, so iterations come back to back without a taken-branch bubble;
+ * only the exit from the loop is redirected.
+ */
+typedef struct APEX_Loop_Buffer
 {
-    int value;
-    int status; // 0 means available, 1 means being used
     int valid;
+    int start_pc;      /* Target of the loop branch, first insn of the body */
+    int end_pc;        /* The loop branch */
+    APEX_Dyn_Insn insn[LOOP_BUFFER_SIZE];  /* Record fetched at each PC */
+} APEX_Loop_Buffer;
+
+/* Masks with a bit per architectural register, so that searches over them
+ * are bit scans */
+typedef uint64_t APEX_Mask;
+
+/* Mask of the first n bits */
+#define APEX_MASK_ALL(n) ((n) >= 64 ? ~(APEX_Mask)0 : ((APEX_Mask)1 << (n)) - 1)
+
+#if REG_FILE_SIZE > 32
+#error "the register file must fit its masks"
+#endif
+
+/* Scoreboard of the architectural registers */
+typedef struct APEX_Reg_Status
+{
+    APEX_Mask busy;                /* Registers with a write in flight */
+    uint8_t writes[REG_FILE_SIZE]; /* In-flight writes to each register */
+    APEX_Mask predicted;           /* Registers whose youngest write is a
+                                      load with a predicted value */
+    int pred_value[REG_FILE_SIZE];
+    APEX_Dyn_Insn *pred_load[REG_FILE_SIZE];
 } APEX_Reg_Status;
 
-typedef struct {
-    int value;         // Value stored in the physical register
-    int valid;         // Flag to indicate if the register is valid
-    int status;      // Associated architectural register
-} PhysicalRegister;
+/* Hardware threads of an SMT core, and the policies fetch chooses them by */
+#define SMT_MAX_THREADS 4
+#define SMT_FETCH_RR 0       /* Round-robin */
+#define SMT_FETCH_ICOUNT 1   /* Fewest instructions in flight */
+
+/*
+ * Architectural state of a hardware thread while another thread's is in
+ * the CPU (see smt_switch). Each thread has its own program, registers,
+ * flags, scoreboard and data memory, and its own decode latch, so that a
+ * thread stalled in decode does not keep fetch from the others.
+ */
+typedef struct APEX_Thread
+{
+    int pc;
+    int regs[REG_FILE_SIZE];
+    APEX_Instruction *code_memory;
+    int code_memory_size;
+    APEX_Memory data_memory;
+    APEX_Reg_Status register_status;
+    int zero_flag;
+    int pos_flag;
+    int neg_flag;
+    int cc;
+    int fetch_enabled;
+    int fetch_from_next_cycle;
+    APEX_Dyn_Insn *decode;
+
+    /* Kept here for every thread, including the one in the CPU */
+    int insn_completed;
+    int halted;
+} APEX_Thread;
+
+/* Pipeline statistics, counted per simulated cycle */
+typedef struct APEX_Stats
+{
+    int fetch_stalls;      /* Fetch held its PC behind an occupied decode */
+    int decode_stalls;     /* Decode waited on a source or an occupied execute */
+    int execute_stalls;    /* Execute held an insn (MUL latency or busy memory) */
+    int memory_stalls;     /* Memory access latency beyond the first cycle */
+    int skipped_cycles;    /* Idle cycles jumped over by the event kernel */
+    int run_allocations;   /* Host allocations (arena blocks and data memory)
+                              during the last APEX_cpu_run */
+    int fused_pairs;       /* Instruction pairs retired as one fused op */
+    int loops_captured;    /* Loops taken into the loop buffer */
+    int loop_buffer_fetches; /* Fetch cycles supplied by the loop buffer */
+    int loop_exits;        /* Loop branches followed as taken that were not */
+    int branches;          /* Conditional branches resolved */
+    int branch_redirects;  /* Conditional branches resolved against fetch */
+    int jump_redirects;    /* JUMP and JALR, which always redirect fetch */
+    int flushed_insns;     /* Younger instructions dropped by a redirect */
+    int vp_loads;          /* Loads returned with value prediction on */
+    int vp_predicted;      /* Loads whose value was predicted */
+    int vp_correct;        /* Predictions the returned value matched */
+    int vp_used;           /* Predictions a dependent read */
+    int vp_squashes;       /* Wrong predictions a dependent read */
+    int vp_squashed_insns; /* Instructions squashed by them */
+    int loads_bypassed;    /* Loads that read memory past a busy store */
+    int bypass_aliases;    /* Loads held behind a store to their address */
+} APEX_Stats;
+
+struct APEX_CPU;
+struct APEX_System;
+
+/*
+ * Called after every retirement with its architectural effects, and after
+ * every cycle. A nonzero return value stops the simulation.
+ */
+typedef int (*APEX_Retire_Callback)(struct APEX_CPU *cpu,
+                                    const APEX_Retire *retire, void *arg);
+typedef int (*APEX_Cycle_Callback)(struct APEX_CPU *cpu, void *arg);
 
 /* Model of APEX CPU */
 typedef struct APEX_CPU
@@ -88,34 +198,95 @@ typedef struct APEX_CPU
     int pc;                        /* Current program counter */
     int clock;                     /* Clock cycles elapsed */
     int insn_completed;            /* Instructions retired */
+    int retired_pc;                /* PC of the last retired instruction */
+    int target_pc;                 /* PC watched by APEX_cpu_run_until_pc,
+                                      0 for none */
+    int target_hit;                /* An instruction at target_pc retired */
+    int halted;                    /* HALT has retired */
+    int stopped;                   /* Stopped by the checker, a callback or the user */
     int regs[REG_FILE_SIZE];       /* Integer register file */
     int code_memory_size;          /* Number of instruction in the input file */
-    APEX_Reg_Status register_status[REG_FILE_SIZE]; // Status of registers
+    APEX_Reg_Status register_status; /* Registers with writes in flight */
     APEX_Instruction *code_memory; /* Code Memory */
-    int data_memory[DATA_MEMORY_SIZE]; /* Data Memory */
+    APEX_Memory data_memory;       /* Data Memory */
     int single_step;               /* Wait for user input after every cycle */
+    int max_cycles;                /* Stop after this many cycles, 0 = never */
+    int mul_latency;               /* Cycles MUL spends in execute */
+    int mem_latency;               /* Cycles a load or store spends in memory */
+    int skip_idle;                 /* Jump over cycles where no stage can move */
+    int print_stats;               /* Print APEX_Stats at the end of the run */
+    int fusion;                    /* Fuse CMP/CML/ADDL/SUBL with a following
+                                      conditional branch */
+    int loop_buffer;               /* Supply short loops from the loop buffer */
+    int value_predict;             /* VPRED_* predictor for load values */
+    int load_bypass;               /* Loads may pass a busy store in memory */
     int zero_flag;                 /* {TRUE, FALSE} Used by BZ and BNZ to branch */
     int pos_flag;                  
     int neg_flag;
     int cc;                        
     int fetch_from_next_cycle;
     int stall;
-    OpQueue op_queue;
 
-    /* Pipeline stages */
-    CPU_Stage fetch;
-    CPU_Stage decode;
-    CPU_Stage execute;
-    CPU_Stage memory;
-    CPU_Stage writeback;
+    /* Pipeline latches: the instruction in each stage, or NULL */
+    int fetch_enabled;             /* Cleared once HALT has been fetched */
+    APEX_Dyn_Insn *decode;
+    APEX_Dyn_Insn *execute;
+    APEX_Dyn_Insn *memory;
+    APEX_Dyn_Insn *writeback;
+    uint64_t insn_seq;             /* Sequence number of the last fetch */
+
+    APEX_Thread threads[SMT_MAX_THREADS];
+    int num_threads;               /* 1 unless threads were added for SMT */
+    int thread;                    /* Thread whose state is in the fields above */
+    int threads_halted;
+    int fetch_policy;              /* SMT_FETCH_* */
+    int last_fetch;                /* Threads fetch and decode went with last */
+    int last_issue;
+
+    APEX_Arena arena;              /* Per-run data, freed by APEX_cpu_stop */
+    APEX_Loop_Buffer lsd;
+    APEX_Vpred vpred;
+    APEX_Slab insn_pool;           /* In-flight instruction records */
+
+    APEX_Event_Queue events;       /* Completion cycles of multi-cycle ops */
+    APEX_Stats stats;
 
-    OpQueue opq;
+    APEX_Profile profile;          /* Host-side stage timing */
+    APEX_Energy energy;            /* Event counts and the energy model */
+    APEX_Interval interval;        /* Per-interval statistics */
+    APEX_Cosim *cosim;             /* Lockstep reference checker, or NULL */
 
-    PhysicalRegister phys_reg[NUM_PHYSICAL_REGS];
+    struct APEX_System *system;    /* Multi-core system owning this CPU, or NULL */
+    int core_id;
+
+    APEX_Retire_Callback retire_callback;
+    void *retire_callback_arg;
+    APEX_Cycle_Callback cycle_callback;
+    void *cycle_callback_arg;
 } APEX_CPU;
 
+/*
+ * Pipeline settings of cpu. One fixed at build time is a constant, so the
+ * tests of it in the stages fold away.
+ */
+#define CPU_SETTING(cpu, field, fixed) ((fixed) >= 0 ? (fixed) : (cpu)->field)
+#define CPU_MUL_LATENCY(cpu) CPU_SETTING(cpu, mul_latency, CONFIG_MUL_LATENCY)
+#define CPU_MEM_LATENCY(cpu) CPU_SETTING(cpu, mem_latency, CONFIG_MEM_LATENCY)
+#define CPU_SKIP_IDLE(cpu) CPU_SETTING(cpu, skip_idle, CONFIG_SKIP_IDLE)
+#define CPU_FUSION(cpu) CPU_SETTING(cpu, fusion, CONFIG_FUSION)
+#define CPU_LOOP_BUFFER(cpu) CPU_SETTING(cpu, loop_buffer, CONFIG_LOOP_BUFFER)
+#define CPU_VALUE_PREDICT(cpu) \
+    CPU_SETTING(cpu, value_predict, CONFIG_VALUE_PREDICT)
+#define CPU_LOAD_BYPASS(cpu) CPU_SETTING(cpu, load_bypass, CONFIG_LOAD_BYPASS)
+
 APEX_Instruction *create_code_memory(const char *filename, int *size);
 APEX_CPU *APEX_cpu_init(const char *filename);
+APEX_CPU *APEX_cpu_init_from_code(APEX_Instruction *code_memory,
+                                  int code_memory_size);
+int APEX_cpu_add_thread_from_code(APEX_CPU *cpu, APEX_Instruction *code_memory,
+                                  int code_memory_size);
+int APEX_cpu_add_thread(APEX_CPU *cpu, const char *filename);
+int APEX_cpu_cycle(APEX_CPU *cpu, int limit);
 void APEX_cpu_run(APEX_CPU *cpu);
 void APEX_cpu_stop(APEX_CPU *cpu);
 void stall_handling(APEX_CPU *cpu);
@@ -0,0 +1,248 @@
+/*
+ * apex_energy.c
+ * Contains the activity-based energy model
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex_energy.h"
+
+/* Keys of the model file, in event order */
+static const char *event_names[ENERGY_NUM_EVENTS] = {
+    "FETCH", "LOOP_BUFFER", "REG_READ", "REG_WRITE", "ALU", "MUL",
+    "DATA_MEMORY", "LATCH",
+};
+
+/* Energy in pJ of each event when the model file leaves it out */
+static const double default_pj[ENERGY_NUM_EVENTS] = {
+    8.0, 1.5, 1.2, 1.8, 0.9, 3.5, 10.0, 0.5,
+};
+
+#define DEFAULT_LEAKAGE_PJ 5.0
+#define DEFAULT_CLOCK_MHZ 1000.0
+
+/* Removes a comment and surrounding white space from line, in place */
+static char *
+trim(char *line)
+{
+    char *end;
+
+    line[strcspn(line, "#\r\n")] = '\0';
+    while (*line == ' ' || *line == '\t')
+    {
+        ++line;
+    }
+    end = line + strlen(line);
+    while (end > line && (end[-1] == ' ' || end[-1] == '\t'))
+    {
+        *--end = '\0';
+    }
+    return line;
+}
+
+/* Sets the energy named key to value. Returns 0, or -1 for an unknown key. */
+static int
+set_key(APEX_Energy *energy, const char *key, double value)
+{
+    int i;
+
+    for (i = 0; i < ENERGY_NUM_EVENTS; ++i)
+    {
+        if (strcmp(key, event_names[i]) == 0)
+        {
+            energy->pj[i] = value;
+            return 0;
+        }
+    }
+    if (strcmp(key, "LEAKAGE") == 0)
+    {
+        energy->leakage_pj = value;
+        return 0;
+    }
+    if (strcmp(key, "CLOCK_MHZ") == 0 && value > 0.0)
+    {
+        energy->clock_mhz = value;
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * Reads a model file: one KEY=VALUE per line, energies in pJ, blank lines
+ * and text after # ignored. Returns 0, or -1 after reporting the line of
+ * an unknown key or a bad value.
+ */
+static int
+load_model(APEX_Energy *energy, const char *model_file)
+{
+    char buf[256], *line, *sep, *end = NULL;
+    FILE *fp = fopen(model_file, "r");
+    double value = 0.0;
+    int line_no = 0;
+
+    if (!fp)
+    {
+        return -1;
+    }
+
+    while (fgets(buf, sizeof(buf), fp))
+    {
+        ++line_no;
+        line = trim(buf);
+        if (*line == '\0')
+        {
+            continue;
+        }
+
+        sep = strchr(line, '=');
+        if (sep)
+        {
+            *sep = '\0';
+            value = strtod(sep + 1, &end);
+        }
+        if (!sep || end == sep + 1 || *trim(end) != '\0' || value < 0.0
+            || set_key(energy, trim(line), value))
+        {
+            fprintf(stderr, "APEX_ENERGY: %s:%d: expected KEY=VALUE with a "
+                            "known key and a value of 0 or more\n",
+                    model_file, line_no);
+            fclose(fp);
+            return -1;
+        }
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+/*
+ * Enables the model with the energies of model_file, the built-in ones for
+ * keys it leaves out. With trace_file, a row is written to it every
+ * interval cycles. The event counts are kept. Returns 0 on success and -1
+ * if a file cannot be read or opened.
+ */
+int
+energy_init(APEX_Energy *energy, const char *model_file, int interval,
+            const char *trace_file)
+{
+    memcpy(energy->pj, default_pj, sizeof(energy->pj));
+    energy->leakage_pj = DEFAULT_LEAKAGE_PJ;
+    energy->clock_mhz = DEFAULT_CLOCK_MHZ;
+    energy->interval = interval > 0 ? interval : ENERGY_DEFAULT_INTERVAL;
+    energy->next_sample = INT_MAX;
+    energy->last_cycle = 0;
+    energy->last_insns = 0;
+    energy->last_pj = 0.0;
+
+    if (load_model(energy, model_file))
+    {
+        return -1;
+    }
+
+    if (trace_file)
+    {
+        energy->trace = fopen(trace_file, "w");
+        if (!energy->trace)
+        {
+            return -1;
+        }
+        fprintf(energy->trace, "cycle,instructions,ipc,energy_pj,"
+                               "epi_pj,power_mw\n");
+        energy->next_sample = energy->interval;
+    }
+    energy->enabled = 1;
+    return 0;
+}
+
+/* Energy in pJ of the events counted so far and cycles of leakage */
+double
+energy_total_pj(const APEX_Energy *energy, int cycles)
+{
+    double total = energy->leakage_pj * cycles;
+    int i;
+
+    for (i = 0; i < ENERGY_NUM_EVENTS; ++i)
+    {
+        total += energy->pj[i] * energy->count[i];
+    }
+    return total;
+}
+
+/*
+ * Writes a row for the cycles since the previous one, when the trace is
+ * due at cycle. Cycles skipped as idle fall in the row they end in.
+ */
+void
+energy_sample(APEX_Energy *energy, int cycle, int insns)
+{
+    double total, pj;
+    int cycles;
+
+    if (!energy->trace || cycle <= energy->last_cycle)
+    {
+        return;
+    }
+
+    total = energy_total_pj(energy, cycle);
+    pj = total - energy->last_pj;
+    cycles = cycle - energy->last_cycle;
+    insns -= energy->last_insns;
+
+    fprintf(energy->trace, "%d,%d,%.4f,%.1f,%.2f,%.3f\n", cycle, insns,
+            (double)insns / cycles, pj, insns ? pj / insns : 0.0,
+            pj / cycles * energy->clock_mhz / 1000.0);
+
+    energy->last_cycle = cycle;
+    energy->last_insns += insns;
+    energy->last_pj = total;
+    energy->next_sample = cycle - cycle % energy->interval + energy->interval;
+}
+
+/*
+ * Prints the energy of each event, the total, the energy per instruction,
+ * the average power and the energy-delay product, and ends the trace with
+ * a row for the last cycles
+ */
+void
+energy_report(APEX_Energy *energy, int cycles, int insns)
+{
+    double total = energy_total_pj(energy, cycles);
+    double seconds = cycles / (energy->clock_mhz * 1e6);
+    int i;
+
+    energy_sample(energy, cycles, insns);
+
+    printf("----------\n%s\n----------\n", "Energy:");
+    for (i = 0; i < ENERGY_NUM_EVENTS; ++i)
+    {
+        printf("%-15s: %12llu x %7.2f pJ = %12.1f nJ %6.2f%%\n",
+               event_names[i], (unsigned long long)energy->count[i],
+               energy->pj[i], energy->pj[i] * energy->count[i] / 1000.0,
+               total > 0.0 ? 100.0 * energy->pj[i] * energy->count[i] / total
+                           : 0.0);
+    }
+    printf("%-15s: %12d x %7.2f pJ = %12.1f nJ %6.2f%%\n", "LEAKAGE", cycles,
+           energy->leakage_pj, energy->leakage_pj * cycles / 1000.0,
+           total > 0.0 ? 100.0 * energy->leakage_pj * cycles / total : 0.0);
+
+    printf("total          : %.1f nJ, %.2f pJ/instruction\n", total / 1000.0,
+           insns ? total / insns : 0.0);
+    if (seconds > 0.0)
+    {
+        printf("power          : %.3f mW at %.0f MHz\n",
+               total * 1e-12 / seconds * 1000.0, energy->clock_mhz);
+        printf("EDP            : %.4g J*s\n", total * 1e-12 * seconds);
+    }
+}
+
+void
+energy_close(APEX_Energy *energy)
+{
+    if (energy->trace)
+    {
+        fclose(energy->trace);
+        energy->trace = NULL;
+    }
+}
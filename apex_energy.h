@@ -0,0 +1,52 @@
+/*
+ * apex_energy.h
+ * Contains declarations of the activity-based energy model
+ *
+ * The stage functions count events: instruction fetches, register file
+ * reads and writes, ALU and multiplier operations, data memory accesses
+ * and latch writes. The energy of a run is the count of each event times
+ * its energy, read from a model file, plus leakage every cycle. Counting is always on; the model only turns the counts into
+ * energy, at the end of the run and optionally every N cycles into a trace.
+ */
+#ifndef _APEX_ENERGY_H_
+#define _APEX_ENERGY_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Events, in the order they are reported */
+#define ENERGY_FETCH 0        /* Instruction read from code memory */
+#define ENERGY_LOOP_BUFFER 1  /* Instruction supplied by the loop buffer */
+#define ENERGY_REG_READ 2
+#define ENERGY_REG_WRITE 3
+#define ENERGY_ALU 4
+#define ENERGY_MUL 5          /* MUL and DIV */
+#define ENERGY_DATA_MEMORY 6  /* Load or store access */
+#define ENERGY_LATCH 7        /* Instruction passed on to the next stage */
+#define ENERGY_NUM_EVENTS 8
+
+/* Default number of cycles between two rows of the trace */
+#define ENERGY_DEFAULT_INTERVAL 10000
+
+typedef struct APEX_Energy
+{
+    int enabled;                         /* Set when a model is loaded */
+    uint64_t count[ENERGY_NUM_EVENTS];   /* Events so far */
+    double pj[ENERGY_NUM_EVENTS];        /* Energy of one event */
+    double leakage_pj;                   /* Energy of every cycle */
+    double clock_mhz;                    /* Clock rate, for power and EDP */
+    FILE *trace;                         /* Optional per-interval CSV */
+    int interval;                        /* Cycles per row of the trace */
+    int next_sample;                     /* Cycle of the next row */
+    int last_cycle;                      /* State at the previous row */
+    int last_insns;
+    double last_pj;
+} APEX_Energy;
+
+int energy_init(APEX_Energy *energy, const char *model_file, int interval,
+                const char *trace_file);
+double energy_total_pj(const APEX_Energy *energy, int cycles);
+void energy_sample(APEX_Energy *energy, int cycle, int insns);
+void energy_report(APEX_Energy *energy, int cycles, int insns);
+void energy_close(APEX_Energy *energy);
+#endif
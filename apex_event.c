@@ -0,0 +1,75 @@
+/*
+ * apex_event.c
+ * Contains the pending completion queue of the event-driven kernel
+ */
+#include "apex_event.h"
+
+static void
+event_swap(APEX_Event_Queue *queue, int a, int b)
+{
+    int tmp = queue->cycle[a];
+
+    queue->cycle[a] = queue->cycle[b];
+    queue->cycle[b] = tmp;
+}
+
+/* Schedules a completion; the queue is never full in a 5-stage pipeline */
+void
+event_queue_push(APEX_Event_Queue *queue, int cycle)
+{
+    int i, parent;
+
+    if (queue->size == EVENT_QUEUE_SIZE)
+    {
+        return;
+    }
+
+    i = queue->size++;
+    queue->cycle[i] = cycle;
+    while (i > 0)
+    {
+        parent = (i - 1) / 2;
+        if (queue->cycle[parent] <= queue->cycle[i])
+        {
+            break;
+        }
+        event_swap(queue, parent, i);
+        i = parent;
+    }
+}
+
+static void
+event_queue_pop(APEX_Event_Queue *queue)
+{
+    int i = 0, child;
+
+    queue->cycle[0] = queue->cycle[--queue->size];
+    while ((child = 2 * i + 1) < queue->size)
+    {
+        if (child + 1 < queue->size
+            && queue->cycle[child + 1] < queue->cycle[child])
+        {
+            child++;
+        }
+        if (queue->cycle[i] <= queue->cycle[child])
+        {
+            break;
+        }
+        event_swap(queue, i, child);
+        i = child;
+    }
+}
+
+/*
+ * Drops completions scheduled before now and returns the earliest one
+ * still pending, or -1 when nothing is scheduled
+ */
+int
+event_queue_next(APEX_Event_Queue *queue, int now)
+{
+    while (queue->size && queue->cycle[0] < now)
+    {
+        event_queue_pop(queue);
+    }
+    return queue->size ? queue->cycle[0] : -1;
+}
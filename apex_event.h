@@ -0,0 +1,24 @@
+/*
+ * apex_event.h
+ * Contains declarations of the pending completion queue
+ *
+ * Multi-cycle operations schedule the cycle at which they complete. When no
+ * pipeline stage can make progress, the simulation loop jumps straight to
+ * the earliest scheduled completion instead of ticking idle cycles.
+ */
+#ifndef _APEX_EVENT_H_
+#define _APEX_EVENT_H_
+
+/* At most one operation is in flight per stage */
+#define EVENT_QUEUE_SIZE 8
+
+/* Binary min-heap of completion cycles */
+typedef struct APEX_Event_Queue
+{
+    int cycle[EVENT_QUEUE_SIZE];
+    int size;
+} APEX_Event_Queue;
+
+void event_queue_push(APEX_Event_Queue *queue, int cycle);
+int event_queue_next(APEX_Event_Queue *queue, int now);
+#endif
@@ -0,0 +1,232 @@
+/*
+ * apex_interval.c
+ * Contains the interval statistics and the basic-block vector
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex_cpu.h"
+#include "apex_interval.h"
+
+/* Instructions in the latches of cpu, and the decode latches of the
+ * threads not loaded in it */
+static int
+in_flight(const APEX_CPU *cpu)
+{
+    int n = (cpu->decode != NULL) + (cpu->execute != NULL)
+            + (cpu->memory != NULL) + (cpu->writeback != NULL);
+    int i;
+
+    for (i = 1; i < cpu->num_threads; ++i)
+    {
+        n += cpu->threads[i].decode != NULL;
+    }
+    return n;
+}
+
+static void
+read_counters(const APEX_CPU *cpu, uint64_t *counter)
+{
+    counter[INTERVAL_CYCLES] = cpu->clock;
+    counter[INTERVAL_INSNS] = cpu->insn_completed;
+    counter[INTERVAL_FETCH_STALLS] = cpu->stats.fetch_stalls;
+    counter[INTERVAL_DECODE_STALLS] = cpu->stats.decode_stalls;
+    counter[INTERVAL_EXECUTE_STALLS] = cpu->stats.execute_stalls;
+    counter[INTERVAL_MEMORY_STALLS] = cpu->stats.memory_stalls;
+    counter[INTERVAL_IN_FLIGHT] = cpu->interval.in_flight;
+    counter[INTERVAL_BRANCHES] = cpu->stats.branches;
+    counter[INTERVAL_MISPREDICTS] = cpu->stats.branch_redirects;
+    counter[INTERVAL_MEM_ACCESSES] = cpu->energy.count[ENERGY_DATA_MEMORY];
+}
+
+/* First cycle or instruction count past value that ends an interval */
+static int
+next_boundary(const APEX_Interval *interval, int value)
+{
+    return value - value % interval->length + interval->length;
+}
+
+/* Writes the line of the vector for the interval and clears the counts */
+static void
+write_bbv(APEX_Interval *interval)
+{
+    int i;
+
+    fputc('T', interval->bbv);
+    for (i = 0; i < interval->num_blocks; ++i)
+    {
+        if (interval->block_insns[i])
+        {
+            fprintf(interval->bbv, ":%d:%u ", i + 1,
+                    interval->block_insns[i]);
+            interval->block_insns[i] = 0;
+        }
+    }
+    fputc('\n', interval->bbv);
+}
+
+/* Ends the interval at the current cycle and starts the next one */
+static void
+end_interval(APEX_CPU *cpu)
+{
+    APEX_Interval *interval = &cpu->interval;
+    uint64_t now[INTERVAL_NUM_COUNTERS], delta[INTERVAL_NUM_COUNTERS];
+    double cycles, insns;
+    int i;
+
+    read_counters(cpu, now);
+    for (i = 0; i < INTERVAL_NUM_COUNTERS; ++i)
+    {
+        delta[i] = now[i] - interval->start[i];
+    }
+    cycles = delta[INTERVAL_CYCLES];
+    insns = delta[INTERVAL_INSNS];
+
+    if (interval->csv)
+    {
+        fprintf(interval->csv,
+                "%d,%llu,%.4f,%llu,%llu,%llu,%llu,%.3f,%llu,%.4f,%.4f\n",
+                cpu->clock, (unsigned long long)delta[INTERVAL_INSNS],
+                cycles ? insns / cycles : 0.0,
+                (unsigned long long)delta[INTERVAL_FETCH_STALLS],
+                (unsigned long long)delta[INTERVAL_DECODE_STALLS],
+                (unsigned long long)delta[INTERVAL_EXECUTE_STALLS],
+                (unsigned long long)delta[INTERVAL_MEMORY_STALLS],
+                cycles ? delta[INTERVAL_IN_FLIGHT] / cycles : 0.0,
+                (unsigned long long)delta[INTERVAL_BRANCHES],
+                delta[INTERVAL_BRANCHES]
+                    ? (double)delta[INTERVAL_MISPREDICTS]
+                          / delta[INTERVAL_BRANCHES]
+                    : 0.0,
+                insns ? delta[INTERVAL_MEM_ACCESSES] / insns : 0.0);
+    }
+    if (interval->bbv)
+    {
+        write_bbv(interval);
+    }
+
+    memcpy(interval->start, now, sizeof(now));
+    interval->next = next_boundary(interval, interval->by_insns
+                                                 ? cpu->insn_completed
+                                                 : cpu->clock);
+}
+
+/*
+ * Cuts the run of cpu into intervals of length cycles, or retired
+ * instructions with by_insns, from the current cycle on. A row is written
+ * to csv_file and a line to bbv_file for each; either may be NULL. Returns
+ * 0 on success and -1 if a file cannot be opened or out of memory.
+ */
+int
+interval_init(APEX_CPU *cpu, int length, int by_insns, const char *csv_file,
+              const char *bbv_file)
+{
+    APEX_Interval *interval = &cpu->interval;
+
+    interval->length = length > 0 ? length : INTERVAL_DEFAULT_LENGTH;
+    interval->by_insns = by_insns;
+    interval->in_flight = 0;
+    interval->last_tick = cpu->clock;
+    interval->block_start = -1;
+
+    if (csv_file)
+    {
+        interval->csv = fopen(csv_file, "w");
+        if (!interval->csv)
+        {
+            return -1;
+        }
+        fprintf(interval->csv, "cycle,instructions,ipc,fetch_stalls,"
+                               "decode_stalls,execute_stalls,memory_stalls,"
+                               "in_flight,branches,mispredict_rate,"
+                               "mem_per_insn\n");
+    }
+
+    if (bbv_file)
+    {
+        interval->num_blocks = cpu->code_memory_size;
+        interval->block_insns = calloc(cpu->code_memory_size + 1,
+                                       sizeof(uint32_t));
+        interval->bbv = fopen(bbv_file, "w");
+        if (!interval->block_insns || !interval->bbv)
+        {
+            return -1;
+        }
+    }
+
+    read_counters(cpu, interval->start);
+    interval->next = next_boundary(interval, by_insns ? cpu->insn_completed
+                                                      : cpu->clock);
+    interval->enabled = TRUE;
+    return 0;
+}
+
+/*
+ * Called at the end of every cycle. Cycles skipped as idle are counted
+ * with the instructions in flight after the cycle that ends them, and fall
+ * in the interval that cycle ends in.
+ */
+void
+interval_tick(APEX_CPU *cpu)
+{
+    APEX_Interval *interval = &cpu->interval;
+
+    interval->in_flight
+        += (uint64_t)in_flight(cpu) * (cpu->clock - interval->last_tick);
+    interval->last_tick = cpu->clock;
+
+    if ((interval->by_insns ? cpu->insn_completed : cpu->clock)
+        >= interval->next)
+    {
+        end_interval(cpu);
+    }
+}
+
+/*
+ * Counts insns retired at pc towards the block being retired. A block
+ * starts at the first instruction retired after the end of the previous
+ * one, and ends with a branch, JUMP, JALR or HALT.
+ */
+void
+interval_retire(APEX_Interval *interval, int pc, int insns, int ends_block)
+{
+    if (interval->block_start < 0)
+    {
+        interval->block_start = (pc - 4000) / 4;
+    }
+    interval->block_insns[interval->block_start] += insns;
+    if (ends_block)
+    {
+        interval->block_start = -1;
+    }
+}
+
+/* Writes the last, partial interval of the run */
+void
+interval_finish(APEX_CPU *cpu)
+{
+    APEX_Interval *interval = &cpu->interval;
+
+    interval_tick(cpu);
+    if (cpu->clock > (int)interval->start[INTERVAL_CYCLES])
+    {
+        end_interval(cpu);
+    }
+}
+
+void
+interval_close(APEX_Interval *interval)
+{
+    if (interval->csv)
+    {
+        fclose(interval->csv);
+        interval->csv = NULL;
+    }
+    if (interval->bbv)
+    {
+        fclose(interval->bbv);
+        interval->bbv = NULL;
+    }
+    free(interval->block_insns);
+    interval->block_insns = NULL;
+}
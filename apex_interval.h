@@ -0,0 +1,67 @@
+/*
+ * apex_interval.h
+ * Contains declarations of the interval statistics
+ *
+ * Totals at the end of a run hide its phases. With interval statistics
+ * enabled, the run is cut into intervals of N cycles or N retired
+ * instructions, and at the end of each one a row with the IPC, the stall
+ * counts, the average number of instructions in flight, the branch
+ * mispredict rate and the data memory access rate of the interval is
+ * written to a CSV file. A basic-block vector can be written alongside, in
+ * the format SimPoint reads: a line per interval listing, for every basic
+ * block retired in it, the block and the number of instructions it
+ * retired.
+ *
+ * The stages only look at the interval state when it is enabled: once per
+ * cycle for the CSV and once per retirement for the vector.
+ */
+#ifndef _APEX_INTERVAL_H_
+#define _APEX_INTERVAL_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Default length of an interval */
+#define INTERVAL_DEFAULT_LENGTH 10000
+
+/* Counters compared between the two ends of an interval */
+#define INTERVAL_CYCLES 0
+#define INTERVAL_INSNS 1
+#define INTERVAL_FETCH_STALLS 2
+#define INTERVAL_DECODE_STALLS 3
+#define INTERVAL_EXECUTE_STALLS 4
+#define INTERVAL_MEMORY_STALLS 5
+#define INTERVAL_IN_FLIGHT 6     /* Instructions in the latches, each cycle */
+#define INTERVAL_BRANCHES 7
+#define INTERVAL_MISPREDICTS 8   /* Conditional branches that redirected */
+#define INTERVAL_MEM_ACCESSES 9
+#define INTERVAL_NUM_COUNTERS 10
+
+struct APEX_CPU;
+
+typedef struct APEX_Interval
+{
+    int enabled;                         /* Set when either file is written */
+    int by_insns;                        /* Length counts instructions */
+    int length;
+    int next;                            /* Cycle or count ending the interval */
+    FILE *csv;                           /* Rows of counters, or NULL */
+    uint64_t in_flight;                  /* Sum of the instructions in flight */
+    int last_tick;                       /* Cycle it was last added at */
+    uint64_t start[INTERVAL_NUM_COUNTERS]; /* Counters at the interval start */
+
+    /* Basic-block vector, NULL bbv when not written */
+    FILE *bbv;
+    uint32_t *block_insns;               /* Indexed by block start instruction */
+    int num_blocks;
+    int block_start;                     /* Current block, -1 between blocks */
+} APEX_Interval;
+
+int interval_init(struct APEX_CPU *cpu, int length, int by_insns,
+                  const char *csv_file, const char *bbv_file);
+void interval_tick(struct APEX_CPU *cpu);
+void interval_retire(APEX_Interval *interval, int pc, int insns,
+                     int ends_block);
+void interval_finish(struct APEX_CPU *cpu);
+void interval_close(APEX_Interval *interval);
+#endif
@@ -0,0 +1,1003 @@
+/*
+ * apex_jit.c
+ * Contains the x86-64 translator for functional runs
+ *
+ * Register use in translated code:
+ *  - rbx   the APEX_Ref being run; guest registers, flags and pc are
+ *          addressed as [rbx + offset]
+ *  - r12   pointer to the caller's instruction budget
+ *  - r13   instructions left in the budget. A block takes its length off
+ *          on entry, or exits if fewer are left; an exit in the middle of
+ *          a block gives back the instructions that did not run.
+ *  - eax, ecx, edx, esi, edi  scratch
+ *
+ * Every exit stores the guest pc and leaves through the shared epilogue
+ * with one of the JIT_EXIT codes in eax. Exits to a fixed target carry
+ * JIT_EXIT_STUB plus the index of their stub, so the dispatcher can patch
+ * the stub into a jump to the target's block.
+ *
+ * The code buffer is mapped RW or RX, never both (jit_protect).
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__unix__)
+#include <sys/mman.h>
+#define JIT_HOST 1
+#else
+#define JIT_HOST 0
+#endif
+
+#include "apex_cpu.h"
+#include "apex_jit.h"
+
+/* Reasons translated code returns to the dispatcher */
+#define JIT_EXIT_NEXT 0       /* Continue at ref->pc */
+#define JIT_EXIT_HALT 1
+#define JIT_EXIT_FAULT 2      /* The access at ref->pc is outside memory */
+#define JIT_EXIT_BUDGET 3     /* Not enough budget left for the block */
+#define JIT_EXIT_STUB 16      /* Chainable exit JIT_EXIT_STUB + index */
+
+/* Upper bound on the bytes emitted for one block */
+#define JIT_INSN_BYTES 160
+#define JIT_BLOCK_BYTES (JIT_BLOCK_INSNS * JIT_INSN_BYTES + 256)
+
+/* Host registers */
+#define EAX 0
+#define ECX 1
+#define EDX 2
+#define ESI 6
+
+/* Condition codes */
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_NS 0x9
+#define CC_L 0xc
+#define CC_GE 0xd
+#define CC_G 0xf
+
+#define REF_OFF(field) ((int)offsetof(APEX_Ref, field))
+#define REG_OFF(reg) (REF_OFF(regs) + 4 * (reg))
+
+static void
+emit8(APEX_Jit *jit, int byte)
+{
+    jit->code[jit->code_used++] = (uint8_t)byte;
+}
+
+static void
+emit32(APEX_Jit *jit, uint32_t value)
+{
+    memcpy(jit->code + jit->code_used, &value, 4);
+    jit->code_used += 4;
+}
+
+static void
+emit64(APEX_Jit *jit, uint64_t value)
+{
+    memcpy(jit->code + jit->code_used, &value, 8);
+    jit->code_used += 8;
+}
+
+/* Emits op with a [rbx + disp] operand; two-byte opcodes start with 0x0f */
+static void
+emit_mem(APEX_Jit *jit, int op, int reg, int disp)
+{
+    if (op > 0xff)
+    {
+        emit8(jit, op >> 8);
+    }
+    emit8(jit, op & 0xff);
+    emit8(jit, 0x83 | (reg << 3));
+    emit32(jit, (uint32_t)disp);
+}
+
+/* Emits a short conditional jump and returns where to patch its target */
+static size_t
+emit_jcc8(APEX_Jit *jit, int cc)
+{
+    emit8(jit, 0x70 | cc);
+    emit8(jit, 0);
+    return jit->code_used - 1;
+}
+
+static size_t
+emit_jmp8(APEX_Jit *jit)
+{
+    emit8(jit, 0xeb);
+    emit8(jit, 0);
+    return jit->code_used - 1;
+}
+
+/* Points the short jump at patch to the current position */
+static void
+land8(APEX_Jit *jit, size_t patch)
+{
+    jit->code[patch] = (uint8_t)(jit->code_used - (patch + 1));
+}
+
+static void
+emit_jmp32(APEX_Jit *jit, size_t target)
+{
+    emit8(jit, 0xe9);
+    emit32(jit, (uint32_t)(target - (jit->code_used + 4)));
+}
+
+/* mov dword [rbx + pc], pc; mov eax, code; jmp epilogue */
+static void
+emit_exit(APEX_Jit *jit, int pc, int code)
+{
+    emit_mem(jit, 0xc7, 0, REF_OFF(pc));
+    emit32(jit, (uint32_t)pc);
+    emit8(jit, 0xb8);
+    emit32(jit, (uint32_t)code);
+    emit_jmp32(jit, jit->epilogue);
+}
+
+/*
+ * Emits an exit to pc that the dispatcher may chain to pc's block, by
+ * overwriting its first five bytes with a jmp
+ */
+static void
+emit_stub(APEX_Jit *jit, int pc)
+{
+    uint32_t *stub;
+
+    if (jit->num_stubs == jit->max_stubs)
+    {
+        stub = realloc(jit->stub, sizeof(uint32_t) * 2 * jit->max_stubs);
+        if (!stub)
+        {
+            /* Not chainable, but still a correct exit */
+            emit_exit(jit, pc, JIT_EXIT_NEXT);
+            return;
+        }
+        jit->stub = stub;
+        jit->max_stubs *= 2;
+    }
+
+    jit->stub[jit->num_stubs] = (uint32_t)jit->code_used;
+    emit_exit(jit, pc, JIT_EXIT_STUB + jit->num_stubs);
+    jit->num_stubs++;
+}
+
+/*
+ * Gives back the instructions of the block that did not run, then exits
+ * with JIT_EXIT_FAULT at the access that faulted
+ */
+static void
+emit_fault(APEX_Jit *jit, int pc, int unrun)
+{
+    emit8(jit, 0x49);                    /* add r13, unrun */
+    emit8(jit, 0x81);
+    emit8(jit, 0xc5);
+    emit32(jit, (uint32_t)unrun);
+    emit_exit(jit, pc, JIT_EXIT_FAULT);
+}
+
+/* Sets the flags from the result in eax, as ref_set_flags(result, 0) */
+static void
+emit_flags(APEX_Jit *jit)
+{
+    emit8(jit, 0x85);                    /* test eax, eax */
+    emit8(jit, 0xc0);
+    emit_mem(jit, 0x0f90 | CC_E, 0, REF_OFF(zero_flag));
+    emit_mem(jit, 0x0f90 | CC_G, 0, REF_OFF(pos_flag));
+    emit_mem(jit, 0x0f90 | CC_L, 0, REF_OFF(neg_flag));
+}
+
+/* Called by translated code when an access misses the last-page cache */
+static int64_t
+jit_load(APEX_Ref *ref, int address)
+{
+    if (!memory_valid(&ref->data_memory, address))
+    {
+        return -1;
+    }
+    return (uint32_t)memory_read(&ref->data_memory, address);
+}
+
+static int
+jit_store(APEX_Ref *ref, int address, int value)
+{
+    if (!memory_valid(&ref->data_memory, address))
+    {
+        return 1;
+    }
+    memory_write(&ref->data_memory, address, value);
+    return 0;
+}
+
+/*
+ * Emits a load into eax, or a store of edx, at the address in esi. The
+ * limit and last-page checks of memory_read and memory_write are inlined;
+ * everything else goes through jit_load or jit_store.
+ */
+static void
+emit_access(APEX_Jit *jit, int store, int pc, int unrun)
+{
+    size_t unlimited, over_limit, miss, done, ok;
+
+    emit_mem(jit, 0x8b, EAX, REF_OFF(data_memory.limit));
+    emit8(jit, 0x85);                    /* test eax, eax */
+    emit8(jit, 0xc0);
+    unlimited = emit_jcc8(jit, CC_E);
+    emit8(jit, 0x39);                    /* cmp esi, eax */
+    emit8(jit, 0xc6);
+    over_limit = emit_jcc8(jit, CC_AE);
+    land8(jit, unlimited);
+
+    emit8(jit, 0x89);                    /* mov eax, esi */
+    emit8(jit, 0xf0);
+    emit8(jit, 0xc1);                    /* shr eax, MEM_PAGE_BITS */
+    emit8(jit, 0xe8);
+    emit8(jit, MEM_PAGE_BITS);
+    emit_mem(jit, 0x3b, EAX, REF_OFF(data_memory.last_page));
+    miss = emit_jcc8(jit, CC_NE);
+    emit8(jit, 0x48);                    /* mov rcx, last_data */
+    emit_mem(jit, 0x8b, ECX, REF_OFF(data_memory.last_data));
+    emit8(jit, 0x89);                    /* mov eax, esi */
+    emit8(jit, 0xf0);
+    emit8(jit, 0x25);                    /* and eax, MEM_PAGE_MASK */
+    emit32(jit, MEM_PAGE_MASK);
+    emit8(jit, store ? 0x89 : 0x8b);     /* mov [rcx + rax * 4], edx/eax */
+    emit8(jit, store ? 0x14 : 0x04);
+    emit8(jit, 0x81);
+    done = emit_jmp8(jit);
+
+    land8(jit, over_limit);
+    land8(jit, miss);
+    emit8(jit, 0x48);                    /* mov rdi, rbx */
+    emit8(jit, 0x89);
+    emit8(jit, 0xdf);
+    emit8(jit, 0x48);                    /* mov rax, helper */
+    emit8(jit, 0xb8);
+    emit64(jit, store ? (uint64_t)(uintptr_t)jit_store
+                      : (uint64_t)(uintptr_t)jit_load);
+    emit8(jit, 0xff);                    /* call rax */
+    emit8(jit, 0xd0);
+    if (store)
+    {
+        emit8(jit, 0x85);                /* test eax, eax */
+        emit8(jit, 0xc0);
+        ok = emit_jcc8(jit, CC_E);
+    }
+    else
+    {
+        emit8(jit, 0x48);                /* test rax, rax */
+        emit8(jit, 0x85);
+        emit8(jit, 0xc0);
+        ok = emit_jcc8(jit, CC_NS);
+    }
+    emit_fault(jit, pc, unrun);
+    land8(jit, ok);
+    land8(jit, done);
+}
+
+/* Emits JUMP or JALR: the target is looked up in the block table inline */
+static void
+emit_indirect(APEX_Jit *jit, const APEX_Instruction *ins, int pc)
+{
+    size_t out_of_code, misaligned, untranslated;
+
+    emit_mem(jit, 0x8b, EAX, REG_OFF(ins->rs1));
+    emit8(jit, 0x05);                    /* add eax, imm */
+    emit32(jit, (uint32_t)ins->imm);
+    if (ins->opcode == OPCODE_JALR)
+    {
+        emit_mem(jit, 0xc7, 0, REG_OFF(ins->rd));
+        emit32(jit, (uint32_t)(pc + 4));
+    }
+    emit_mem(jit, 0x89, EAX, REF_OFF(pc));
+
+    emit8(jit, 0x2d);                    /* sub eax, 4000 */
+    emit32(jit, 4000);
+    emit8(jit, 0x3d);                    /* cmp eax, size * 4 */
+    emit32(jit, (uint32_t)jit->code_memory_size * 4);
+    out_of_code = emit_jcc8(jit, CC_AE);
+    emit8(jit, 0xa8);                    /* test al, 3 */
+    emit8(jit, 3);
+    misaligned = emit_jcc8(jit, CC_NE);
+    emit8(jit, 0x48);                    /* mov rcx, block table */
+    emit8(jit, 0xb9);
+    emit64(jit, (uint64_t)(uintptr_t)jit->block);
+    emit8(jit, 0x48);                    /* mov rcx, [rcx + rax * 2] */
+    emit8(jit, 0x8b);
+    emit8(jit, 0x0c);
+    emit8(jit, 0x41);
+    emit8(jit, 0x48);                    /* test rcx, rcx */
+    emit8(jit, 0x85);
+    emit8(jit, 0xc9);
+    untranslated = emit_jcc8(jit, CC_E);
+    emit8(jit, 0xff);                    /* jmp rcx */
+    emit8(jit, 0xe1);
+
+    land8(jit, out_of_code);
+    land8(jit, misaligned);
+    land8(jit, untranslated);
+    emit8(jit, 0xb8);                    /* mov eax, JIT_EXIT_NEXT */
+    emit32(jit, JIT_EXIT_NEXT);
+    emit_jmp32(jit, jit->epilogue);
+}
+
+/* Emits a conditional branch at the end of a block */
+static void
+emit_branch(APEX_Jit *jit, const APEX_Instruction *ins, int pc)
+{
+    size_t taken;
+    int flag, cc;
+
+    switch (ins->opcode)
+    {
+        case OPCODE_BZ: flag = REF_OFF(zero_flag); cc = CC_NE; break;
+        case OPCODE_BNZ: flag = REF_OFF(zero_flag); cc = CC_E; break;
+        case OPCODE_BP: flag = REF_OFF(pos_flag); cc = CC_NE; break;
+        case OPCODE_BNP: flag = REF_OFF(pos_flag); cc = CC_E; break;
+        case OPCODE_BN: flag = REF_OFF(neg_flag); cc = CC_NE; break;
+        default: flag = REF_OFF(neg_flag); cc = CC_E; break;
+    }
+
+    emit_mem(jit, 0x83, 7, flag);        /* cmp dword flag, 0 */
+    emit8(jit, 0);
+    taken = emit_jcc8(jit, cc);
+    emit_stub(jit, pc + 4);
+    land8(jit, taken);
+    emit_stub(jit, pc + ins->imm);
+}
+
+static int
+valid_reg(int reg)
+{
+    return reg >= 0 && reg < REG_FILE_SIZE;
+}
+
+/* Returns TRUE if ins can be translated */
+static int
+translatable(const APEX_Instruction *ins)
+{
+    switch (ins->opcode)
+    {
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_AND:
+        case OPCODE_OR:
+        case OPCODE_XOR:
+            return valid_reg(ins->rd) && valid_reg(ins->rs1)
+                   && valid_reg(ins->rs2);
+
+        case OPCODE_ADDL:
+        case OPCODE_SUBL:
+        case OPCODE_LOAD:
+        case OPCODE_LOADP:
+        case OPCODE_JALR:
+            return valid_reg(ins->rd) && valid_reg(ins->rs1);
+
+        case OPCODE_MOVC:
+            return valid_reg(ins->rd);
+
+        case OPCODE_CMP:
+        case OPCODE_STORE:
+        case OPCODE_STOREP:
+            return valid_reg(ins->rs1) && valid_reg(ins->rs2);
+
+        case OPCODE_CML:
+        case OPCODE_JUMP:
+            return valid_reg(ins->rs1);
+
+        case OPCODE_BZ:
+        case OPCODE_BNZ:
+        case OPCODE_BP:
+        case OPCODE_BNP:
+        case OPCODE_BN:
+        case OPCODE_BNN:
+        case OPCODE_HALT:
+        case OPCODE_NOP:
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static int
+ends_block(int opcode)
+{
+    switch (opcode)
+    {
+        case OPCODE_BZ:
+        case OPCODE_BNZ:
+        case OPCODE_BP:
+        case OPCODE_BNP:
+        case OPCODE_BN:
+        case OPCODE_BNN:
+        case OPCODE_JUMP:
+        case OPCODE_JALR:
+        case OPCODE_HALT:
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static int
+sets_flags(int opcode)
+{
+    switch (opcode)
+    {
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_AND:
+        case OPCODE_OR:
+        case OPCODE_XOR:
+        case OPCODE_ADDL:
+        case OPCODE_SUBL:
+        case OPCODE_MOVC:
+        case OPCODE_CMP:
+        case OPCODE_CML:
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static int
+accesses_memory(int opcode)
+{
+    return opcode == OPCODE_LOAD || opcode == OPCODE_LOADP
+           || opcode == OPCODE_STORE || opcode == OPCODE_STOREP;
+}
+
+/* Emits rd = rs1 / rs2, with 0 for a zero divisor and no trap on -1 */
+static void
+emit_div(APEX_Jit *jit, const APEX_Instruction *ins)
+{
+    size_t zero, minus_one, done, done_zero;
+
+    emit_mem(jit, 0x8b, ECX, REG_OFF(ins->rs2));
+    emit8(jit, 0x85);                    /* test ecx, ecx */
+    emit8(jit, 0xc9);
+    zero = emit_jcc8(jit, CC_E);
+    emit8(jit, 0x83);                    /* cmp ecx, -1 */
+    emit8(jit, 0xf9);
+    emit8(jit, 0xff);
+    minus_one = emit_jcc8(jit, CC_E);
+    emit8(jit, 0x99);                    /* cdq */
+    emit8(jit, 0xf7);                    /* idiv ecx */
+    emit8(jit, 0xf9);
+    done = emit_jmp8(jit);
+    land8(jit, zero);
+    emit8(jit, 0x31);                    /* xor eax, eax */
+    emit8(jit, 0xc0);
+    done_zero = emit_jmp8(jit);
+    land8(jit, minus_one);
+    emit8(jit, 0xf7);                    /* neg eax */
+    emit8(jit, 0xd8);
+    land8(jit, done);
+    land8(jit, done_zero);
+}
+
+/*
+ * Emits one instruction of a block; k is its position and n the length of
+ * the block. Flags are only written when write_flags is set.
+ */
+static void
+emit_insn(APEX_Jit *jit, const APEX_Instruction *ins, int pc, int k, int n,
+          int write_flags)
+{
+    int rs2 = REG_OFF(ins->rs2);
+
+    switch (ins->opcode)
+    {
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_AND:
+        case OPCODE_OR:
+        case OPCODE_XOR:
+        case OPCODE_ADDL:
+        case OPCODE_SUBL:
+        case OPCODE_MOVC:
+        {
+            if (ins->opcode == OPCODE_MOVC)
+            {
+                emit8(jit, 0xb8);        /* mov eax, imm */
+                emit32(jit, (uint32_t)ins->imm);
+            }
+            else
+            {
+                emit_mem(jit, 0x8b, EAX, REG_OFF(ins->rs1));
+            }
+
+            switch (ins->opcode)
+            {
+                case OPCODE_ADD: emit_mem(jit, 0x03, EAX, rs2); break;
+                case OPCODE_SUB: emit_mem(jit, 0x2b, EAX, rs2); break;
+                case OPCODE_MUL: emit_mem(jit, 0x0faf, EAX, rs2); break;
+                case OPCODE_DIV: emit_div(jit, ins); break;
+                case OPCODE_AND: emit_mem(jit, 0x23, EAX, rs2); break;
+                case OPCODE_OR: emit_mem(jit, 0x0b, EAX, rs2); break;
+                case OPCODE_XOR: emit_mem(jit, 0x33, EAX, rs2); break;
+                case OPCODE_ADDL: emit8(jit, 0x05); emit32(jit, ins->imm); break;
+                case OPCODE_SUBL: emit8(jit, 0x2d); emit32(jit, ins->imm); break;
+            }
+
+            emit_mem(jit, 0x89, EAX, REG_OFF(ins->rd));
+            if (write_flags)
+            {
+                emit_flags(jit);
+            }
+            break;
+        }
+
+        case OPCODE_CMP:
+        case OPCODE_CML:
+        {
+            if (!write_flags)
+            {
+                break;
+            }
+            emit_mem(jit, 0x8b, EAX, REG_OFF(ins->rs1));
+            if (ins->opcode == OPCODE_CMP)
+            {
+                emit_mem(jit, 0x3b, EAX, REG_OFF(ins->rs2));
+            }
+            else
+            {
+                emit8(jit, 0x3d);        /* cmp eax, imm */
+                emit32(jit, (uint32_t)ins->imm);
+            }
+            emit_mem(jit, 0x0f90 | CC_E, 0, REF_OFF(zero_flag));
+            emit_mem(jit, 0x0f90 | CC_G, 0, REF_OFF(pos_flag));
+            emit_mem(jit, 0x0f90 | CC_L, 0, REF_OFF(neg_flag));
+            break;
+        }
+
+        case OPCODE_LOAD:
+        case OPCODE_LOADP:
+        {
+            emit_mem(jit, 0x8b, ESI, REG_OFF(ins->rs1));
+            emit8(jit, 0x81);            /* add esi, imm */
+            emit8(jit, 0xc6);
+            emit32(jit, (uint32_t)ins->imm);
+            emit_access(jit, FALSE, pc, n - k);
+
+            /* As in ref_step, rd is written last and wins over rs1 */
+            if (ins->opcode == OPCODE_LOADP)
+            {
+                emit_mem(jit, 0x83, 0, REG_OFF(ins->rs1));
+                emit8(jit, 4);
+            }
+            emit_mem(jit, 0x89, EAX, REG_OFF(ins->rd));
+            break;
+        }
+
+        case OPCODE_STORE:
+        case OPCODE_STOREP:
+        {
+            emit_mem(jit, 0x8b, ESI, REG_OFF(ins->rs2));
+            emit8(jit, 0x81);            /* add esi, imm */
+            emit8(jit, 0xc6);
+            emit32(jit, (uint32_t)ins->imm);
+            emit_mem(jit, 0x8b, EDX, REG_OFF(ins->rs1));
+            emit_access(jit, TRUE, pc, n - k);
+            if (ins->opcode == OPCODE_STOREP)
+            {
+                emit_mem(jit, 0x83, 0, REG_OFF(ins->rs2));
+                emit8(jit, 4);
+            }
+            break;
+        }
+
+        case OPCODE_BZ:
+        case OPCODE_BNZ:
+        case OPCODE_BP:
+        case OPCODE_BNP:
+        case OPCODE_BN:
+        case OPCODE_BNN:
+        {
+            emit_branch(jit, ins, pc);
+            break;
+        }
+
+        case OPCODE_JUMP:
+        case OPCODE_JALR:
+        {
+            emit_indirect(jit, ins, pc);
+            break;
+        }
+
+        case OPCODE_HALT:
+        {
+            emit_exit(jit, pc, JIT_EXIT_HALT);
+            break;
+        }
+    }
+}
+
+/*
+ * Maps the code buffer read-write for emitting and patching code, or
+ * read-execute for running it. Returns 0, or -1 if the host refuses.
+ */
+static int
+jit_protect(APEX_Jit *jit, int writable)
+{
+    if (jit->writable == writable)
+    {
+        return 0;
+    }
+#if JIT_HOST
+    if (mprotect(jit->code, JIT_CODE_SIZE,
+                 writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC))
+    {
+        return -1;
+    }
+#endif
+    jit->writable = writable;
+    return 0;
+}
+
+/* Discards all translations */
+static void
+jit_flush(APEX_Jit *jit)
+{
+    jit->code_used = jit->code_start;
+    memset(jit->block, 0, sizeof(void *) * jit->code_memory_size);
+    jit->num_stubs = 0;
+    jit->stats.flushes++;
+}
+
+/*
+ * Translates the block starting at instruction index. Returns its entry,
+ * or NULL if the first instruction cannot be translated.
+ */
+static void *
+jit_translate(APEX_Jit *jit, int index)
+{
+    const APEX_Instruction *ins = &jit->code_memory[index];
+    int write_flags[JIT_BLOCK_INSNS];
+    int flags_live = TRUE;
+    size_t budget_ok;
+    void *entry;
+    int n, k;
+
+    for (n = 0; n < JIT_BLOCK_INSNS && index + n < jit->code_memory_size
+                && translatable(&ins[n]);
+         ++n)
+    {
+        if (ends_block(ins[n].opcode))
+        {
+            ++n;
+            break;
+        }
+    }
+    if (n == 0 || jit_protect(jit, TRUE))
+    {
+        return NULL;
+    }
+
+    /*
+     * Only the last flag setter of a block needs to write the flags, unless
+     * an access that may fault comes between it and the next setter
+     */
+    for (k = n - 1; k >= 0; --k)
+    {
+        write_flags[k] = flags_live && sets_flags(ins[k].opcode);
+        if (sets_flags(ins[k].opcode))
+        {
+            flags_live = FALSE;
+        }
+        if (accesses_memory(ins[k].opcode))
+        {
+            flags_live = TRUE;
+        }
+    }
+
+    if (JIT_CODE_SIZE - jit->code_used < JIT_BLOCK_BYTES)
+    {
+        jit_flush(jit);
+    }
+    entry = jit->code + jit->code_used;
+
+    /* if (r13 < n) exit; r13 -= n */
+    emit8(jit, 0x49);                    /* cmp r13, n */
+    emit8(jit, 0x81);
+    emit8(jit, 0xfd);
+    emit32(jit, (uint32_t)n);
+    budget_ok = emit_jcc8(jit, CC_GE);
+    emit_exit(jit, 4000 + 4 * index, JIT_EXIT_BUDGET);
+    land8(jit, budget_ok);
+    emit8(jit, 0x49);                    /* sub r13, n */
+    emit8(jit, 0x81);
+    emit8(jit, 0xed);
+    emit32(jit, (uint32_t)n);
+
+    for (k = 0; k < n; ++k)
+    {
+        emit_insn(jit, &ins[k], 4000 + 4 * (index + k), k, n, write_flags[k]);
+    }
+    if (!ends_block(ins[n - 1].opcode))
+    {
+        emit_stub(jit, 4000 + 4 * (index + n));
+    }
+
+    jit->block[index] = entry;
+    jit->stats.blocks++;
+    jit->stats.block_insns += n;
+    return entry;
+}
+
+/* Returns the translated block at pc, translating it if needed, or NULL */
+static void *
+jit_lookup(APEX_Jit *jit, int pc)
+{
+    int index = (pc - 4000) / 4;
+
+    if (pc < 4000 || (pc - 4000) % 4 != 0 || index >= jit->code_memory_size)
+    {
+        return NULL;
+    }
+    if (jit->block[index])
+    {
+        return jit->block[index];
+    }
+    return jit_translate(jit, index);
+}
+
+/* Emits the entry and exit code at the start of the buffer */
+static void
+emit_trampoline(APEX_Jit *jit)
+{
+    jit->code_used = 0;
+    jit->enter = (Jit_Entry)(void *)jit->code;
+
+    emit8(jit, 0x53);                    /* push rbx */
+    emit8(jit, 0x41);                    /* push r12 */
+    emit8(jit, 0x54);
+    emit8(jit, 0x41);                    /* push r13 */
+    emit8(jit, 0x55);
+    emit8(jit, 0x48);                    /* mov rbx, rdi */
+    emit8(jit, 0x89);
+    emit8(jit, 0xfb);
+    emit8(jit, 0x49);                    /* mov r12, rsi */
+    emit8(jit, 0x89);
+    emit8(jit, 0xf4);
+    emit8(jit, 0x4c);                    /* mov r13, [rsi] */
+    emit8(jit, 0x8b);
+    emit8(jit, 0x2e);
+    emit8(jit, 0xff);                    /* jmp rdx */
+    emit8(jit, 0xe2);
+
+    jit->epilogue = jit->code_used;
+    emit8(jit, 0x4d);                    /* mov [r12], r13 */
+    emit8(jit, 0x89);
+    emit8(jit, 0x2c);
+    emit8(jit, 0x24);
+    emit8(jit, 0x41);                    /* pop r13 */
+    emit8(jit, 0x5d);
+    emit8(jit, 0x41);                    /* pop r12 */
+    emit8(jit, 0x5c);
+    emit8(jit, 0x5b);                    /* pop rbx */
+    emit8(jit, 0xc3);                    /* ret */
+
+    jit->code_start = jit->code_used;
+}
+
+/*
+ * Creates a translator for code_memory. If the host cannot run translated
+ * code, the translator interprets. Returns NULL when out of memory.
+ */
+APEX_Jit *
+jit_create(const APEX_Instruction *code_memory, int code_memory_size)
+{
+    APEX_Jit *jit = calloc(1, sizeof(APEX_Jit));
+
+    if (!jit)
+    {
+        return NULL;
+    }
+    jit->code_memory = code_memory;
+    jit->code_memory_size = code_memory_size;
+    jit->max_stubs = 256;
+    jit->block = calloc(code_memory_size > 0 ? code_memory_size : 1,
+                        sizeof(void *));
+    jit->stub = malloc(sizeof(uint32_t) * jit->max_stubs);
+    if (!jit->block || !jit->stub)
+    {
+        jit_destroy(jit);
+        return NULL;
+    }
+
+#if JIT_HOST
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED)
+    {
+        jit->code = NULL;
+    }
+    jit->writable = TRUE;
+#endif
+    if (jit->code)
+    {
+        emit_trampoline(jit);
+    }
+    return jit;
+}
+
+void
+jit_destroy(APEX_Jit *jit)
+{
+    if (!jit)
+    {
+        return;
+    }
+#if JIT_HOST
+    if (jit->code)
+    {
+        munmap(jit->code, JIT_CODE_SIZE);
+    }
+#endif
+    free(jit->block);
+    free(jit->stub);
+    free(jit);
+}
+
+/*
+ * Discards all translations and makes the translator run code_memory, for
+ * a reloaded or modified code memory. Returns 0, or -1 when out of memory.
+ */
+int
+jit_invalidate(APEX_Jit *jit, const APEX_Instruction *code_memory,
+               int code_memory_size)
+{
+    void **table = realloc(jit->block, sizeof(void *)
+                                           * (code_memory_size > 0
+                                                  ? code_memory_size : 1));
+
+    if (!table)
+    {
+        return -1;
+    }
+    jit->block = table;
+    jit->code_memory = code_memory;
+    jit->code_memory_size = code_memory_size;
+    jit_flush(jit);
+    return 0;
+}
+
+/* Points stub at block, unless a flush has discarded the stub since */
+static void
+jit_chain(APEX_Jit *jit, int stub, void *block, uint64_t flushes)
+{
+    uint8_t *p;
+    int32_t rel;
+
+    if (flushes != jit->stats.flushes || stub >= jit->num_stubs
+        || jit_protect(jit, TRUE))
+    {
+        return;
+    }
+    p = jit->code + jit->stub[stub];
+    rel = (int32_t)((uint8_t *)block - (p + 5));
+    p[0] = 0xe9;
+    memcpy(p + 1, &rel, 4);
+    jit->stats.chained++;
+}
+
+/* Runs budget instructions, or until HALT or an error, on ref_step */
+static int
+jit_interpret(APEX_Jit *jit, APEX_Ref *ref, int64_t budget)
+{
+    APEX_Retire retire;
+    int before = ref->insn_completed;
+    int status = REF_OK;
+
+    while (budget-- > 0 && status == REF_OK)
+    {
+        status = ref_step(ref, &retire);
+    }
+    jit->stats.interpreted += ref->insn_completed - before;
+    return status;
+}
+
+/* Enters translated code until budget runs out, HALT or an error */
+static int
+jit_dispatch(APEX_Jit *jit, APEX_Ref *ref, int64_t budget)
+{
+    APEX_Retire retire;
+    int64_t before;
+    uint64_t flushes;
+    void *block;
+    int reason;
+
+    while (budget > 0)
+    {
+        block = jit_lookup(jit, ref->pc);
+        if (!block)
+        {
+            /* Untranslatable, or a pc ref_step will report */
+            budget--;
+            reason = jit_interpret(jit, ref, 1);
+            if (reason != REF_OK)
+            {
+                return reason;
+            }
+            continue;
+        }
+
+        if (jit_protect(jit, FALSE))
+        {
+            return jit_interpret(jit, ref, budget);
+        }
+
+        before = budget;
+        jit->stats.dispatches++;
+        reason = jit->enter(ref, &budget, block);
+        ref->insn_completed += (int)(before - budget);
+
+        switch (reason)
+        {
+            case JIT_EXIT_NEXT:
+                break;
+
+            case JIT_EXIT_HALT:
+                return REF_HALT;
+
+            case JIT_EXIT_FAULT:
+                /* Reports the fault and leaves the state as it is */
+                return ref_step(ref, &retire);
+
+            case JIT_EXIT_BUDGET:
+                return jit_interpret(jit, ref, budget);
+
+            default:
+                flushes = jit->stats.flushes;
+                block = jit_lookup(jit, ref->pc);
+                if (block)
+                {
+                    jit_chain(jit, reason - JIT_EXIT_STUB, block, flushes);
+                }
+                break;
+        }
+    }
+    return REF_OK;
+}
+
+/*
+ * Runs until HALT, an error, or ref->insn_completed reaches max_insns (0
+ * for no limit). Like ref_run, it always runs at least one instruction and
+ * returns the status of the last one.
+ */
+int
+jit_run(APEX_Jit *jit, APEX_Ref *ref, int max_insns)
+{
+    int64_t budget = max_insns ? (int64_t)max_insns - ref->insn_completed
+                               : INT64_MAX;
+    int before = ref->insn_completed;
+    int status;
+
+    if ((ref->code_memory != jit->code_memory
+         || ref->code_memory_size != jit->code_memory_size)
+        && jit_invalidate(jit, ref->code_memory, ref->code_memory_size))
+    {
+        return ref_run(ref, max_insns);
+    }
+
+    if (!jit->code)
+    {
+        status = ref_run(ref, max_insns);
+        jit->stats.interpreted += ref->insn_completed - before;
+    }
+    else if (budget <= 0)
+    {
+        status = jit_interpret(jit, ref, 1);
+    }
+    else
+    {
+        status = jit_dispatch(jit, ref, budget);
+    }
+
+    jit->stats.insns += ref->insn_completed - before;
+    return status;
+}
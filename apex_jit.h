@@ -0,0 +1,82 @@
+/*
+ * apex_jit.h
+ * Contains declarations of the x86-64 translator for functional runs
+ *
+ * The translator runs APEX code with the semantics of the reference model
+ * (apex_ref.c), much faster, for fast-forwarding through long programs.
+ * It translates a basic block at a time, ending at a branch, JUMP, JALR
+ * or HALT, into x86-64 code in an mmapped code buffer. Translated
+ * code keeps the guest state in the APEX_Ref it runs on, pinned in a host
+ * register, and calls out only for data memory accesses that miss the
+ * memory's last-page cache.
+ *
+ * Blocks are chained: an exit to a fixed target leaves to the dispatcher
+ * the first time, which translates the target and patches the exit into a
+ * direct jump, so hot loops run without leaving translated code. JUMP and
+ * JALR look their target up in the block table inline.
+ *
+ * The code buffer is never writable and executable at once: it is mapped
+ * read-write while blocks are emitted or chained and read-execute while
+ * translated code runs, switching only when the next use needs the other.
+ *
+ * ref_step remains the fallback: it runs instructions that cannot be
+ * translated, the last instructions before the instruction limit, and
+ * everything on hosts other than x86-64 or when no executable memory can
+ * be mapped.
+ *
+ * Translations belong to one code memory. Running on another one, or
+ * calling jit_invalidate after changing the instructions in place, discards
+ * them all, as does a full code buffer.
+ */
+#ifndef _APEX_JIT_H_
+#define _APEX_JIT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "apex_ref.h"
+
+/* Instructions in the longest translated block */
+#define JIT_BLOCK_INSNS 64
+
+/* Size of the code buffer; it is flushed when full */
+#define JIT_CODE_SIZE (4 << 20)
+
+typedef struct APEX_Jit_Stats
+{
+    uint64_t insns;           /* Instructions executed */
+    uint64_t blocks;          /* Blocks translated */
+    uint64_t block_insns;     /* Instructions in them */
+    uint64_t chained;         /* Exits patched into direct jumps */
+    uint64_t dispatches;      /* Entries into translated code */
+    uint64_t interpreted;     /* Instructions run by ref_step instead */
+    uint64_t flushes;         /* Times all translations were discarded */
+} APEX_Jit_Stats;
+
+/* Enters translated code at block; returns why it left */
+typedef int (*Jit_Entry)(APEX_Ref *ref, int64_t *budget, void *block);
+
+typedef struct APEX_Jit
+{
+    const struct APEX_Instruction *code_memory;
+    int code_memory_size;
+    uint8_t *code;            /* Executable buffer, NULL when interpreting */
+    size_t code_used;
+    size_t code_start;        /* First byte after the entry and exit code */
+    size_t epilogue;          /* Offset of the exit code */
+    int writable;             /* The buffer is mapped RW, not RX */
+    Jit_Entry enter;
+    void **block;             /* Translation starting at each instruction */
+    uint32_t *stub;           /* Buffer offsets of the chainable exits */
+    int num_stubs;
+    int max_stubs;
+    APEX_Jit_Stats stats;
+} APEX_Jit;
+
+APEX_Jit *jit_create(const struct APEX_Instruction *code_memory,
+                     int code_memory_size);
+int jit_invalidate(APEX_Jit *jit, const struct APEX_Instruction *code_memory,
+                   int code_memory_size);
+int jit_run(APEX_Jit *jit, APEX_Ref *ref, int max_insns);
+void jit_destroy(APEX_Jit *jit);
+#endif
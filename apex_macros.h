@@ -12,15 +12,19 @@
 #define FALSE 0x0
 #define TRUE 0x1
 
-/* Integers */
+/*
+ * Sizes marked #ifndef can be set by a build configuration (configs/);
+ * the register file is fixed by the ISA.
+ */
+
+/* Words of data memory of each lane of the batch engine */
+#ifndef DATA_MEMORY_SIZE
 #define DATA_MEMORY_SIZE 4096
+#endif
 
 /* Size of integer register file */
 #define REG_FILE_SIZE 16
 
-#define Op_QUEUE_SIZE 16
-
-#define NUM_PHYSICAL_REGS 32 
 /* Numeric OPCODE identifiers for instructions */
 #define OPCODE_ADD 0x0
 #define OPCODE_SUB 0x1
@@ -49,9 +53,46 @@
 #define OPCODE_BNN 0x18        // opcode for BNN
 #define OPCODE_NOP 0x19        // opcode for NOP
 /* Set this flag to 1 to enable debug messages */
+#ifndef ENABLE_DEBUG_MESSAGES
 #define ENABLE_DEBUG_MESSAGES 1
+#endif
 
 /* Set this flag to 1 to enable cycle single-step mode */
+#ifndef ENABLE_SINGLE_STEP
 #define ENABLE_SINGLE_STEP 1
+#endif
+
+/*
+ * Pipeline settings fixed at build time by a configuration (configs/). A
+ * value of 0 or more makes the setting a constant in every stage and takes
+ * the place of its command line option; -1 leaves it to the option.
+ */
+#ifndef CONFIG_MUL_LATENCY
+#define CONFIG_MUL_LATENCY -1
+#endif
+
+#ifndef CONFIG_MEM_LATENCY
+#define CONFIG_MEM_LATENCY -1
+#endif
+
+#ifndef CONFIG_SKIP_IDLE
+#define CONFIG_SKIP_IDLE -1
+#endif
+
+#ifndef CONFIG_FUSION
+#define CONFIG_FUSION -1
+#endif
+
+#ifndef CONFIG_LOOP_BUFFER
+#define CONFIG_LOOP_BUFFER -1
+#endif
+
+#ifndef CONFIG_VALUE_PREDICT
+#define CONFIG_VALUE_PREDICT -1
+#endif
+
+#ifndef CONFIG_LOAD_BYPASS
+#define CONFIG_LOAD_BYPASS -1
+#endif
 
 #endif
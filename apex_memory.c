@@ -0,0 +1,618 @@
+/*
+ * apex_memory.c
+ * Contains the sparse paged data memory
+ */
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "apex_macros.h"
+#include "apex_memory.h"
+
+#define DIR_INDEX(page) ((page) >> MEM_TABLE_BITS)
+#define TABLE_INDEX(page) ((page) & (MEM_TABLE_ENTRIES - 1))
+
+/* Words a hex image is parsed into before they are copied to memory */
+#define LOAD_BUFFER_WORDS 4096
+
+/* Words per line of a hex dump */
+#define DUMP_LINE_WORDS 8
+
+/* Every host allocation of a memory goes through here to be counted */
+static void *
+memory_calloc(APEX_Memory *mem, size_t size)
+{
+    void *block = calloc(1, size);
+
+    if (block)
+    {
+        mem->allocations++;
+    }
+    return block;
+}
+
+int
+memory_init(APEX_Memory *mem, uint32_t limit)
+{
+    memset(mem, 0, sizeof(*mem));
+    mem->dir = memory_calloc(mem, MEM_DIR_ENTRIES * sizeof(Mem_Table *));
+    if (!mem->dir)
+    {
+        return -1;
+    }
+    mem->limit = limit;
+    mem->last_page = MEM_NO_PAGE;
+    mem->chunk_used = MEM_POOL_CHUNK_PAGES;
+    return 0;
+}
+
+void
+memory_free(APEX_Memory *mem)
+{
+    Mem_Chunk *chunk, *next;
+    Mem_Mapping *mapping, *next_mapping;
+    int i;
+
+    if (!mem->dir)
+    {
+        return;
+    }
+
+    for (i = 0; i < MEM_DIR_ENTRIES; ++i)
+    {
+        free(mem->dir[i]);
+    }
+    free(mem->dir);
+
+    for (chunk = mem->chunks; chunk; chunk = next)
+    {
+        next = chunk->next;
+        free(chunk);
+    }
+
+    for (mapping = mem->mappings; mapping; mapping = next_mapping)
+    {
+        next_mapping = mapping->next;
+        munmap(mapping->base, mapping->length);
+        free(mapping);
+    }
+    memset(mem, 0, sizeof(*mem));
+}
+
+/* Hands out a zeroed page from the pool */
+static Mem_Page *
+memory_alloc_page(APEX_Memory *mem)
+{
+    Mem_Chunk *chunk;
+
+    if (mem->chunk_used == MEM_POOL_CHUNK_PAGES)
+    {
+        chunk = memory_calloc(mem, sizeof(Mem_Chunk));
+        if (!chunk)
+        {
+            return NULL;
+        }
+        chunk->next = mem->chunks;
+        mem->chunks = chunk;
+        mem->chunk_used = 0;
+    }
+
+    mem->num_pages++;
+    return &mem->chunks->page[mem->chunk_used++];
+}
+
+/* Returns the page holding a page number, or NULL if it was never written */
+static Mem_Page *
+memory_find_page(const APEX_Memory *mem, uint32_t page)
+{
+    Mem_Table *table = mem->dir[DIR_INDEX(page)];
+
+    return table ? table->page[TABLE_INDEX(page)] : NULL;
+}
+
+/* Same as memory_find_page, but allocates the table and page if needed */
+static Mem_Page *
+memory_touch_page(APEX_Memory *mem, uint32_t page)
+{
+    Mem_Table **table = &mem->dir[DIR_INDEX(page)];
+    Mem_Page **entry;
+
+    if (!*table && !(*table = memory_calloc(mem, sizeof(Mem_Table))))
+    {
+        return NULL;
+    }
+
+    entry = &(*table)->page[TABLE_INDEX(page)];
+    if (!*entry)
+    {
+        *entry = memory_alloc_page(mem);
+    }
+    return *entry;
+}
+
+static void
+out_of_memory(void)
+{
+    fprintf(stderr, "APEX_Error: Out of host memory for data memory pages\n");
+    exit(1);
+}
+
+int
+memory_peek(const APEX_Memory *mem, uint32_t address)
+{
+    Mem_Page *page = memory_find_page(mem, address >> MEM_PAGE_BITS);
+
+    return page ? page->word[address & MEM_PAGE_MASK] : 0;
+}
+
+int
+memory_read_slow(APEX_Memory *mem, uint32_t address)
+{
+    uint32_t number = address >> MEM_PAGE_BITS;
+    Mem_Page *page = memory_find_page(mem, number);
+
+    /* Unwritten pages read as zero and are not allocated */
+    if (!page)
+    {
+        return 0;
+    }
+
+    mem->last_page = number;
+    mem->last_data = page->word;
+    return page->word[address & MEM_PAGE_MASK];
+}
+
+void
+memory_write_slow(APEX_Memory *mem, uint32_t address, int value)
+{
+    uint32_t number = address >> MEM_PAGE_BITS;
+    Mem_Page *page = memory_touch_page(mem, number);
+
+    if (!page)
+    {
+        out_of_memory();
+    }
+
+    mem->last_page = number;
+    mem->last_data = page->word;
+    page->word[address & MEM_PAGE_MASK] = value;
+}
+
+/* Makes dst an independent copy of src. Returns 0, or -1 when out of memory. */
+int
+memory_clone(APEX_Memory *dst, const APEX_Memory *src)
+{
+    Mem_Page *page, *copy;
+    uint32_t number;
+    int i, j;
+
+    if (memory_init(dst, src->limit))
+    {
+        return -1;
+    }
+
+    for (i = 0; i < MEM_DIR_ENTRIES; ++i)
+    {
+        if (!src->dir[i])
+        {
+            continue;
+        }
+        for (j = 0; j < MEM_TABLE_ENTRIES; ++j)
+        {
+            if (!(page = src->dir[i]->page[j]))
+            {
+                continue;
+            }
+            number = ((uint32_t)i << MEM_TABLE_BITS) | j;
+            if (!(copy = memory_touch_page(dst, number)))
+            {
+                memory_free(dst);
+                return -1;
+            }
+            memcpy(copy, page, sizeof(Mem_Page));
+        }
+    }
+    return 0;
+}
+
+/* Returns TRUE if every word of a page is zero */
+static int
+page_is_zero(const Mem_Page *page)
+{
+    int i;
+
+    for (i = 0; i < MEM_PAGE_WORDS; ++i)
+    {
+        if (page->word[i])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Returns nonzero if both memories hold the same words. Limits are ignored. */
+int
+memory_equal(const APEX_Memory *a, const APEX_Memory *b)
+{
+    const Mem_Page *pa, *pb;
+    uint32_t number;
+    int i, j;
+
+    for (i = 0; i < MEM_DIR_ENTRIES; ++i)
+    {
+        if (!a->dir[i] && !b->dir[i])
+        {
+            continue;
+        }
+        for (j = 0; j < MEM_TABLE_ENTRIES; ++j)
+        {
+            number = ((uint32_t)i << MEM_TABLE_BITS) | j;
+            pa = memory_find_page(a, number);
+            pb = memory_find_page(b, number);
+
+            /* A missing page equals a page of zeros */
+            if (pa && pb)
+            {
+                if (memcmp(pa, pb, sizeof(Mem_Page)))
+                {
+                    return 0;
+                }
+            }
+            else if ((pa && !page_is_zero(pa)) || (pb && !page_is_zero(pb)))
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+ * Copies num_words words to consecutive addresses starting at address.
+ * Returns 0, or -1 if they do not fit below the limit.
+ */
+int
+memory_load(APEX_Memory *mem, uint32_t address, const int *words,
+            int num_words)
+{
+    Mem_Page *page;
+    int offset, count;
+
+    if (mem->limit && (address >= mem->limit
+                       || (uint64_t)address + num_words > mem->limit))
+    {
+        return -1;
+    }
+    if ((uint64_t)address + num_words > (uint64_t)UINT32_MAX + 1)
+    {
+        return -1;
+    }
+
+    while (num_words > 0)
+    {
+        offset = address & MEM_PAGE_MASK;
+        count = MEM_PAGE_WORDS - offset;
+        if (count > num_words)
+        {
+            count = num_words;
+        }
+
+        if (!(page = memory_touch_page(mem, address >> MEM_PAGE_BITS)))
+        {
+            out_of_memory();
+        }
+        memcpy(&page->word[offset], words, count * sizeof(int));
+
+        words += count;
+        num_words -= count;
+        address += count;
+    }
+    return 0;
+}
+
+/* Returns TRUE if a file name ends in ".hex" */
+static int
+is_hex_file(const char *filename)
+{
+    size_t length = strlen(filename);
+
+    return length >= 4 && strcmp(filename + length - 4, ".hex") == 0;
+}
+
+/* Returns TRUE if num_words words from address fit below the limit */
+static int
+memory_fits(const APEX_Memory *mem, uint32_t address, uint64_t num_words)
+{
+    uint64_t end = (uint64_t)address + num_words;
+
+    return end <= (mem->limit ? mem->limit : (uint64_t)UINT32_MAX + 1);
+}
+
+/*
+ * Loads a raw image. Whole pages that land on a page boundary and were
+ * never written are pointed at the mapping itself; the rest is copied.
+ * Returns the number of words, or -1.
+ */
+static int
+memory_load_raw(APEX_Memory *mem, char *data, size_t length, uint32_t address,
+                int *mapped)
+{
+    Mem_Table **table;
+    Mem_Page **entry;
+    uint64_t num_words = length / sizeof(int);
+    uint64_t done, count;
+    int can_map;
+
+    if (length % sizeof(int) || !memory_fits(mem, address, num_words))
+    {
+        return -1;
+    }
+
+    /* A page of the mapping must be a page of the memory, and the image
+     * must start on a page boundary for its pages to line up */
+    can_map = sysconf(_SC_PAGESIZE) == sizeof(Mem_Page);
+
+    for (done = 0; done < num_words; done += count)
+    {
+        uint32_t target = address + (uint32_t)done;
+
+        count = MEM_PAGE_WORDS - (target & MEM_PAGE_MASK);
+        if (count > num_words - done)
+        {
+            count = num_words - done;
+        }
+
+        if (can_map && (target & MEM_PAGE_MASK) == 0
+            && done % MEM_PAGE_WORDS == 0)
+        {
+            table = &mem->dir[DIR_INDEX(target >> MEM_PAGE_BITS)];
+            if (!*table && !(*table = memory_calloc(mem, sizeof(Mem_Table))))
+            {
+                out_of_memory();
+            }
+            entry = &(*table)->page[TABLE_INDEX(target >> MEM_PAGE_BITS)];
+
+            /* The kernel zero-fills the tail of the last page */
+            if (!*entry)
+            {
+                *entry = (Mem_Page *)(data + done * sizeof(int));
+                mem->mapped_pages++;
+                *mapped = TRUE;
+                continue;
+            }
+        }
+
+        memory_load(mem, target, (const int *)(data + done * sizeof(int)),
+                    (int)count);
+    }
+
+    /* Cached pages may have been replaced */
+    mem->last_page = MEM_NO_PAGE;
+    return (int)num_words;
+}
+
+/*
+ * Loads a hex image: 32-bit words as up to 8 hex digits, optionally with a
+ * 0x prefix, separated by white space. "@offset" (hex) moves the next word
+ * to that many words past the load address, and '#' starts a comment that
+ * runs to the end of the line. Returns the number of words, or -1.
+ */
+static int
+memory_load_hex(APEX_Memory *mem, const char *data, size_t length,
+                uint32_t address)
+{
+    int buffer[LOAD_BUFFER_WORDS];
+    const char *p = data, *end = data + length, *token;
+    uint64_t offset = 0, start = 0, value;
+    int buffered = 0, total = 0, digits, is_offset;
+
+    while (TRUE)
+    {
+        while (p < end && (isspace((unsigned char)*p) || *p == '#'))
+        {
+            if (*p == '#')
+            {
+                while (p < end && *p != '\n')
+                {
+                    ++p;
+                }
+            }
+            else
+            {
+                ++p;
+            }
+        }
+
+        /* Flush at the end, before a jump and when the buffer is full */
+        is_offset = (p < end && *p == '@');
+        if (buffered && (p == end || is_offset || buffered == LOAD_BUFFER_WORDS))
+        {
+            if (!memory_fits(mem, address, start + buffered)
+                || memory_load(mem, address + (uint32_t)start, buffer,
+                               buffered))
+            {
+                return -1;
+            }
+            total += buffered;
+            buffered = 0;
+        }
+        if (p == end)
+        {
+            return total;
+        }
+
+        token = p;
+        if (is_offset)
+        {
+            ++p;
+        }
+        else if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+        {
+            p += 2;
+        }
+
+        for (value = 0, digits = 0; p < end && isxdigit((unsigned char)*p);
+             ++p, ++digits)
+        {
+            value = value * 16
+                    + (isdigit((unsigned char)*p) ? *p - '0'
+                                                  : tolower((unsigned char)*p)
+                                                        - 'a' + 10);
+            if (value > UINT32_MAX)
+            {
+                return -1;
+            }
+        }
+
+        if (digits == 0 || (p < end && !isspace((unsigned char)*p)
+                            && *p != '#'))
+        {
+            fprintf(stderr, "APEX_Error: Bad token in hex image at byte %ld\n",
+                    (long)(token - data));
+            return -1;
+        }
+
+        if (is_offset)
+        {
+            offset = value;
+        }
+        else
+        {
+            if (buffered == 0)
+            {
+                start = offset;
+            }
+            buffer[buffered++] = (int)(uint32_t)value;
+            offset++;
+        }
+    }
+}
+
+/*
+ * Loads an image file into consecutive words starting at address: a hex
+ * text image if the name ends in ".hex", otherwise raw 32-bit words in host
+ * byte order. Returns the number of words loaded, or -1 if the file cannot
+ * be read, is malformed or does not fit.
+ */
+int
+memory_load_file(APEX_Memory *mem, const char *filename, uint32_t address)
+{
+    Mem_Mapping *mapping;
+    struct stat st;
+    char *data;
+    int fd, words, mapped = FALSE;
+
+    if ((fd = open(filename, O_RDONLY)) < 0)
+    {
+        return -1;
+    }
+    if (fstat(fd, &st) || st.st_size / sizeof(int) > INT32_MAX)
+    {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    /* Private and writable, so mapped pages become copy-on-write */
+    data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    if (is_hex_file(filename))
+    {
+        words = memory_load_hex(mem, data, st.st_size, address);
+    }
+    else
+    {
+        words = memory_load_raw(mem, data, st.st_size, address, &mapped);
+    }
+
+    if (!mapped)
+    {
+        munmap(data, st.st_size);
+        return words;
+    }
+
+    /* Pages now point into the mapping; it lives as long as the memory */
+    if (!(mapping = memory_calloc(mem, sizeof(Mem_Mapping))))
+    {
+        out_of_memory();
+    }
+    mapping->base = data;
+    mapping->length = st.st_size;
+    mapping->next = mem->mappings;
+    mem->mappings = mapping;
+    return words;
+}
+
+/*
+ * Writes num_words words starting at address to a file, in the format
+ * memory_load_file reads back from the same name. Returns 0, or -1.
+ */
+int
+memory_dump_file(const APEX_Memory *mem, const char *filename,
+                 uint32_t address, uint32_t num_words)
+{
+    static const Mem_Page zero_page;
+    const Mem_Page *page;
+    FILE *fp = fopen(filename, is_hex_file(filename) ? "w" : "wb");
+    uint32_t done, count, offset, i;
+    int hex = is_hex_file(filename), error = 0;
+
+    if (!fp)
+    {
+        return -1;
+    }
+
+    if (hex)
+    {
+        fprintf(fp, "# APEX data memory, %u words from address %u\n",
+                num_words, address);
+    }
+
+    for (done = 0; done < num_words && !error; done += count)
+    {
+        offset = (address + done) & MEM_PAGE_MASK;
+        count = MEM_PAGE_WORDS - offset;
+        if (count > num_words - done)
+        {
+            count = num_words - done;
+        }
+
+        page = memory_find_page(mem, (address + done) >> MEM_PAGE_BITS);
+        if (!page)
+        {
+            page = &zero_page;
+        }
+
+        if (!hex)
+        {
+            error = fwrite(&page->word[offset], sizeof(int), count, fp)
+                    != count;
+            continue;
+        }
+
+        for (i = 0; i < count; ++i)
+        {
+            fprintf(fp, "%08x%s", (uint32_t)page->word[offset + i],
+                    (done + i + 1) % DUMP_LINE_WORDS
+                        && done + i + 1 < num_words ? " " : "\n");
+        }
+    }
+
+    error |= ferror(fp);
+    return (fclose(fp) || error) ? -1 : 0;
+}
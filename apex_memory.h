@@ -0,0 +1,122 @@
+/*
+ * apex_memory.h
+ * Contains declarations of the sparse paged data memory
+ *
+ * Data memory is word addressed over a 32-bit address space. Addresses are
+ * split into a directory index, a table index and a word offset; tables
+ * and 4 KiB pages are allocated on first write, so memory that is never
+ * written costs nothing and reads as zero. Pages come from a pool that
+ * allocates them in chunks. The last page accessed is cached so that the
+ * common case, consecutive accesses to the same page, skips the table walk.
+ *
+ * A memory can have a limit: addresses at or above it (including negative
+ * addresses, which are large when taken as unsigned) are invalid, and the
+ * pipeline stops on an access to one.
+ *
+ * Image files are mmapped. Pages of a raw image loaded at a page boundary
+ * are mapped privately into the page table instead of being copied, so a
+ * large image costs only the pages the program touches, and writes to them
+ * go to copy-on-write host pages, never to the file.
+ */
+#ifndef _APEX_MEMORY_H_
+#define _APEX_MEMORY_H_
+
+#include <stdint.h>
+
+/* 32-bit word address = directory index | table index | page offset */
+#define MEM_PAGE_BITS 10
+#define MEM_TABLE_BITS 11
+#define MEM_DIR_BITS 11
+#define MEM_PAGE_WORDS (1 << MEM_PAGE_BITS)     /* 1024 words = 4 KiB */
+#define MEM_TABLE_ENTRIES (1 << MEM_TABLE_BITS)
+#define MEM_DIR_ENTRIES (1 << MEM_DIR_BITS)
+#define MEM_PAGE_MASK (MEM_PAGE_WORDS - 1)
+
+/* Pages the pool allocates at once */
+#define MEM_POOL_CHUNK_PAGES 16
+
+/* Page number no address maps to, marks an empty last-page cache */
+#define MEM_NO_PAGE UINT32_MAX
+
+typedef struct Mem_Page
+{
+    int word[MEM_PAGE_WORDS];
+} Mem_Page;
+
+typedef struct Mem_Table
+{
+    Mem_Page *page[MEM_TABLE_ENTRIES];
+} Mem_Table;
+
+/* A chunk of pages handed out by the pool */
+typedef struct Mem_Chunk
+{
+    struct Mem_Chunk *next;
+    Mem_Page page[MEM_POOL_CHUNK_PAGES];
+} Mem_Chunk;
+
+/* A privately mapped image file whose pages are in the page table */
+typedef struct Mem_Mapping
+{
+    struct Mem_Mapping *next;
+    void *base;
+    size_t length;
+} Mem_Mapping;
+
+typedef struct APEX_Memory
+{
+    Mem_Table **dir;          /* MEM_DIR_ENTRIES tables, NULL until used */
+    uint32_t limit;           /* First invalid address, 0 = none */
+    uint32_t last_page;       /* Page number of last_data, or MEM_NO_PAGE */
+    int *last_data;
+    Mem_Chunk *chunks;        /* Pool: all chunks, newest first */
+    int chunk_used;           /* Pages handed out from the newest chunk */
+    int num_pages;            /* Pages allocated so far */
+    Mem_Mapping *mappings;    /* Image files mapped into the page table */
+    int mapped_pages;         /* Pages that live in those mappings */
+    uint64_t allocations;     /* Host allocations so far */
+} APEX_Memory;
+
+int memory_init(APEX_Memory *mem, uint32_t limit);
+void memory_free(APEX_Memory *mem);
+int memory_clone(APEX_Memory *dst, const APEX_Memory *src);
+int memory_equal(const APEX_Memory *a, const APEX_Memory *b);
+int memory_peek(const APEX_Memory *mem, uint32_t address);
+int memory_read_slow(APEX_Memory *mem, uint32_t address);
+void memory_write_slow(APEX_Memory *mem, uint32_t address, int value);
+int memory_load(APEX_Memory *mem, uint32_t address, const int *words,
+                int num_words);
+int memory_load_file(APEX_Memory *mem, const char *filename,
+                     uint32_t address);
+int memory_dump_file(const APEX_Memory *mem, const char *filename,
+                     uint32_t address, uint32_t num_words);
+
+static inline int
+memory_valid(const APEX_Memory *mem, int address)
+{
+    return !mem->limit || (uint32_t)address < mem->limit;
+}
+
+/* Reads a word, through the last-page cache */
+static inline int
+memory_read(APEX_Memory *mem, uint32_t address)
+{
+    if ((address >> MEM_PAGE_BITS) == mem->last_page)
+    {
+        return mem->last_data[address & MEM_PAGE_MASK];
+    }
+    return memory_read_slow(mem, address);
+}
+
+/* Writes a word, allocating its page on first touch */
+static inline void
+memory_write(APEX_Memory *mem, uint32_t address, int value)
+{
+    if ((address >> MEM_PAGE_BITS) == mem->last_page)
+    {
+        mem->last_data[address & MEM_PAGE_MASK] = value;
+        return;
+    }
+    memory_write_slow(mem, address, value);
+}
+#endif
@@ -0,0 +1,134 @@
+/*
+ * apex_pool.c
+ * Contains the arena and slab allocators
+ */
+#include <stdlib.h>
+
+#include "apex_pool.h"
+
+/* Alignment of everything the arena hands out */
+#define ARENA_ALIGN 16
+
+void
+arena_init(APEX_Arena *arena)
+{
+    arena->blocks = NULL;
+    arena->allocations = 0;
+    arena->bytes = 0;
+}
+
+/* Returns size bytes that stay valid until arena_free, or NULL */
+void *
+arena_alloc(APEX_Arena *arena, size_t size)
+{
+    Arena_Block *block = arena->blocks;
+    size_t header = (sizeof(Arena_Block) + ARENA_ALIGN - 1)
+                    & ~(size_t)(ARENA_ALIGN - 1);
+    size_t block_size;
+    void *p;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (!block || block->size - block->used < size)
+    {
+        block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(header + block_size);
+        if (!block)
+        {
+            return NULL;
+        }
+        arena->allocations++;
+        block->size = block_size;
+        block->used = 0;
+
+        /*
+         * An oversized request gets a block of its own; keep filling the
+         * current one afterwards
+         */
+        if (size > ARENA_BLOCK_SIZE && arena->blocks)
+        {
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        }
+        else
+        {
+            block->next = arena->blocks;
+            arena->blocks = block;
+        }
+    }
+
+    p = (char *)block + header + block->used;
+    block->used += size;
+    arena->bytes += size;
+    return p;
+}
+
+void
+arena_free(APEX_Arena *arena)
+{
+    Arena_Block *block, *next;
+
+    for (block = arena->blocks; block; block = next)
+    {
+        next = block->next;
+        free(block);
+    }
+    arena_init(arena);
+}
+
+/* Carves a new chunk of objects out of the arena onto the free list */
+static int
+slab_grow(APEX_Slab *slab)
+{
+    char *chunk = arena_alloc(slab->arena,
+                              slab->object_size * slab->chunk_objects);
+    Slab_Free *object;
+    int i;
+
+    if (!chunk)
+    {
+        return -1;
+    }
+
+    for (i = slab->chunk_objects - 1; i >= 0; --i)
+    {
+        object = (Slab_Free *)(chunk + i * slab->object_size);
+        object->next = slab->free_list;
+        slab->free_list = object;
+    }
+    slab->capacity += slab->chunk_objects;
+    return 0;
+}
+
+/*
+ * Sets up a pool of object_size objects and preallocates its first chunk,
+ * so a pool sized for the objects in flight never grows while running
+ */
+int
+slab_init(APEX_Slab *slab, APEX_Arena *arena, size_t object_size,
+          int chunk_objects)
+{
+    if (object_size < sizeof(Slab_Free))
+    {
+        object_size = sizeof(Slab_Free);
+    }
+
+    slab->arena = arena;
+    slab->object_size = (object_size + sizeof(void *) - 1)
+                        & ~(sizeof(void *) - 1);
+    slab->chunk_objects = chunk_objects;
+    slab->free_list = NULL;
+    slab->in_use = 0;
+    slab->capacity = 0;
+    return slab_grow(slab);
+}
+
+void *
+slab_alloc_slow(APEX_Slab *slab)
+{
+    if (slab_grow(slab))
+    {
+        return NULL;
+    }
+    return slab_alloc(slab);
+}
@@ -0,0 +1,83 @@
+/*
+ * apex_pool.h
+ * Contains declarations of the arena and slab allocators
+ *
+ * Every APEX_CPU owns an arena: a bump allocator for data that lives as
+ * long as the CPU, released all at once by APEX_cpu_stop. Slab pools carve
+ * fixed-size objects, such as in-flight instruction records, out of arena
+ * chunks and recycle freed objects through a free list, so once the pools
+ * have grown to the number of objects in flight the simulator stops calling
+ * malloc. The arena counts its calls to malloc to make that checkable.
+ */
+#ifndef _APEX_POOL_H_
+#define _APEX_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Default size of an arena block; larger requests get a block of their own */
+#define ARENA_BLOCK_SIZE 65536
+
+typedef struct Arena_Block
+{
+    struct Arena_Block *next;
+    size_t size;               /* Bytes available after the header */
+    size_t used;
+} Arena_Block;
+
+typedef struct APEX_Arena
+{
+    Arena_Block *blocks;       /* Newest first, allocations come from it */
+    uint64_t allocations;      /* Calls to malloc so far */
+    size_t bytes;              /* Bytes handed out */
+} APEX_Arena;
+
+/* A free object is linked through its first bytes */
+typedef struct Slab_Free
+{
+    struct Slab_Free *next;
+} Slab_Free;
+
+typedef struct APEX_Slab
+{
+    APEX_Arena *arena;         /* Where chunks come from */
+    size_t object_size;
+    int chunk_objects;         /* Objects per chunk */
+    Slab_Free *free_list;
+    int in_use;
+    int capacity;              /* Objects in all chunks */
+} APEX_Slab;
+
+void arena_init(APEX_Arena *arena);
+void *arena_alloc(APEX_Arena *arena, size_t size);
+void arena_free(APEX_Arena *arena);
+
+int slab_init(APEX_Slab *slab, APEX_Arena *arena, size_t object_size,
+              int chunk_objects);
+void *slab_alloc_slow(APEX_Slab *slab);
+
+/* Returns an uninitialized object, like malloc, or NULL when out of memory */
+static inline void *
+slab_alloc(APEX_Slab *slab)
+{
+    Slab_Free *object = slab->free_list;
+
+    if (!object)
+    {
+        return slab_alloc_slow(slab);
+    }
+    slab->free_list = object->next;
+    slab->in_use++;
+    return object;
+}
+
+static inline void
+slab_free(APEX_Slab *slab, void *object)
+{
+    Slab_Free *free_object = object;
+
+    free_object->next = slab->free_list;
+    slab->free_list = free_object;
+    slab->in_use--;
+}
+#endif
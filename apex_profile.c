@@ -0,0 +1,120 @@
+/*
+ * apex_profile.c
+ * Contains host-side self-profiling of the simulator
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "apex_profile.h"
+
+static const char *stage_names[PROF_NUM_STAGES] = {
+    "APEX_writeback", "APEX_memory", "APEX_execute", "APEX_decode", "APEX_fetch",
+};
+
+/* Monotonic host time in nanoseconds */
+uint64_t
+profile_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Enables profiling. A sample period of N times one cycle out of every N.
+ * Returns 0 on success and -1 if the trace file cannot be opened.
+ */
+int
+profile_init(APEX_Profile *prof, int sample_period, const char *trace_file)
+{
+    memset(prof, 0, sizeof(*prof));
+    prof->enabled = 1;
+    prof->sample_period
+        = (sample_period > 0) ? sample_period : PROF_DEFAULT_SAMPLE_PERIOD;
+
+    if (trace_file)
+    {
+        prof->trace = fopen(trace_file, "w");
+        if (!prof->trace)
+        {
+            return -1;
+        }
+        fprintf(prof->trace, "cycle,writeback_ns,memory_ns,execute_ns,"
+                             "decode_ns,fetch_ns\n");
+    }
+    return 0;
+}
+
+/*
+ * Accounts one timed cycle. stamps holds num_stages + 1 timestamps taken
+ * around the stage calls, in calling order.
+ */
+void
+profile_sample(APEX_Profile *prof, int cycle, const uint64_t *stamps,
+               int num_stages)
+{
+    int i;
+
+    prof->samples++;
+    for (i = 0; i < num_stages; ++i)
+    {
+        prof->stage_ns[i] += stamps[i + 1] - stamps[i];
+    }
+
+    if (prof->trace)
+    {
+        fprintf(prof->trace, "%d", cycle);
+        for (i = 0; i < PROF_NUM_STAGES; ++i)
+        {
+            fprintf(prof->trace, ",%llu",
+                    (i < num_stages)
+                        ? (unsigned long long)(stamps[i + 1] - stamps[i])
+                        : 0ull);
+        }
+        fprintf(prof->trace, "\n");
+    }
+}
+
+/* Prints the per-stage breakdown and simulation speed */
+void
+profile_report(const APEX_Profile *prof, int cycles, int insns)
+{
+    uint64_t total_ns = 0;
+    double run_s = prof->run_ns / 1e9;
+    int i;
+
+    for (i = 0; i < PROF_NUM_STAGES; ++i)
+    {
+        total_ns += prof->stage_ns[i];
+    }
+
+    printf("----------\n%s\n----------\n", "Host profile:");
+    printf("sampled cycles : %llu (1 in %d)\n",
+           (unsigned long long)prof->samples, prof->sample_period);
+
+    for (i = 0; i < PROF_NUM_STAGES; ++i)
+    {
+        printf("%-15s: %10.1f ns/cycle %6.2f%%\n", stage_names[i],
+               prof->samples ? (double)prof->stage_ns[i] / prof->samples : 0.0,
+               total_ns ? 100.0 * prof->stage_ns[i] / total_ns : 0.0);
+    }
+
+    printf("host time      : %.6f s\n", run_s);
+    if (run_s > 0.0)
+    {
+        printf("speed          : %.2f KCPS %.2f KIPS\n",
+               cycles / run_s / 1000.0, insns / run_s / 1000.0);
+    }
+}
+
+void
+profile_close(APEX_Profile *prof)
+{
+    if (prof->trace)
+    {
+        fclose(prof->trace);
+        prof->trace = NULL;
+    }
+}
@@ -0,0 +1,43 @@
+/*
+ * apex_profile.h
+ * Contains declarations for host-side self-profiling of the simulator
+ *
+ * The profiler measures host nanoseconds spent in each pipeline stage
+ * function. Only every Nth simulated cycle is timed so that the overhead of
+ * reading the clock stays small.
+ */
+#ifndef _APEX_PROFILE_H_
+#define _APEX_PROFILE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Stage indices, in the order the stages are called every cycle */
+#define PROF_WRITEBACK 0
+#define PROF_MEMORY 1
+#define PROF_EXECUTE 2
+#define PROF_DECODE 3
+#define PROF_FETCH 4
+#define PROF_NUM_STAGES 5
+
+/* Default number of cycles between two timed cycles */
+#define PROF_DEFAULT_SAMPLE_PERIOD 64
+
+typedef struct APEX_Profile
+{
+    int enabled;                         /* Set when profiling is requested */
+    int sample_period;                   /* Time one cycle out of every N */
+    uint64_t samples;                    /* Number of timed cycles */
+    uint64_t stage_ns[PROF_NUM_STAGES];  /* Host time summed over samples */
+    uint64_t run_start_ns;               /* Host time at start of the run */
+    uint64_t run_ns;                     /* Host time of the whole run */
+    FILE *trace;                         /* Optional per-sample trace output */
+} APEX_Profile;
+
+uint64_t profile_now_ns(void);
+int profile_init(APEX_Profile *prof, int sample_period, const char *trace_file);
+void profile_sample(APEX_Profile *prof, int cycle, const uint64_t *stamps,
+                    int num_stages);
+void profile_report(const APEX_Profile *prof, int cycles, int insns);
+void profile_close(APEX_Profile *prof);
+#endif
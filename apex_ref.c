@@ -0,0 +1,231 @@
+/*
+ * apex_ref.c
+ * Contains the functional reference model of the APEX ISA
+ *
+ * Semantics:
+ *  - ADD, SUB, MUL, DIV, AND, OR, EXOR: rd = rs1 op rs2
+ *  - ADDL, SUBL: rd = rs1 op imm
+ *  - MOVC: rd = imm
+ *  - The instructions above set the zero, positive and negative flags from
+ *    their result. CMP and CML set them by comparing rs1 with rs2 or imm.
+ *  - LOAD rd,rs1,#imm: rd = mem[rs1 + imm]
+ *  - LOADP: same as LOAD, then rs1 = rs1 + 4
+ *  - STORE rs1,rs2,#imm: mem[rs2 + imm] = rs1
+ *  - STOREP: same as STORE, then rs2 = rs2 + 4
+ *  - BZ, BNZ, BP, BNP, BN, BNN: pc = pc + imm when the flag condition holds
+ *  - JUMP rs1,#imm: pc = rs1 + imm
+ *  - JALR rd,rs1,#imm: rd = pc + 4, pc = rs1 + imm
+ *  - DIV by zero produces 0, and INT_MIN / -1 produces INT_MIN (ref_div)
+ *  - ADD, SUB, MUL and the address and pointer arithmetic wrap around in
+ *    32-bit two's complement on overflow (ref_add, ref_sub, ref_mul)
+ */
+#include <string.h>
+
+#include "apex_cpu.h"
+#include "apex_ref.h"
+
+static void
+ref_set_flags(APEX_Ref *ref, int a, int b)
+{
+    ref->zero_flag = (a == b);
+    ref->neg_flag = (a < b);
+    ref->pos_flag = (a > b);
+}
+
+static void
+ref_write_reg(APEX_Ref *ref, APEX_Retire *retire, int reg, int value)
+{
+    ref->regs[reg] = value;
+    retire->reg[retire->num_reg_writes] = reg;
+    retire->reg_value[retire->num_reg_writes] = value;
+    retire->num_reg_writes++;
+}
+
+/*
+ * Starts the model at PC 4000 with a copy of data_memory, or with an empty
+ * unlimited memory if it is NULL. Returns 0, or -1 when out of memory.
+ */
+int
+ref_init(APEX_Ref *ref, const APEX_Instruction *code_memory,
+         int code_memory_size, const APEX_Memory *data_memory)
+{
+    memset(ref, 0, sizeof(*ref));
+    ref->pc = 4000;
+    ref->code_memory = code_memory;
+    ref->code_memory_size = code_memory_size;
+
+    if (data_memory)
+    {
+        return memory_clone(&ref->data_memory, data_memory);
+    }
+    return memory_init(&ref->data_memory, 0);
+}
+
+void
+ref_free(APEX_Ref *ref)
+{
+    memory_free(&ref->data_memory);
+}
+
+/*
+ * Executes the instruction at ref->pc and describes its effects in retire.
+ * Returns REF_OK, REF_HALT when HALT retired, or an error code; on error
+ * the state is left unchanged.
+ */
+int
+ref_step(APEX_Ref *ref, APEX_Retire *retire)
+{
+    const APEX_Instruction *ins;
+    int index = (ref->pc - 4000) / 4;
+    int next_pc = ref->pc + 4;
+    int rs1, rs2, result, address;
+    int taken = FALSE;
+
+    memset(retire, 0, sizeof(*retire));
+    retire->pc = ref->pc;
+
+    if (ref->pc < 4000 || (ref->pc - 4000) % 4 != 0
+        || index >= ref->code_memory_size)
+    {
+        return REF_BAD_PC;
+    }
+
+    ins = &ref->code_memory[index];
+    retire->opcode = ins->opcode;
+    rs1 = ref->regs[ins->rs1];
+    rs2 = ref->regs[ins->rs2];
+
+    switch (ins->opcode)
+    {
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_AND:
+        case OPCODE_OR:
+        case OPCODE_XOR:
+        case OPCODE_ADDL:
+        case OPCODE_SUBL:
+        case OPCODE_MOVC:
+        {
+            switch (ins->opcode)
+            {
+                case OPCODE_ADD: result = ref_add(rs1, rs2); break;
+                case OPCODE_SUB: result = ref_sub(rs1, rs2); break;
+                case OPCODE_MUL: result = ref_mul(rs1, rs2); break;
+                case OPCODE_DIV: result = ref_div(rs1, rs2); break;
+                case OPCODE_AND: result = rs1 & rs2; break;
+                case OPCODE_OR: result = rs1 | rs2; break;
+                case OPCODE_XOR: result = rs1 ^ rs2; break;
+                case OPCODE_ADDL: result = ref_add(rs1, ins->imm); break;
+                case OPCODE_SUBL: result = ref_sub(rs1, ins->imm); break;
+                default: result = ins->imm; break;
+            }
+            ref_set_flags(ref, result, 0);
+            ref_write_reg(ref, retire, ins->rd, result);
+            break;
+        }
+
+        case OPCODE_CMP:
+        {
+            ref_set_flags(ref, rs1, rs2);
+            break;
+        }
+
+        case OPCODE_CML:
+        {
+            ref_set_flags(ref, rs1, ins->imm);
+            break;
+        }
+
+        case OPCODE_LOAD:
+        case OPCODE_LOADP:
+        {
+            address = ref_add(rs1, ins->imm);
+            if (!memory_valid(&ref->data_memory, address))
+            {
+                return REF_BAD_ADDRESS;
+            }
+            if (ins->opcode == OPCODE_LOADP)
+            {
+                ref_write_reg(ref, retire, ins->rs1, ref_add(rs1, 4));
+            }
+            ref_write_reg(ref, retire, ins->rd,
+                          memory_read(&ref->data_memory, address));
+            break;
+        }
+
+        case OPCODE_STORE:
+        case OPCODE_STOREP:
+        {
+            address = ref_add(rs2, ins->imm);
+            if (!memory_valid(&ref->data_memory, address))
+            {
+                return REF_BAD_ADDRESS;
+            }
+            memory_write(&ref->data_memory, address, rs1);
+            retire->mem_write = TRUE;
+            retire->mem_address = address;
+            retire->mem_value = rs1;
+            if (ins->opcode == OPCODE_STOREP)
+            {
+                ref_write_reg(ref, retire, ins->rs2, ref_add(rs2, 4));
+            }
+            break;
+        }
+
+        case OPCODE_BZ: taken = ref->zero_flag; break;
+        case OPCODE_BNZ: taken = !ref->zero_flag; break;
+        case OPCODE_BP: taken = ref->pos_flag; break;
+        case OPCODE_BNP: taken = !ref->pos_flag; break;
+        case OPCODE_BN: taken = ref->neg_flag; break;
+        case OPCODE_BNN: taken = !ref->neg_flag; break;
+
+        case OPCODE_JUMP:
+        {
+            next_pc = ref_add(rs1, ins->imm);
+            break;
+        }
+
+        case OPCODE_JALR:
+        {
+            ref_write_reg(ref, retire, ins->rd, ref->pc + 4);
+            next_pc = ref_add(rs1, ins->imm);
+            break;
+        }
+
+        case OPCODE_HALT:
+        {
+            ref->insn_completed++;
+            return REF_HALT;
+        }
+    }
+
+    if (taken)
+    {
+        next_pc = ref->pc + ins->imm;
+    }
+
+    ref->pc = next_pc;
+    ref->insn_completed++;
+    return REF_OK;
+}
+
+/*
+ * Runs until HALT, an error, or max_insns instructions (0 for no limit).
+ * Returns the status of the last ref_step.
+ */
+int
+ref_run(APEX_Ref *ref, int max_insns)
+{
+    APEX_Retire retire;
+    int status;
+
+    do
+    {
+        status = ref_step(ref, &retire);
+    } while (status == REF_OK
+             && (max_insns == 0 || ref->insn_completed < max_insns));
+
+    return status;
+}
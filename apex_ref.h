@@ -0,0 +1,96 @@
+/*
+ * apex_ref.h
+ * Contains declarations of the functional reference model of the APEX ISA
+ *
+ * The reference model executes one instruction per call with no notion of
+ * pipeline timing. It defines the architectural result of every opcode and
+ * is what the co-simulation checker compares the pipeline against.
+ */
+#ifndef _APEX_REF_H_
+#define _APEX_REF_H_
+
+#include "apex_macros.h"
+#include "apex_memory.h"
+
+struct APEX_Instruction;
+
+/* Return values of ref_step */
+#define REF_OK 0
+#define REF_HALT 1
+#define REF_BAD_PC 2
+#define REF_BAD_ADDRESS 3
+
+/* Architectural effects of one retired instruction */
+typedef struct APEX_Retire
+{
+    int pc;
+    int opcode;
+    int num_reg_writes;   /* LOADP and STOREP also update their base register */
+    int reg[2];
+    int reg_value[2];
+    int mem_write;        /* TRUE for STORE and STOREP */
+    int mem_address;
+    int mem_value;
+} APEX_Retire;
+
+/* Architectural state of the reference model */
+typedef struct APEX_Ref
+{
+    int pc;
+    int regs[REG_FILE_SIZE];
+    int zero_flag;
+    int pos_flag;
+    int neg_flag;
+    APEX_Memory data_memory;
+    const struct APEX_Instruction *code_memory;
+    int code_memory_size;
+    int insn_completed;
+} APEX_Ref;
+
+/*
+ * Results of ADD, SUB and MUL (and of address arithmetic): computed on
+ * unsigned values so that overflow wraps around in two's complement, as in
+ * hardware, instead of being undefined behaviour
+ */
+static inline int
+ref_add(int a, int b)
+{
+    return (int)((unsigned)a + (unsigned)b);
+}
+
+static inline int
+ref_sub(int a, int b)
+{
+    return (int)((unsigned)a - (unsigned)b);
+}
+
+static inline int
+ref_mul(int a, int b)
+{
+    return (int)((unsigned)a * (unsigned)b);
+}
+
+/*
+ * Result of DIV: 0 for a zero divisor, and INT_MIN / -1 wraps to INT_MIN
+ * like any other division by -1 negates, instead of trapping on the host
+ */
+static inline int
+ref_div(int rs1, int rs2)
+{
+    if (rs2 == 0)
+    {
+        return 0;
+    }
+    if (rs2 == -1)
+    {
+        return (int)(0u - (unsigned)rs1);
+    }
+    return rs1 / rs2;
+}
+
+int ref_init(APEX_Ref *ref, const struct APEX_Instruction *code_memory,
+             int code_memory_size, const APEX_Memory *data_memory);
+int ref_step(APEX_Ref *ref, APEX_Retire *retire);
+int ref_run(APEX_Ref *ref, int max_insns);
+void ref_free(APEX_Ref *ref);
+#endif
@@ -0,0 +1,345 @@
+/*
+ * apex_system.c
+ * Contains the multi-core APEX system with MSI-coherent L1 caches
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apex_api.h"
+#include "apex_system.h"
+
+/* Argument of a core thread */
+typedef struct Core_Thread
+{
+    APEX_System *system;
+    int core;
+    pthread_t thread;
+} Core_Thread;
+
+/*
+ * Creates num_cores cores running copies of the same program. Core i starts
+ * with R0 = i so that a program can tell the cores apart.
+ */
+APEX_System *
+system_create(const APEX_Instruction *code_memory, int code_memory_size,
+              int num_cores)
+{
+    APEX_System *system;
+    int i;
+
+    if (num_cores < 1 || num_cores > SYSTEM_MAX_CORES)
+    {
+        return NULL;
+    }
+
+    system = calloc(1, sizeof(APEX_System));
+    if (!system)
+    {
+        return NULL;
+    }
+
+    system->hit_latency = SYSTEM_HIT_LATENCY;
+    system->bus_latency = SYSTEM_BUS_LATENCY;
+    system->miss_latency = SYSTEM_MISS_LATENCY;
+    system->quantum = SYSTEM_DEFAULT_QUANTUM;
+    if (memory_init(&system->memory, 0))
+    {
+        free(system);
+        return NULL;
+    }
+    pthread_mutex_init(&system->bus, NULL);
+
+    for (i = 0; i < num_cores; ++i)
+    {
+        system->cores[i] = APEX_cpu_create(code_memory, code_memory_size);
+        if (!system->cores[i])
+        {
+            system_destroy(system);
+            return NULL;
+        }
+        system->num_cores++;
+        system->cores[i]->system = system;
+        system->cores[i]->core_id = i;
+        system->cores[i]->regs[0] = i;
+    }
+    return system;
+}
+
+/*
+ * Performs a load or store of one word for a core and returns its latency.
+ * The snooping MSI protocol:
+ *  - Read hit (S/M) or write hit (M): no bus traffic
+ *  - Write hit on S: BusUpgr invalidates the other copies, line becomes M
+ *  - Read miss: BusRd, a Modified copy elsewhere is flushed and both end S
+ *  - Write miss: BusRdX, other copies are flushed or invalidated, line is M
+ *  - Evicting a Modified line writes it back
+ */
+int
+system_access(APEX_System *system, int core, uint32_t address,
+              int is_write, int *value)
+{
+    L1_Stats *stats = &system->l1_stats[core];
+    uint32_t tag = address / L1_LINE_WORDS;
+    int index = tag % L1_NUM_LINES;
+    L1_Line *line = &system->l1[core][index];
+    L1_Line *other;
+    int latency, supplied = FALSE;
+    int i;
+
+    pthread_mutex_lock(&system->bus);
+
+    if (is_write)
+    {
+        stats->stores++;
+    }
+    else
+    {
+        stats->loads++;
+    }
+
+    if (line->state != MSI_INVALID && line->tag == tag)
+    {
+        stats->hits++;
+        latency = system->hit_latency;
+
+        if (is_write && line->state == MSI_SHARED)
+        {
+            stats->bus_upgr++;
+            for (i = 0; i < system->num_cores; ++i)
+            {
+                other = &system->l1[i][index];
+                if (i != core && other->state != MSI_INVALID
+                    && other->tag == tag)
+                {
+                    other->state = MSI_INVALID;
+                    system->l1_stats[i].invalidations++;
+                }
+            }
+            line->state = MSI_MODIFIED;
+            latency = system->bus_latency;
+        }
+    }
+    else
+    {
+        stats->misses++;
+        if (line->state == MSI_MODIFIED)
+        {
+            stats->writebacks++;
+        }
+
+        if (is_write)
+        {
+            stats->bus_rdx++;
+        }
+        else
+        {
+            stats->bus_rd++;
+        }
+
+        for (i = 0; i < system->num_cores; ++i)
+        {
+            other = &system->l1[i][index];
+            if (i == core || other->state == MSI_INVALID || other->tag != tag)
+            {
+                continue;
+            }
+            if (other->state == MSI_MODIFIED)
+            {
+                system->l1_stats[i].flushes++;
+                supplied = TRUE;
+            }
+            if (is_write)
+            {
+                other->state = MSI_INVALID;
+                system->l1_stats[i].invalidations++;
+            }
+            else
+            {
+                other->state = MSI_SHARED;
+            }
+        }
+
+        line->tag = tag;
+        line->state = is_write ? MSI_MODIFIED : MSI_SHARED;
+        latency = supplied ? system->bus_latency : system->miss_latency;
+    }
+
+    if (is_write)
+    {
+        memory_write(&system->memory, address, *value);
+    }
+    else
+    {
+        *value = memory_read(&system->memory, address);
+    }
+
+    pthread_mutex_unlock(&system->bus);
+    return latency;
+}
+
+/* Runs a core up to the end of its quantum. Returns TRUE once it finished. */
+static int
+system_run_quantum(APEX_System *system, int core, int end)
+{
+    APEX_CPU *cpu = system->cores[core];
+
+    if (system->max_cycles && end > system->max_cycles)
+    {
+        end = system->max_cycles;
+    }
+
+    while (cpu->clock < end)
+    {
+        if (APEX_cpu_cycle(cpu, end))
+        {
+            return TRUE;
+        }
+    }
+    return system->max_cycles && cpu->clock >= system->max_cycles;
+}
+
+static void *
+system_core_thread(void *arg)
+{
+    Core_Thread *thread = arg;
+    APEX_System *system = thread->system;
+    int end = 0, finished = FALSE, done;
+
+    while (TRUE)
+    {
+        end += system->quantum;
+        if (!finished && system_run_quantum(system, thread->core, end))
+        {
+            finished = TRUE;
+            pthread_mutex_lock(&system->bus);
+            system->running--;
+            pthread_mutex_unlock(&system->bus);
+        }
+
+        /* Everyone reads running between the two barriers */
+        pthread_barrier_wait(&system->barrier);
+        done = (system->running == 0);
+        pthread_barrier_wait(&system->barrier);
+
+        if (done)
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Runs all cores until each has halted, was stopped or reached max_cycles.
+ * Exits if the host threads could not be started.
+ */
+int
+system_run(APEX_System *system, int serial)
+{
+    Core_Thread threads[SYSTEM_MAX_CORES];
+    int finished[SYSTEM_MAX_CORES] = {0};
+    int i, end, started;
+
+    system->running = system->num_cores;
+
+    if (serial)
+    {
+        for (end = system->quantum; system->running; end += system->quantum)
+        {
+            for (i = 0; i < system->num_cores; ++i)
+            {
+                if (!finished[i] && system_run_quantum(system, i, end))
+                {
+                    finished[i] = TRUE;
+                    system->running--;
+                }
+            }
+        }
+        return 0;
+    }
+
+    pthread_barrier_init(&system->barrier, NULL, system->num_cores);
+    for (started = 0; started < system->num_cores; ++started)
+    {
+        threads[started].system = system;
+        threads[started].core = started;
+        if (pthread_create(&threads[started].thread, NULL, system_core_thread,
+                           &threads[started]))
+        {
+            break;
+        }
+    }
+
+    if (started < system->num_cores)
+    {
+        /* The barrier can never be reached by everyone; give up */
+        fprintf(stderr, "APEX_SYSTEM: Unable to start core threads\n");
+        exit(1);
+    }
+
+    for (i = 0; i < system->num_cores; ++i)
+    {
+        pthread_join(threads[i].thread, NULL);
+    }
+    pthread_barrier_destroy(&system->barrier);
+    return 0;
+}
+
+void
+system_report(const APEX_System *system)
+{
+    const APEX_CPU *cpu;
+    const L1_Stats *stats;
+    uint64_t bus_total = 0;
+    int i, cycles = 0, insns = 0;
+
+    for (i = 0; i < system->num_cores; ++i)
+    {
+        cpu = system->cores[i];
+        stats = &system->l1_stats[i];
+
+        printf("APEX_SYSTEM: core %d: cycles = %d instructions = %d IPC = %.4f%s\n",
+               i, cpu->clock, cpu->insn_completed,
+               cpu->clock ? (double)cpu->insn_completed / cpu->clock : 0.0,
+               cpu->halted ? "" : " (did not halt)");
+        printf("APEX_SYSTEM: core %d: L1 loads = %llu stores = %llu hits = %llu misses = %llu\n",
+               i, (unsigned long long)stats->loads,
+               (unsigned long long)stats->stores,
+               (unsigned long long)stats->hits,
+               (unsigned long long)stats->misses);
+        printf("APEX_SYSTEM: core %d: BusRd = %llu BusRdX = %llu BusUpgr = %llu invalidations = %llu flushes = %llu writebacks = %llu\n",
+               i, (unsigned long long)stats->bus_rd,
+               (unsigned long long)stats->bus_rdx,
+               (unsigned long long)stats->bus_upgr,
+               (unsigned long long)stats->invalidations,
+               (unsigned long long)stats->flushes,
+               (unsigned long long)stats->writebacks);
+
+        if (cpu->clock > cycles)
+        {
+            cycles = cpu->clock;
+        }
+        insns += cpu->insn_completed;
+        bus_total += stats->bus_rd + stats->bus_rdx + stats->bus_upgr;
+    }
+
+    printf("APEX_SYSTEM: %d cores: cycles = %d instructions = %d IPC = %.4f bus transactions = %llu\n",
+           system->num_cores, cycles, insns,
+           cycles ? (double)insns / cycles : 0.0,
+           (unsigned long long)bus_total);
+}
+
+void
+system_destroy(APEX_System *system)
+{
+    int i;
+
+    for (i = 0; i < system->num_cores; ++i)
+    {
+        APEX_cpu_stop(system->cores[i]);
+    }
+    pthread_mutex_destroy(&system->bus);
+    memory_free(&system->memory);
+    free(system);
+}
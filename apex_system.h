@@ -0,0 +1,92 @@
+/*
+ * apex_system.h
+ * Contains declarations of the multi-core APEX system
+ *
+ * N cores, each a full APEX_CPU pipeline, share one data memory. Every core
+ * has a private direct-mapped L1 data cache kept coherent by snooping the
+ * MSI protocol on a shared bus. The caches only model timing and traffic:
+ * data always lives in the shared memory, and every access is atomic with
+ * respect to the bus.
+ *
+ * Each core runs on its own host thread. Threads advance in quanta of
+ * simulated cycles and wait on a barrier at the end of each quantum, so no
+ * core runs more than one quantum ahead of another. The order of accesses
+ * from different cores within a quantum depends on host scheduling; the
+ * serial mode runs the cores round-robin on one thread instead and is
+ * deterministic.
+ */
+#ifndef _APEX_SYSTEM_H_
+#define _APEX_SYSTEM_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "apex_macros.h"
+#include "apex_memory.h"
+
+struct APEX_CPU;
+struct APEX_Instruction;
+
+#define SYSTEM_MAX_CORES 64
+
+/* L1 geometry: direct-mapped, line size in words */
+#define L1_NUM_LINES 64
+#define L1_LINE_WORDS 4
+
+/* Default access latencies in cycles */
+#define SYSTEM_HIT_LATENCY 1
+#define SYSTEM_BUS_LATENCY 4     /* Upgrade or cache-to-cache transfer */
+#define SYSTEM_MISS_LATENCY 20   /* Line read from memory */
+#define SYSTEM_DEFAULT_QUANTUM 1000
+
+/* MSI line states */
+#define MSI_INVALID 0
+#define MSI_SHARED 1
+#define MSI_MODIFIED 2
+
+typedef struct L1_Line
+{
+    int state;
+    uint32_t tag;   /* Line address: word address / L1_LINE_WORDS */
+} L1_Line;
+
+/* Per-core coherence statistics */
+typedef struct L1_Stats
+{
+    uint64_t loads;
+    uint64_t stores;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t bus_rd;         /* Read misses */
+    uint64_t bus_rdx;        /* Write misses */
+    uint64_t bus_upgr;       /* Writes to a Shared line */
+    uint64_t invalidations;  /* Lines invalidated by other cores */
+    uint64_t flushes;        /* Modified lines supplied to other cores */
+    uint64_t writebacks;     /* Modified lines evicted */
+} L1_Stats;
+
+typedef struct APEX_System
+{
+    int num_cores;
+    struct APEX_CPU *cores[SYSTEM_MAX_CORES];
+    L1_Line l1[SYSTEM_MAX_CORES][L1_NUM_LINES];
+    L1_Stats l1_stats[SYSTEM_MAX_CORES];
+    APEX_Memory memory;              /* Shared data memory */
+    int hit_latency;
+    int bus_latency;
+    int miss_latency;
+    int quantum;                     /* Cycles between two barriers */
+    int max_cycles;                  /* Per-core cycle limit, 0 = none */
+    int running;                     /* Cores that have not finished */
+    pthread_mutex_t bus;             /* Serializes all coherence actions */
+    pthread_barrier_t barrier;
+} APEX_System;
+
+APEX_System *system_create(const struct APEX_Instruction *code_memory,
+                           int code_memory_size, int num_cores);
+int system_access(APEX_System *system, int core, uint32_t address,
+                  int is_write, int *value);
+int system_run(APEX_System *system, int serial);
+void system_report(const APEX_System *system);
+void system_destroy(APEX_System *system);
+#endif
@@ -0,0 +1,75 @@
+/*
+ * apex_vpred.c
+ * Contains the last-value and stride load value predictor
+ */
+#include "apex_vpred.h"
+
+static int
+vpred_index(int pc)
+{
+    return (unsigned)pc / 4 % VPRED_ENTRIES;
+}
+
+/*
+ * Sets *value to the predicted value of the load at pc. Returns TRUE if
+ * the predictor is confident enough to predict.
+ */
+int
+vpred_lookup(const APEX_Vpred *vpred, int kind, int pc, int *value)
+{
+    const Vpred_Entry *entry = &vpred->entry[vpred_index(pc)];
+
+    if (entry->pc != pc || entry->confidence < VPRED_THRESHOLD)
+    {
+        return 0;
+    }
+    *value = entry->last;
+    if (kind == VPRED_STRIDE)
+    {
+        *value = (int)((unsigned)entry->last + (unsigned)entry->stride);
+    }
+    return 1;
+}
+
+/* Trains the entry of the load at pc with the value it returned */
+void
+vpred_train(APEX_Vpred *vpred, int kind, int pc, int value)
+{
+    Vpred_Entry *entry = &vpred->entry[vpred_index(pc)];
+    int stride;
+
+    if (entry->pc != pc)
+    {
+        entry->pc = pc;
+        entry->last = value;
+        entry->stride = 0;
+        entry->confidence = 0;
+        return;
+    }
+
+    stride = (int)((unsigned)value - (unsigned)entry->last);
+    if ((kind == VPRED_STRIDE) ? stride == entry->stride : stride == 0)
+    {
+        if (entry->confidence < VPRED_MAX_CONFIDENCE)
+        {
+            entry->confidence++;
+        }
+    }
+    else
+    {
+        entry->confidence = 0;
+    }
+    entry->last = value;
+    entry->stride = stride;
+}
+
+const char *
+vpred_kind_str(int kind)
+{
+    switch (kind)
+    {
+        case VPRED_LAST: return "last value";
+        case VPRED_STRIDE: return "stride";
+    }
+    return "none";
+}
@@ -0,0 +1,45 @@
+/*
+ * apex_vpred.h
+ * Contains declarations of the load value predictor
+ *
+ * The predictor guesses the value a LOAD or LOADP will return from the
+ * values earlier instances of the same load returned: the last value, or
+ * the last value plus the last stride between two values. Each entry
+ * counts how many times in a row its guess would have been right and only
+ * predicts once it is confident, since a wrong prediction that was used
+ * costs a squash.
+ */
+#ifndef _APEX_VPRED_H_
+#define _APEX_VPRED_H_
+
+#include <stdint.h>
+
+/* Entries of the predictor, indexed by PC */
+#define VPRED_ENTRIES 256
+
+/* Right guesses in a row before an entry predicts */
+#define VPRED_THRESHOLD 3
+#define VPRED_MAX_CONFIDENCE 7
+
+/* Predictor kinds */
+#define VPRED_NONE 0
+#define VPRED_LAST 1       /* Last value */
+#define VPRED_STRIDE 2     /* Last value plus last stride */
+
+typedef struct Vpred_Entry
+{
+    int pc;                /* Load owning the entry, 0 when empty */
+    int last;
+    int stride;
+    uint8_t confidence;
+} Vpred_Entry;
+
+typedef struct APEX_Vpred
+{
+    Vpred_Entry entry[VPRED_ENTRIES];
+} APEX_Vpred;
+
+int vpred_lookup(const APEX_Vpred *vpred, int kind, int pc, int *value);
+void vpred_train(APEX_Vpred *vpred, int kind, int pc, int value);
+const char *vpred_kind_str(int kind);
+#endif
@@ -0,0 +1,180 @@
+/*
+ * apex_batch_bench.c
+ * Lane throughput of the batched functional engine
+ *
+ * Runs each program given on the command line on the lanes of one batch,
+ * and on the same number of reference models one after another, and reports
+ * both in lane instructions per second. Every lane starts from the same
+ * state, so the lanes stay converged and the ratio shows what running a
+ * vector of lanes per instruction gains over running each lane on its own.
+ * Fails when a lane does not end with the instruction count and status of
+ * its reference run.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../apex_batch.h"
+#include "../apex_cpu.h"
+#include "../apex_ref.h"
+
+#define DEFAULT_LANES 16
+#define DEFAULT_REPEAT 3
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Runs code on lanes reference models, one after another. Returns the
+ * seconds taken and fills the instruction count and status of the last.
+ */
+static double
+time_ref(const APEX_Instruction *code, int size, int lanes, int *insns,
+         int *status)
+{
+    APEX_Ref ref;
+    double start = now();
+    int lane;
+
+    for (lane = 0; lane < lanes; ++lane)
+    {
+        if (ref_init(&ref, code, size, NULL))
+        {
+            fprintf(stderr, "APEX_BATCH_BENCH: out of memory\n");
+            exit(1);
+        }
+        *status = ref_run(&ref, 0);
+        *insns = ref.insn_completed;
+        ref_free(&ref);
+    }
+    return now() - start;
+}
+
+/*
+ * Runs code on a batch of lanes. Returns the seconds taken, or -1 when a
+ * lane ended unlike the reference run.
+ */
+static double
+time_batch(const APEX_Instruction *code, int size, int lanes, int insns,
+           int status, uint64_t *divergent_steps)
+{
+    APEX_Batch *batch = batch_create(code, size, lanes);
+    double start, elapsed;
+    int lane;
+
+    if (!batch)
+    {
+        fprintf(stderr, "APEX_BATCH_BENCH: out of memory\n");
+        exit(1);
+    }
+
+    start = now();
+    batch_run(batch, 0);
+    elapsed = now() - start;
+
+    for (lane = 0; lane < lanes; ++lane)
+    {
+        if (batch->status[lane] != status
+            || batch_get_insns(batch, lane) != insns)
+        {
+            elapsed = -1;
+        }
+    }
+    *divergent_steps = batch->divergent_steps;
+    batch_destroy(batch);
+    return elapsed;
+}
+
+static void
+print_usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-l lanes] [-r repeat] <file.asm>...\n", prog);
+}
+
+int
+main(int argc, char const *argv[])
+{
+    APEX_Instruction *code;
+    uint64_t divergent_steps;
+    double ref_time, batch_time, t;
+    int lanes = DEFAULT_LANES, repeat = DEFAULT_REPEAT;
+    int i, run, size, insns, status, failed = 0;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i += 2)
+    {
+        if (i + 1 >= argc)
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[i], "-l") == 0)
+        {
+            lanes = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-r") == 0)
+        {
+            repeat = atoi(argv[i + 1]);
+        }
+        else
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (i >= argc || lanes <= 0 || repeat <= 0)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    printf("# %d lanes, vector width %d, best of %d runs, lane MIPS\n", lanes,
+           BATCH_VECTOR_WIDTH, repeat);
+    for (; i < argc; ++i)
+    {
+        code = create_code_memory(argv[i], &size);
+        if (!code)
+        {
+            fprintf(stderr, "APEX_BATCH_BENCH: cannot load %s\n", argv[i]);
+            return 1;
+        }
+
+        ref_time = batch_time = 0;
+        for (run = 0; run < repeat; ++run)
+        {
+            t = time_ref(code, size, lanes, &insns, &status);
+            ref_time = (run == 0 || t < ref_time) ? t : ref_time;
+            t = time_batch(code, size, lanes, insns, status,
+                           &divergent_steps);
+            if (t < 0)
+            {
+                break;
+            }
+            batch_time = (run == 0 || t < batch_time) ? t : batch_time;
+        }
+
+        if (t < 0)
+        {
+            printf("%-40s MISMATCH against ref_run\n", argv[i]);
+            failed = 1;
+        }
+        else
+        {
+            printf("%-40s ref %8.1f batch %8.1f speedup %5.2fx "
+                   "divergent steps %llu\n",
+                   argv[i], (double)insns * lanes / ref_time / 1e6,
+                   (double)insns * lanes / batch_time / 1e6,
+                   ref_time / batch_time,
+                   (unsigned long long)divergent_steps);
+        }
+        free(code);
+    }
+    return failed;
+}
@@ -0,0 +1,224 @@
+/*
+ * apex_workload.c
+ * Synthetic workload generator for the APEX benchmark suite
+ *
+ * Writes an APEX assembly program of the requested kind to stdout. The size
+ * argument scales the dynamic length of the program; every workload is a
+ * bounded loop ending in HALT.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* First instruction address, same as the simulator */
+#define CODE_BASE 4000
+
+/* Elements walked per pass of the array walk, 4 words apart */
+#define ARRAY_ELEMS 256
+#define ARRAY_SRC 0
+#define ARRAY_DST 2048
+
+/* Nodes in the pointer chasing ring and the stride between them */
+#define RING_NODES 64
+#define RING_STRIDE 613
+#define RING_SPAN 4096
+
+/* Trip count of the inner loop of the nested loop workload */
+#define INNER_TRIPS 8
+
+static int insn_count;
+
+/* Prints one instruction and returns its index in code memory */
+static int
+emit(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf("\n");
+    return insn_count++;
+}
+
+/* Byte offset of a branch at the next slot to the instruction at target */
+static int
+branch_offset(int target)
+{
+    return (target - insn_count) * 4;
+}
+
+/* Long dependency chain through R1 */
+static void
+gen_alu_chain(int size)
+{
+    int loop;
+
+    emit("MOVC R1,#1");
+    emit("MOVC R2,#3");
+    emit("MOVC R15,#%d", size);
+    loop = emit("ADD R1,R1,R2");
+    emit("SUB R1,R1,R2");
+    emit("ADDL R1,R1,#1");
+    emit("SUBL R1,R1,#1");
+    emit("OR R1,R1,R2");
+    emit("EXOR R1,R1,R2");
+    emit("AND R1,R1,R2");
+    emit("ADD R1,R1,R2");
+    emit("SUBL R15,R15,#1");
+    emit("BNZ #%d", branch_offset(loop));
+    emit("HALT");
+}
+
+/* Independent ALU operations that only read loop invariant registers */
+static void
+gen_alu_indep(int size)
+{
+    int loop;
+
+    emit("MOVC R1,#7");
+    emit("MOVC R2,#3");
+    emit("MOVC R15,#%d", size);
+    loop = emit("ADD R3,R1,R2");
+    emit("SUB R4,R1,R2");
+    emit("ADDL R5,R1,#1");
+    emit("SUBL R6,R2,#1");
+    emit("OR R7,R1,R2");
+    emit("EXOR R8,R1,R2");
+    emit("AND R9,R1,R2");
+    emit("ADDL R10,R2,#5");
+    emit("SUBL R15,R15,#1");
+    emit("BNZ #%d", branch_offset(loop));
+    emit("HALT");
+}
+
+/* Copies ARRAY_ELEMS elements with LOADP/STOREP, size elements in total */
+static void
+gen_array_walk(int size)
+{
+    int elems = (size < ARRAY_ELEMS) ? size : ARRAY_ELEMS;
+    int passes = (size + elems - 1) / elems;
+    int outer, inner;
+
+    emit("MOVC R13,#%d", passes);
+    outer = emit("MOVC R1,#%d", ARRAY_SRC);
+    emit("MOVC R2,#%d", ARRAY_DST);
+    emit("MOVC R15,#%d", elems);
+    inner = emit("LOADP R3,R1,#0");
+    emit("ADDL R3,R3,#1");
+    emit("STOREP R3,R2,#0");
+    emit("SUBL R15,R15,#1");
+    emit("BNZ #%d", branch_offset(inner));
+    emit("SUBL R13,R13,#1");
+    emit("BNZ #%d", branch_offset(outer));
+    emit("HALT");
+}
+
+/* Builds a ring of linked nodes, then follows it with dependent LOADs */
+static void
+gen_ptr_chase(int size)
+{
+    int i, loop;
+
+    for (i = 0; i < RING_NODES; ++i)
+    {
+        emit("MOVC R1,#%d", (i * RING_STRIDE) % RING_SPAN);
+        emit("MOVC R2,#%d", ((i + 1) % RING_NODES * RING_STRIDE) % RING_SPAN);
+        emit("STORE R2,R1,#0");
+    }
+
+    emit("MOVC R1,#0");
+    emit("MOVC R15,#%d", size);
+    loop = emit("LOAD R1,R1,#0");
+    emit("LOAD R1,R1,#0");
+    emit("LOAD R1,R1,#0");
+    emit("LOAD R1,R1,#0");
+    emit("SUBL R15,R15,#1");
+    emit("BNZ #%d", branch_offset(loop));
+    emit("HALT");
+}
+
+/* Outer BNZ loop around an inner loop with a data dependent BZ */
+static void
+gen_nested_loops(int size)
+{
+    int outer, inner;
+
+    emit("MOVC R3,#1");
+    emit("MOVC R15,#%d", size);
+    outer = emit("MOVC R14,#%d", INNER_TRIPS);
+    inner = emit("ADDL R1,R1,#1");
+    emit("AND R2,R1,R3");
+    emit("BZ #8");
+    emit("ADDL R4,R4,#1");
+    emit("SUBL R14,R14,#1");
+    emit("BNZ #%d", branch_offset(inner));
+    emit("SUBL R15,R15,#1");
+    emit("BNZ #%d", branch_offset(outer));
+    emit("HALT");
+}
+
+/* Calls a leaf function through JALR and returns with JUMP */
+static void
+gen_call_ret(int size)
+{
+    /* The function starts right after the 8 instructions of the caller */
+    int func = CODE_BASE + 8 * 4;
+    int loop;
+
+    emit("MOVC R10,#%d", func);
+    emit("MOVC R15,#%d", size);
+    emit("MOVC R1,#0");
+    emit("MOVC R2,#0");
+    loop = emit("JALR R11,R10,#0");
+    emit("SUBL R15,R15,#1");
+    emit("BNZ #%d", branch_offset(loop));
+    emit("HALT");
+    emit("ADDL R1,R1,#1");
+    emit("ADDL R2,R2,#2");
+    emit("JUMP R11,#0");
+}
+
+typedef struct Workload
+{
+    const char *name;
+    void (*generate)(int size);
+} Workload;
+
+static const Workload workloads[] = {
+    {"alu_chain", gen_alu_chain},       {"alu_indep", gen_alu_indep},
+    {"array_walk", gen_array_walk},     {"ptr_chase", gen_ptr_chase},
+    {"nested_loops", gen_nested_loops}, {"call_ret", gen_call_ret},
+};
+
+#define NUM_WORKLOADS (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+int
+main(int argc, char const *argv[])
+{
+    int i, size;
+
+    if (argc != 3 || (size = atoi(argv[2])) <= 0)
+    {
+        fprintf(stderr, "Usage: %s <workload> <size>\nWorkloads:", argv[0]);
+        for (i = 0; i < NUM_WORKLOADS; ++i)
+        {
+            fprintf(stderr, " %s", workloads[i].name);
+        }
+        fprintf(stderr, "\n");
+        exit(1);
+    }
+
+    for (i = 0; i < NUM_WORKLOADS; ++i)
+    {
+        if (strcmp(argv[1], workloads[i].name) == 0)
+        {
+            workloads[i].generate(size);
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "Unknown workload %s\n", argv[1]);
+    exit(1);
+}
@@ -0,0 +1,109 @@
+#!/bin/sh
+#
+# run_bench.sh
+# Runs the APEX micro-benchmark suite and compares it against a baseline
+#
+# Usage: bench/run_bench.sh [--update]
+#
+# Every workload is generated with apex_workload and simulated with the quiet
+# apex_sim_bench binary. Simulated IPC and host speed (best KCPS out of
+# REPEAT runs) are written to bench/results.txt. The results are then compared
+# against bench/baseline.txt, and the script fails when IPC drops by more than
+# IPC_THRESHOLD percent or a workload no longer runs to HALT. Host speed
+# depends on the machine the baseline was recorded on, so it is only gated
+# when SPEED_THRESHOLD is set, failing when it drops by more than that many
+# percent. With --update the results become the new baseline instead.
+
+BENCH_DIR=$(dirname "$0")
+SIM=${SIM:-$BENCH_DIR/apex_sim_bench}
+GEN=${GEN:-$BENCH_DIR/apex_workload}
+BASELINE=${BASELINE:-$BENCH_DIR/baseline.txt}
+RESULTS=$BENCH_DIR/results.txt
+IPC_THRESHOLD=${IPC_THRESHOLD:-2}
+SPEED_THRESHOLD=${SPEED_THRESHOLD:-}
+MAX_CYCLES=${MAX_CYCLES:-20000000}
+REPEAT=${REPEAT:-3}
+MODE=$1
+
+# workload:size pairs, sized for roughly two million simulated cycles each
+WORKLOADS=${WORKLOADS:-"alu_chain:200000 alu_indep:200000 array_walk:300000 \
+ptr_chase:250000 nested_loops:30000 call_ret:200000"}
+
+echo "# workload size cycles insns ipc kcps status" > "$RESULTS"
+
+for entry in $WORKLOADS
+do
+    name=${entry%%:*}
+    size=${entry##*:}
+    asm=$BENCH_DIR/$name.asm
+    out=$BENCH_DIR/$name.out
+
+    "$GEN" "$name" "$size" > "$asm" || exit 1
+
+    best=0
+    run=0
+    while [ $run -lt "$REPEAT" ]
+    do
+        "$SIM" --profile=4096 --max-cycles "$MAX_CYCLES" "$asm" \
+            < /dev/null > "$out" 2>&1
+        rc=$?
+        kcps=$(sed -n 's/^speed *: *\([0-9.]*\) KCPS.*/\1/p' "$out")
+        best=$(awk -v a="$best" -v b="${kcps:-0}" 'BEGIN { print (b > a) ? b : a }')
+        run=$((run + 1))
+    done
+
+    status=ok
+    if [ $rc -ne 0 ]
+    then
+        status=crash
+    elif grep -aq "Simulation Stopped" "$out"
+    then
+        status=limit
+    fi
+
+    counts=$(grep -ao "cycles = [0-9]* instructions = [0-9]*" "$out" \
+             | awk '{ print $3, $6 }')
+    set -- ${counts:-0 0}
+    ipc=$(awk -v c="$1" -v i="$2" 'BEGIN { printf "%.4f", c ? i / c : 0 }')
+
+    echo "$name $size $1 $2 $ipc $best $status" >> "$RESULTS"
+    rm -f "$out"
+done
+
+if [ "$MODE" = "--update" ]
+then
+    cp "$RESULTS" "$BASELINE"
+    echo "Baseline updated: $BASELINE"
+    cat "$BASELINE"
+    exit 0
+fi
+
+if [ ! -f "$BASELINE" ]
+then
+    echo "No baseline at $BASELINE, run with --update to create one"
+    cat "$RESULTS"
+    exit 1
+fi
+
+awk -v ipc_thr="$IPC_THRESHOLD" -v speed_thr="$SPEED_THRESHOLD" '
+    /^#/ { next }
+    FNR == NR { ipc[$1] = $5; kcps[$1] = $6; status[$1] = $7; next }
+    {
+        verdict = "ok"
+        dipc = dspeed = 0
+        if (!($1 in ipc)) {
+            verdict = "NEW"
+        } else {
+            dipc = ipc[$1] ? 100 * ($5 - ipc[$1]) / ipc[$1] : 0
+            dspeed = kcps[$1] ? 100 * ($6 - kcps[$1]) / kcps[$1] : 0
+            if ($7 != status[$1] || dipc < -ipc_thr \
+                || (speed_thr != "" && dspeed < -speed_thr)) {
+                verdict = "REGRESSION"
+                failed = 1
+            }
+        }
+        printf "%-14s ipc %.4f (%+.1f%%) kcps %10.1f (%+.1f%%) %-6s %s\n",
+               $1, $5, dipc, $6, dspeed, $7, verdict
+    }
+    END { exit failed }
+' "$BASELINE" "$RESULTS"
@@ -0,0 +1,84 @@
+#!/bin/sh
+#
+# gen_config.sh
+# Turns a build configuration into the header of a specialized simulator
+#
+# Usage: configs/gen_config.sh configs/<name>.cfg > apex_config.h
+#
+# A configuration has one KEY=VALUE setting per line; blank lines and lines
+# starting with # are ignored. Each setting becomes a macro that fixes it at
+# compile time (see apex_macros.h); settings left out keep their defaults
+# and, for the pipeline options, stay selectable on the command line.
+#
+#   DATA_MEMORY_SIZE    words of data memory of each batch engine lane
+#   MUL_LATENCY         cycles MUL spends in execute (--mul-latency)
+#   MEM_LATENCY         cycles a load or store spends in memory (--mem-latency)
+#   SKIP_IDLE           0 or 1 (--skip-idle)
+#   FUSION              0 or 1 (--fuse)
+#   LOOP_BUFFER         0 or 1 (--loop-buffer)
+#   VALUE_PREDICT       0, 1 for last value or 2 for stride (--value-predict)
+#   LOAD_BYPASS         0 or 1 (--load-bypass)
+#
+# Unknown keys and values out of range are errors.
+
+CFG=$1
+
+if [ -z "$CFG" ] || [ ! -r "$CFG" ]
+then
+    echo "Usage: $0 <config file>" >&2
+    exit 1
+fi
+
+NAME=$(basename "$CFG" .cfg)
+
+echo "/* Generated by configs/gen_config.sh from $CFG, do not edit */"
+echo "#define APEX_CONFIG_NAME \"$NAME\""
+
+sed -e 's/#.*//' -e 's/[[:space:]]//g' "$CFG" | awk -F= -v cfg="$CFG" '
+function fail(msg)
+{
+    printf "%s:%d: %s\n", cfg, NR, msg > "/dev/stderr"
+    exit 1
+}
+
+BEGIN {
+    # key, macro, smallest and largest value of each setting
+    split("DATA_MEMORY_SIZE:DATA_MEMORY_SIZE:1:16777216 " \
+          "MUL_LATENCY:CONFIG_MUL_LATENCY:1:1000000 " \
+          "MEM_LATENCY:CONFIG_MEM_LATENCY:1:1000000 " \
+          "SKIP_IDLE:CONFIG_SKIP_IDLE:0:1 FUSION:CONFIG_FUSION:0:1 " \
+          "LOOP_BUFFER:CONFIG_LOOP_BUFFER:0:1 " \
+          "VALUE_PREDICT:CONFIG_VALUE_PREDICT:0:2 " \
+          "LOAD_BYPASS:CONFIG_LOAD_BYPASS:0:1", keys, " ")
+    for (i in keys)
+    {
+        split(keys[i], f, ":")
+        macro[f[1]] = f[2]
+        low[f[1]] = f[3]
+        high[f[1]] = f[4]
+    }
+}
+
+$0 == "" { next }
+
+{
+    if (NF != 2)
+    {
+        fail("expected KEY=VALUE")
+    }
+    if (!($1 in macro))
+    {
+        fail("unknown setting " $1)
+    }
+    if ($1 in seen)
+    {
+        fail("setting " $1 " given twice")
+    }
+    if ($2 !~ /^[0-9]+$/ || $2 + 0 < low[$1] || $2 + 0 > high[$1])
+    {
+        fail("bad value " $2 " for " $1)
+    }
+    seen[$1] = 1
+    printf "#define %s %d\n", macro[$1], $2
+}
+' || exit 1
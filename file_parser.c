@@ -210,6 +210,10 @@ create_APEX_instruction(APEX_Instruction *ins, char *buffer)
         strcpy(top_level_tokens[i], "");
     }
 
+    /* Drop the line terminator so that opcodes without operands, such as a
+     * HALT followed by more code, compare equal */
+    buffer[strcspn(buffer, "\r\n")] = '\0';
+
     split_opcode_from_insn_string(buffer, top_level_tokens);
 
     char *token = strtok(top_level_tokens[1], ",");
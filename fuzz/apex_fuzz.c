@@ -0,0 +1,1081 @@
+/*
+ * apex_fuzz.c
+ * Constrained-random program fuzzer for the APEX pipeline
+ *
+ * Generates valid, terminating APEX programs, runs each one through the
+ * pipeline with the co-simulation checker attached and through the fast
+ * functional engines (translator and block cache), runs it on the lanes of
+ * the batch engine with a random data memory image per lane, and
+ * delta-debugs every failing program down to a minimal reproducer written
+ * as an .asm file.
+ *
+ * Register usage of generated programs:
+ *  - R0-R7   data registers, written by ALU operations and loads
+ *  - R8-R11  address registers, only set by MOVC and post-incremented by
+ *            LOADP/STOREP, so every memory access stays inside data memory
+ *  - R12     loop counter of bounded loops
+ *  - R14     link register of JALR calls, R15 holds the function address
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../apex_api.h"
+#include "../apex_batch.h"
+#include "../apex_ref.h"
+
+#define MAX_PROGRAM_SIZE 96
+#define MAX_BODY_SIZE 56
+#define NUM_DATA_REGS 8
+#define FIRST_ADDR_REG 8
+#define NUM_ADDR_REGS 4
+#define LOOP_REG 12
+#define LINK_REG 14
+#define FUNC_REG 15
+#define MAX_ADDR_BASE 1024
+#define MAX_MEM_OFFSET 64
+#define MAX_LOOP_TRIPS 5
+
+/* Reference steps after which a program is considered non-terminating */
+#define MAX_REF_STEPS 4000
+
+/* Lanes of the batch engine run, not a multiple of any vector width */
+#define BATCH_LANES 13
+
+/* Outcome of running one program */
+#define RUN_PASS 0
+#define RUN_INVALID 1   /* Program does not halt cleanly on the reference */
+#define RUN_DIVERGE 2   /* Co-simulation checker reported a mismatch */
+#define RUN_HANG 3      /* Pipeline did not reach HALT in time */
+#define RUN_ENGINE 4    /* Translator or block cache ended in another state */
+#define RUN_SMT_MISMATCH 5 /* An SMT thread ended in another state */
+#define RUN_BATCH 6     /* A batch engine lane ended in another state */
+
+static const char *run_result_str[] = {"pass", "invalid", "divergence", "hang",
+                                       "functional engine mismatch",
+                                       "SMT thread state mismatch",
+                                       "batch lane mismatch"};
+
+/*
+ * Branches and the MOVC loading the function address keep the index of
+ * their target in target[], so removing instructions during minimization
+ * can relink them instead of leaving stale offsets behind.
+ */
+typedef struct Program
+{
+    APEX_Instruction insn[MAX_PROGRAM_SIZE];
+    int target[MAX_PROGRAM_SIZE];   /* Target index, -1 for none */
+    int size;
+} Program;
+
+/* Pipeline settings a program runs with, drawn from its seed */
+typedef struct Fuzz_Config
+{
+    int num_threads;      /* Hardware threads, each with its own program */
+    int fetch_policy;     /* SMT_FETCH_* */
+    int mul_latency;
+    int mem_latency;
+    int skip_idle;
+    int fusion;
+    int loop_buffer;
+    int value_predict;    /* VPRED_* */
+    int load_bypass;
+} Fuzz_Config;
+
+typedef struct Fuzz_Options
+{
+    int num_threads;
+    int num_programs;
+    uint64_t seed;
+    int max_failures;
+    int smt_threads;      /* Hardware threads per run */
+    const char *out_dir;
+} Fuzz_Options;
+
+/* State shared by the worker threads */
+static Fuzz_Options options;
+static pthread_mutex_t fuzz_lock = PTHREAD_MUTEX_INITIALIZER;
+static int next_program;
+static int programs_run;
+static int programs_invalid;
+static int failures;
+
+/* xorshift64* generator, one per program so every program is reproducible */
+static uint64_t
+rng_next(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1Dull;
+}
+
+static int
+rng_range(uint64_t *state, int lo, int hi)
+{
+    return lo + (int)(rng_next(state) % (uint64_t)(hi - lo + 1));
+}
+
+static const char *
+opcode_name(int opcode)
+{
+    switch (opcode)
+    {
+        case OPCODE_ADD: return "ADD";
+        case OPCODE_SUB: return "SUB";
+        case OPCODE_MUL: return "MUL";
+        case OPCODE_DIV: return "DIV";
+        case OPCODE_AND: return "AND";
+        case OPCODE_OR: return "OR";
+        case OPCODE_XOR: return "EXOR";
+        case OPCODE_MOVC: return "MOVC";
+        case OPCODE_LOAD: return "LOAD";
+        case OPCODE_STORE: return "STORE";
+        case OPCODE_BZ: return "BZ";
+        case OPCODE_BNZ: return "BNZ";
+        case OPCODE_HALT: return "HALT";
+        case OPCODE_LOADP: return "LOADP";
+        case OPCODE_STOREP: return "STOREP";
+        case OPCODE_ADDL: return "ADDL";
+        case OPCODE_SUBL: return "SUBL";
+        case OPCODE_CMP: return "CMP";
+        case OPCODE_JUMP: return "JUMP";
+        case OPCODE_JALR: return "JALR";
+        case OPCODE_CML: return "CML";
+        case OPCODE_BP: return "BP";
+        case OPCODE_BNP: return "BNP";
+        case OPCODE_BN: return "BN";
+        case OPCODE_BNN: return "BNN";
+        case OPCODE_NOP: return "NOP";
+    }
+    return "NOP";
+}
+
+static APEX_Instruction *
+emit(Program *prog, int opcode, int rd, int rs1, int rs2, int imm)
+{
+    APEX_Instruction *ins = &prog->insn[prog->size];
+
+    prog->target[prog->size++] = -1;
+    memset(ins, 0, sizeof(*ins));
+    strcpy(ins->opcode_str, opcode_name(opcode));
+    ins->opcode = opcode;
+    ins->rd = rd;
+    ins->rs1 = rs1;
+    ins->rs2 = rs2;
+    ins->imm = imm;
+    return ins;
+}
+
+/* Recomputes the immediates of instructions that have a target */
+static void
+link_program(Program *prog)
+{
+    int i;
+
+    for (i = 0; i < prog->size; ++i)
+    {
+        if (prog->target[i] < 0)
+        {
+            continue;
+        }
+        if (prog->insn[i].opcode == OPCODE_MOVC)
+        {
+            prog->insn[i].imm = 4000 + prog->target[i] * 4;
+        }
+        else
+        {
+            prog->insn[i].imm = (prog->target[i] - i) * 4;
+        }
+    }
+}
+
+/* Writes an instruction in the syntax accepted by file_parser.c */
+static void
+write_instruction(FILE *fp, const APEX_Instruction *ins)
+{
+    switch (ins->opcode)
+    {
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_AND:
+        case OPCODE_OR:
+        case OPCODE_XOR:
+            fprintf(fp, "%s R%d,R%d,R%d", ins->opcode_str, ins->rd, ins->rs1,
+                    ins->rs2);
+            break;
+        case OPCODE_ADDL:
+        case OPCODE_SUBL:
+        case OPCODE_LOAD:
+        case OPCODE_LOADP:
+        case OPCODE_JALR:
+            fprintf(fp, "%s R%d,R%d,#%d", ins->opcode_str, ins->rd, ins->rs1,
+                    ins->imm);
+            break;
+        case OPCODE_STORE:
+        case OPCODE_STOREP:
+            fprintf(fp, "%s R%d,R%d,#%d", ins->opcode_str, ins->rs1, ins->rs2,
+                    ins->imm);
+            break;
+        case OPCODE_MOVC:
+            fprintf(fp, "%s R%d,#%d", ins->opcode_str, ins->rd, ins->imm);
+            break;
+        case OPCODE_CMP:
+            fprintf(fp, "%s R%d,R%d", ins->opcode_str, ins->rs1, ins->rs2);
+            break;
+        case OPCODE_CML:
+        case OPCODE_JUMP:
+            fprintf(fp, "%s R%d,#%d", ins->opcode_str, ins->rs1, ins->imm);
+            break;
+        case OPCODE_BZ:
+        case OPCODE_BNZ:
+        case OPCODE_BP:
+        case OPCODE_BNP:
+        case OPCODE_BN:
+        case OPCODE_BNN:
+            fprintf(fp, "%s #%d", ins->opcode_str, ins->imm);
+            break;
+        default:
+            fprintf(fp, "%s", ins->opcode_str);
+            break;
+    }
+    fprintf(fp, "\n");
+}
+
+static int
+write_program(const char *path, const Program *prog)
+{
+    FILE *fp = fopen(path, "w");
+    int i;
+
+    if (!fp)
+    {
+        return -1;
+    }
+    for (i = 0; i < prog->size; ++i)
+    {
+        write_instruction(fp, &prog->insn[i]);
+    }
+    fclose(fp);
+    return 0;
+}
+
+static int
+data_reg(uint64_t *rng)
+{
+    return rng_range(rng, 0, NUM_DATA_REGS - 1);
+}
+
+/* One instruction, or a DIV with its operands, that never changes control
+ * flow */
+static void
+gen_simple(Program *prog, uint64_t *rng)
+{
+    static const int alu_ops[] = {
+        OPCODE_ADD, OPCODE_SUB, OPCODE_MUL, OPCODE_DIV,
+        OPCODE_AND, OPCODE_OR,  OPCODE_XOR,
+    };
+    /* Operands for the corner cases of DIV, INT_MIN / -1 in particular */
+    static const int edge_values[] = { INT_MIN, -1, INT_MAX };
+    int addr = FIRST_ADDR_REG + rng_range(rng, 0, NUM_ADDR_REGS - 1);
+    int offset = rng_range(rng, 0, MAX_MEM_OFFSET - 1);
+    int reg;
+
+    switch (rng_range(rng, 0, 10))
+    {
+        case 0:
+        case 1:
+        case 2:
+            emit(prog, alu_ops[rng_range(rng, 0, 6)], data_reg(rng),
+                 data_reg(rng), data_reg(rng), 0);
+            break;
+        case 10:
+            /* INT_MIN / -1, too rare to come out of the edge values */
+            reg = data_reg(rng);
+            emit(prog, OPCODE_MOVC, reg, 0, 0, INT_MIN);
+            emit(prog, OPCODE_MOVC, (reg + 1) % NUM_DATA_REGS, 0, 0, -1);
+            emit(prog, OPCODE_DIV, data_reg(rng), reg,
+                 (reg + 1) % NUM_DATA_REGS, 0);
+            break;
+        case 3:
+            emit(prog, rng_range(rng, 0, 1) ? OPCODE_ADDL : OPCODE_SUBL,
+                 data_reg(rng), data_reg(rng), 0, rng_range(rng, -16, 16));
+            break;
+        case 4:
+            emit(prog, OPCODE_MOVC, data_reg(rng), 0, 0,
+                 rng_range(rng, 0, 7) ? rng_range(rng, -100, 100)
+                                      : edge_values[rng_range(rng, 0, 2)]);
+            break;
+        case 5:
+            emit(prog, OPCODE_LOAD, data_reg(rng), addr, 0, offset);
+            break;
+        case 6:
+            emit(prog, OPCODE_LOADP, data_reg(rng), addr, 0, offset);
+            break;
+        case 7:
+            emit(prog, OPCODE_STORE, 0, data_reg(rng), addr, offset);
+            break;
+        case 8:
+            emit(prog, OPCODE_STOREP, 0, data_reg(rng), addr, offset);
+            break;
+        default:
+            if (rng_range(rng, 0, 1))
+            {
+                emit(prog, OPCODE_CMP, 0, data_reg(rng), data_reg(rng), 0);
+            }
+            else
+            {
+                emit(prog, OPCODE_CML, 0, data_reg(rng), 0,
+                     rng_range(rng, -8, 8));
+            }
+            break;
+    }
+}
+
+/* A conditional branch skipping forward over a few simple instructions */
+static void
+gen_forward_branch(Program *prog, uint64_t *rng)
+{
+    static const int branches[] = {
+        OPCODE_BZ, OPCODE_BNZ, OPCODE_BP, OPCODE_BNP, OPCODE_BN, OPCODE_BNN,
+    };
+    int skip = rng_range(rng, 1, 3);
+    int branch = prog->size;
+    int i;
+
+    emit(prog, branches[rng_range(rng, 0, 5)], 0, 0, 0, 0);
+    for (i = 0; i < skip; ++i)
+    {
+        gen_simple(prog, rng);
+    }
+    prog->target[branch] = prog->size;
+}
+
+/* A loop running a few simple instructions a bounded number of times */
+static void
+gen_loop(Program *prog, uint64_t *rng)
+{
+    int body = rng_range(rng, 1, 4);
+    int head, i;
+
+    emit(prog, OPCODE_MOVC, LOOP_REG, 0, 0, rng_range(rng, 1, MAX_LOOP_TRIPS));
+    head = prog->size;
+    for (i = 0; i < body; ++i)
+    {
+        gen_simple(prog, rng);
+    }
+    emit(prog, OPCODE_SUBL, LOOP_REG, LOOP_REG, 0, 1);
+    emit(prog, OPCODE_BNZ, 0, 0, 0, 0);
+    prog->target[prog->size - 1] = head;
+}
+
+/* Builds a random valid program from the given seed */
+static void
+gen_program(Program *prog, uint64_t seed)
+{
+    uint64_t rng = seed * 0x9E3779B97F4A7C15ull + 1;
+    int i, func_addr, has_call = FALSE;
+
+    prog->size = 0;
+
+    for (i = 0; i < NUM_ADDR_REGS; ++i)
+    {
+        emit(prog, OPCODE_MOVC, FIRST_ADDR_REG + i, 0, 0,
+             rng_range(&rng, 0, MAX_ADDR_BASE - 1));
+    }
+    for (i = 0; i < NUM_DATA_REGS; ++i)
+    {
+        if (rng_range(&rng, 0, 1))
+        {
+            emit(prog, OPCODE_MOVC, i, 0, 0, rng_range(&rng, -20, 20));
+        }
+    }
+    func_addr = prog->size;
+    emit(prog, OPCODE_MOVC, FUNC_REG, 0, 0, 0);
+
+    while (prog->size < MAX_BODY_SIZE)
+    {
+        switch (rng_range(&rng, 0, 9))
+        {
+            case 0:
+                gen_forward_branch(prog, &rng);
+                break;
+            case 1:
+                gen_loop(prog, &rng);
+                break;
+            case 2:
+                emit(prog, OPCODE_JALR, LINK_REG, FUNC_REG, 0, 0);
+                has_call = TRUE;
+                break;
+            case 3:
+                emit(prog, OPCODE_NOP, 0, 0, 0, 0);
+                break;
+            default:
+                gen_simple(prog, &rng);
+                break;
+        }
+    }
+    emit(prog, OPCODE_HALT, 0, 0, 0, 0);
+
+    /* Leaf function called through JALR, placed after HALT */
+    prog->target[func_addr] = prog->size;
+    if (has_call)
+    {
+        for (i = rng_range(&rng, 1, 3); i > 0; --i)
+        {
+            gen_simple(prog, &rng);
+        }
+        emit(prog, OPCODE_JUMP, 0, LINK_REG, 0, 0);
+    }
+    link_program(prog);
+}
+
+/*
+ * Draws the pipeline settings of the programs with the given seed, each
+ * feature on about half the time. The stream is separate from the ones of
+ * gen_program, so a seed keeps its programs.
+ */
+static void
+gen_config(Fuzz_Config *config, uint64_t seed)
+{
+    uint64_t rng = seed * 0xC2B2AE3D27D4EB4Full + 1;
+
+    config->mul_latency = rng_range(&rng, 0, 1) ? 1 : rng_range(&rng, 2, 4);
+    config->mem_latency = rng_range(&rng, 0, 1) ? 1 : rng_range(&rng, 2, 4);
+    config->skip_idle = rng_range(&rng, 0, 1);
+    config->fusion = rng_range(&rng, 0, 1);
+    config->loop_buffer = rng_range(&rng, 0, 1);
+    config->value_predict = rng_range(&rng, 0, 1) ? VPRED_NONE
+                                                  : rng_range(&rng, 1, 2);
+    config->load_bypass = rng_range(&rng, 0, 1);
+    config->fetch_policy = rng_range(&rng, 0, 1) ? SMT_FETCH_RR
+                                                 : SMT_FETCH_ICOUNT;
+
+    /* SMT does not combine with the loop buffer */
+    config->num_threads = options.smt_threads;
+    if (config->num_threads > 1)
+    {
+        config->loop_buffer = FALSE;
+    }
+}
+
+/* Writes the apex_sim options selecting config to buf */
+static void
+format_config(char *buf, size_t size, const Fuzz_Config *config)
+{
+    snprintf(buf, size, "--mul-latency %d --mem-latency %d%s%s%s%s%s%s",
+             config->mul_latency, config->mem_latency,
+             config->skip_idle ? " --skip-idle" : "",
+             config->fusion ? " --fuse" : "",
+             config->loop_buffer ? " --loop-buffer" : "",
+             config->value_predict == VPRED_LAST     ? " --value-predict last"
+             : config->value_predict == VPRED_STRIDE ? " --value-predict stride"
+                                                     : "",
+             config->load_bypass ? " --load-bypass" : "",
+             config->num_threads == 1 ? ""
+             : config->fetch_policy == SMT_FETCH_RR
+                 ? " --fetch-policy rr"
+                 : " --fetch-policy icount");
+}
+
+static int
+same_state(const APEX_Ref *a, const APEX_Ref *b)
+{
+    return a->pc == b->pc && a->insn_completed == b->insn_completed
+           && memcmp(a->regs, b->regs, sizeof(a->regs)) == 0
+           && a->zero_flag == b->zero_flag && a->pos_flag == b->pos_flag
+           && a->neg_flag == b->neg_flag
+           && memory_equal(&a->data_memory, &b->data_memory);
+}
+
+/*
+ * Returns TRUE if the translator and the block cache both end in the state
+ * ref_run left ref in
+ */
+static int
+engines_match(const Program *prog, const APEX_Ref *ref)
+{
+    APEX_Jit *jit = jit_create(prog->insn, prog->size);
+    APEX_Bb_Cache *cache = bb_create(prog->insn, prog->size);
+    APEX_Ref out;
+    int match = TRUE;
+
+    if (jit && !ref_init(&out, prog->insn, prog->size, NULL))
+    {
+        match = jit_run(jit, &out, MAX_REF_STEPS) == REF_HALT
+                && same_state(&out, ref);
+        ref_free(&out);
+    }
+    if (match && cache && !ref_init(&out, prog->insn, prog->size, NULL))
+    {
+        match = bb_run(cache, &out, MAX_REF_STEPS) == REF_HALT
+                && same_state(&out, ref);
+        ref_free(&out);
+    }
+
+    jit_destroy(jit);
+    bb_destroy(cache);
+    return match;
+}
+
+/*
+ * Returns TRUE if lane of batch ended with the status, instruction count,
+ * registers, flags and data memory of ref, which ref_run left with status
+ */
+static int
+lane_matches(const APEX_Batch *batch, int lane, const APEX_Ref *ref,
+             int status)
+{
+    int i;
+
+    if (batch->status[lane] != status
+        || batch_get_insns(batch, lane) != ref->insn_completed
+        || !batch->zero_flag[lane] != !ref->zero_flag
+        || !batch->pos_flag[lane] != !ref->pos_flag
+        || !batch->neg_flag[lane] != !ref->neg_flag)
+    {
+        return FALSE;
+    }
+    for (i = 0; i < REG_FILE_SIZE; ++i)
+    {
+        if (batch_get_reg(batch, lane, i) != ref->regs[i])
+        {
+            return FALSE;
+        }
+    }
+    for (i = 0; i < DATA_MEMORY_SIZE; ++i)
+    {
+        if (batch_get_mem(batch, lane, i) != memory_peek(&ref->data_memory, i))
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Returns TRUE if every lane of a batch run of prog ends in the state
+ * ref_run reaches from the same data memory image. The images are random,
+ * so loaded values and the branches on them differ between lanes; they are
+ * drawn from the program itself so that minimization sees the same ones.
+ */
+static int
+batch_matches(const Program *prog)
+{
+    APEX_Batch *batch = batch_create(prog->insn, prog->size, BATCH_LANES);
+    APEX_Memory mem;
+    APEX_Ref ref[BATCH_LANES];
+    int status[BATCH_LANES];
+    int image[DATA_MEMORY_SIZE];
+    uint64_t rng = 0x9e3779b97f4a7c15ull;
+    int lane, i, num_refs = 0, match = TRUE;
+
+    if (!batch)
+    {
+        return TRUE;
+    }
+    for (i = 0; i < prog->size; ++i)
+    {
+        rng = (rng ^ (uint64_t)(prog->insn[i].opcode * 31 + prog->insn[i].imm))
+              * 0x100000001b3ull;
+    }
+
+    for (lane = 0; lane < BATCH_LANES; ++lane)
+    {
+        for (i = 0; i < DATA_MEMORY_SIZE; ++i)
+        {
+            image[i] = (int)(uint32_t)rng_next(&rng);
+        }
+        batch_load_memory(batch, lane, image, DATA_MEMORY_SIZE);
+
+        if (memory_init(&mem, DATA_MEMORY_SIZE))
+        {
+            break;
+        }
+        memory_load(&mem, 0, image, DATA_MEMORY_SIZE);
+        i = ref_init(&ref[lane], prog->insn, prog->size, &mem);
+        memory_free(&mem);
+        if (i)
+        {
+            break;
+        }
+        ++num_refs;
+        status[lane] = ref_run(&ref[lane], MAX_REF_STEPS);
+    }
+
+    if (num_refs == BATCH_LANES)
+    {
+        batch_run(batch, (uint64_t)MAX_REF_STEPS * BATCH_LANES);
+        for (lane = 0; lane < BATCH_LANES && match; ++lane)
+        {
+            match = lane_matches(batch, lane, &ref[lane], status[lane]);
+        }
+    }
+
+    for (lane = 0; lane < num_refs; ++lane)
+    {
+        ref_free(&ref[lane]);
+    }
+    batch_destroy(batch);
+    return match;
+}
+
+/*
+ * Returns TRUE if thread t of cpu ended with the registers, flags and data
+ * memory ref ended with. The state of thread 0 is the one in the CPU.
+ */
+static int
+thread_matches(const APEX_CPU *cpu, int t, const APEX_Ref *ref)
+{
+    const APEX_Thread *thread = &cpu->threads[t];
+
+    if (t == 0)
+    {
+        return memcmp(cpu->regs, ref->regs, sizeof(ref->regs)) == 0
+               && cpu->zero_flag == ref->zero_flag
+               && cpu->pos_flag == ref->pos_flag
+               && cpu->neg_flag == ref->neg_flag
+               && memory_equal(&cpu->data_memory, &ref->data_memory);
+    }
+    return memcmp(thread->regs, ref->regs, sizeof(ref->regs)) == 0
+           && thread->zero_flag == ref->zero_flag
+           && thread->pos_flag == ref->pos_flag
+           && thread->neg_flag == ref->neg_flag
+           && memory_equal(&thread->data_memory, &ref->data_memory);
+}
+
+/*
+ * Runs the programs of the config->num_threads threads on the reference
+ * and the functional engines, then on the pipeline set up as config. A
+ * single thread runs with the co-simulation checker; with SMT, where the
+ * checker cannot follow, the final state of every thread is compared with
+ * its reference run instead.
+ */
+static int
+run_program(const Program *prog, const Fuzz_Config *config)
+{
+    APEX_CPU *cpu;
+    APEX_Ref ref[SMT_MAX_THREADS];
+    APEX_Instruction *code;
+    int result = RUN_PASS, insns = 0;
+    int t, num_refs;
+
+    for (num_refs = 0; num_refs < config->num_threads; ++num_refs)
+    {
+        t = num_refs;
+        if (ref_init(&ref[t], prog[t].insn, prog[t].size, NULL))
+        {
+            result = RUN_INVALID;
+            break;
+        }
+        if (ref_run(&ref[t], MAX_REF_STEPS) != REF_HALT)
+        {
+            result = RUN_INVALID;
+            ++num_refs;
+            break;
+        }
+        if (!engines_match(&prog[t], &ref[t]))
+        {
+            result = RUN_ENGINE;
+            ++num_refs;
+            break;
+        }
+        if (!batch_matches(&prog[t]))
+        {
+            result = RUN_BATCH;
+            ++num_refs;
+            break;
+        }
+        insns += ref[t].insn_completed;
+    }
+
+    cpu = NULL;
+    if (result == RUN_PASS)
+    {
+        cpu = APEX_cpu_create(prog[0].insn, prog[0].size);
+        result = cpu ? RUN_PASS : RUN_INVALID;
+    }
+    for (t = 1; t < config->num_threads && result == RUN_PASS; ++t)
+    {
+        code = malloc(sizeof(APEX_Instruction) * prog[t].size);
+        if (code)
+        {
+            memcpy(code, prog[t].insn, sizeof(APEX_Instruction) * prog[t].size);
+        }
+        if (APEX_cpu_add_thread_from_code(cpu, code, prog[t].size))
+        {
+            result = RUN_INVALID;
+        }
+    }
+    if (result == RUN_PASS && config->num_threads == 1
+        && !(cpu->cosim = cosim_create(cpu)))
+    {
+        result = RUN_INVALID;
+    }
+
+    if (result == RUN_PASS)
+    {
+        cpu->mul_latency = config->mul_latency;
+        cpu->mem_latency = config->mem_latency;
+        cpu->skip_idle = config->skip_idle;
+        cpu->fusion = config->fusion;
+        cpu->loop_buffer = config->loop_buffer;
+        cpu->value_predict = config->value_predict;
+        cpu->load_bypass = config->load_bypass;
+        cpu->fetch_policy = config->fetch_policy;
+
+        /* Every instruction should retire well within 20 cycles */
+        switch (APEX_cpu_run_until(cpu, NULL, NULL, 20 * insns + 100))
+        {
+            case APEX_RUN_HALT: result = RUN_PASS; break;
+            case APEX_RUN_STOPPED: result = RUN_DIVERGE; break;
+            default: result = RUN_HANG; break;
+        }
+        for (t = 0; t < config->num_threads && config->num_threads > 1
+                    && result == RUN_PASS;
+             ++t)
+        {
+            if (!thread_matches(cpu, t, &ref[t]))
+            {
+                result = RUN_SMT_MISMATCH;
+            }
+        }
+    }
+
+    if (cpu)
+    {
+        APEX_cpu_stop(cpu);
+    }
+    for (t = 0; t < num_refs; ++t)
+    {
+        ref_free(&ref[t]);
+    }
+    return result;
+}
+
+/*
+ * Copies prog without the instructions in [start, end). Targets inside the
+ * removed range move to the first instruction after it.
+ */
+static void
+remove_range(Program *out, const Program *prog, int start, int end)
+{
+    int i, j, target;
+
+    for (i = 0, j = 0; i < prog->size; ++i)
+    {
+        if (i >= start && i < end)
+        {
+            continue;
+        }
+        target = prog->target[i];
+        if (target >= end)
+        {
+            target -= end - start;
+        }
+        else if (target >= start)
+        {
+            target = start;
+        }
+        out->insn[j] = prog->insn[i];
+        out->target[j] = target;
+        j++;
+    }
+    out->size = j;
+    link_program(out);
+}
+
+/*
+ * Delta debugging (ddmin) over the instruction list of each thread in
+ * turn, the others kept as they are: repeatedly removes chunks of
+ * instructions while the programs still fail the same way. Removals that
+ * make a program invalid on the reference are rejected.
+ */
+static void
+minimize_program(Program *prog, const Fuzz_Config *config, int failure)
+{
+    Program *candidate = malloc(sizeof(Program) * config->num_threads);
+    int granularity, chunk, start, removed, t;
+
+    if (!candidate)
+    {
+        return;
+    }
+    memcpy(candidate, prog, sizeof(Program) * config->num_threads);
+
+    for (t = 0; t < config->num_threads; ++t)
+    {
+        granularity = 2;
+        while (prog[t].size >= 2)
+        {
+            chunk = (prog[t].size + granularity - 1) / granularity;
+            removed = FALSE;
+
+            for (start = 0; start < prog[t].size; start += chunk)
+            {
+                int end = (start + chunk < prog[t].size) ? start + chunk
+                                                         : prog[t].size;
+
+                remove_range(&candidate[t], &prog[t], start, end);
+                if (candidate[t].size > 0
+                    && run_program(candidate, config) == failure)
+                {
+                    prog[t] = candidate[t];
+                    removed = TRUE;
+                    break;
+                }
+            }
+
+            if (removed)
+            {
+                granularity = (granularity > 2) ? granularity - 1 : 2;
+            }
+            else if (granularity >= prog[t].size)
+            {
+                break;
+            }
+            else
+            {
+                granularity = (granularity * 2 < prog[t].size)
+                                  ? granularity * 2
+                                  : prog[t].size;
+            }
+        }
+        candidate[t] = prog[t];
+    }
+
+    free(candidate);
+}
+
+/*
+ * Writes the program of every thread, thread 0 to path, named
+ * fuzz_<seed><suffix>.asm, and thread t to fuzz_<seed>.t<t><suffix>.asm,
+ * which are listed as --smt options in smt
+ */
+static void
+write_programs(const Program *prog, uint64_t seed, const Fuzz_Config *config,
+               const char *suffix, char *path, size_t size, char *smt,
+               size_t smt_size)
+{
+    char thread_path[512];
+    int t;
+
+    snprintf(path, size, "%s/fuzz_%llu%s.asm", options.out_dir,
+             (unsigned long long)seed, suffix);
+    write_program(path, &prog[0]);
+
+    smt[0] = '\0';
+    for (t = 1; t < config->num_threads; ++t)
+    {
+        snprintf(thread_path, sizeof(thread_path), "%s/fuzz_%llu.t%d%s.asm",
+                 options.out_dir, (unsigned long long)seed, t, suffix);
+        write_program(thread_path, &prog[t]);
+        snprintf(smt + strlen(smt), smt_size - strlen(smt), "--smt %s ",
+                 thread_path);
+    }
+}
+
+static int
+total_size(const Program *prog, int num_threads)
+{
+    int t, size = 0;
+
+    for (t = 0; t < num_threads; ++t)
+    {
+        size += prog[t].size;
+    }
+    return size;
+}
+
+static void
+report_failure(Program *prog, uint64_t seed, const Fuzz_Config *config,
+               int failure)
+{
+    char path[512], flags[256], smt[1600];
+    int original_size = total_size(prog, config->num_threads);
+
+    write_programs(prog, seed, config, ".orig", path, sizeof(path), smt,
+                   sizeof(smt));
+
+    minimize_program(prog, config, failure);
+
+    write_programs(prog, seed, config, "", path, sizeof(path), smt,
+                   sizeof(smt));
+
+    snprintf(flags, sizeof(flags), "%s",
+             config->num_threads == 1 ? "--cosim " : "");
+    format_config(flags + strlen(flags), sizeof(flags) - strlen(flags),
+                  config);
+
+    pthread_mutex_lock(&fuzz_lock);
+    fprintf(stderr,
+            "APEX_FUZZ: seed %llu: %s, minimized %d -> %d instructions: %s\n",
+            (unsigned long long)seed, run_result_str[failure], original_size,
+            total_size(prog, config->num_threads), path);
+    /* The batch engine has no command line; batch_matches reruns it */
+    if (failure != RUN_BATCH)
+    {
+        fprintf(stderr, "APEX_FUZZ: reproduce with ./apex_sim %s %s%s\n",
+                failure == RUN_ENGINE ? "--ffwd 4000 --stats" : flags,
+                failure == RUN_ENGINE ? "" : smt, path);
+    }
+    pthread_mutex_unlock(&fuzz_lock);
+}
+
+static void *
+fuzz_worker(void *arg)
+{
+    Program *prog = malloc(sizeof(Program) * SMT_MAX_THREADS);
+    Fuzz_Config config;
+    int index, result, t;
+
+    (void)arg;
+    if (!prog)
+    {
+        return NULL;
+    }
+
+    while (TRUE)
+    {
+        pthread_mutex_lock(&fuzz_lock);
+        index = next_program++;
+        if (failures >= options.max_failures)
+        {
+            index = options.num_programs;
+        }
+        pthread_mutex_unlock(&fuzz_lock);
+
+        if (index >= options.num_programs)
+        {
+            break;
+        }
+
+        /* Thread 0 keeps the program of the seed without SMT */
+        gen_config(&config, options.seed + index);
+        for (t = 0; t < config.num_threads; ++t)
+        {
+            gen_program(&prog[t],
+                        (options.seed + index) ^ ((uint64_t)t << 40));
+        }
+        result = run_program(prog, &config);
+
+        pthread_mutex_lock(&fuzz_lock);
+        programs_run++;
+        programs_invalid += (result == RUN_INVALID);
+        failures += (result >= RUN_DIVERGE);
+        pthread_mutex_unlock(&fuzz_lock);
+
+        if (result >= RUN_DIVERGE)
+        {
+            report_failure(prog, options.seed + index, &config, result);
+        }
+    }
+
+    free(prog);
+    return NULL;
+}
+
+static void
+print_usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-j threads] [-n programs] [-s seed] [-f max_failures]"
+            " [-t smt_threads] [-o out_dir]\n",
+            prog);
+}
+
+int
+main(int argc, char const *argv[])
+{
+    pthread_t *threads;
+    int i;
+
+    options.num_threads = 4;
+    options.num_programs = 10000;
+    options.seed = 1;
+    options.max_failures = 1;
+    options.smt_threads = 1;
+    options.out_dir = ".";
+
+    for (i = 1; i < argc; ++i)
+    {
+        if (i + 1 >= argc)
+        {
+            print_usage(argv[0]);
+            exit(1);
+        }
+        if (strcmp(argv[i], "-j") == 0)
+        {
+            options.num_threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-n") == 0)
+        {
+            options.num_programs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-s") == 0)
+        {
+            options.seed = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-f") == 0)
+        {
+            options.max_failures = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-t") == 0)
+        {
+            options.smt_threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-o") == 0)
+        {
+            options.out_dir = argv[++i];
+        }
+        else
+        {
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (options.num_threads < 1)
+    {
+        options.num_threads = 1;
+    }
+    if (options.smt_threads < 1 || options.smt_threads > SMT_MAX_THREADS)
+    {
+        fprintf(stderr, "APEX_FUZZ: -t takes 1 to %d threads\n",
+                SMT_MAX_THREADS);
+        exit(1);
+    }
+
+    /* The simulator reports every run on stdout */
+    if (!freopen("/dev/null", "w", stdout))
+    {
+        fprintf(stderr, "APEX_FUZZ: Unable to silence stdout\n");
+    }
+
+    threads = calloc(options.num_threads, sizeof(pthread_t));
+    if (!threads)
+    {
+        exit(1);
+    }
+
+    for (i = 0; i < options.num_threads; ++i)
+    {
+        pthread_create(&threads[i], NULL, fuzz_worker, NULL);
+    }
+    for (i = 0; i < options.num_threads; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    fprintf(stderr,
+            "APEX_FUZZ: %d programs run (%d invalid), %d failures, seed %llu\n",
+            programs_run, programs_invalid, failures,
+            (unsigned long long)options.seed);
+    return failures ? 1 : 0;
+}
@@ -5,32 +5,683 @@
  * Copyright (c) 2020, Gaurav Kothari (gkothar1@binghamton.edu)
  * State University of New York at Binghamton
  */
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "apex_api.h"
 #include "apex_cpu.h"
+#include "apex_system.h"
+
+static void
+print_usage(const char *prog)
+{
+    fprintf(stderr, "APEX_Help: Usage %s [options] <input_file>\n", prog);
+    fprintf(stderr, "  --profile[=N]          Time each stage every Nth cycle "
+                    "(default %d) and report host speed\n",
+            PROF_DEFAULT_SAMPLE_PERIOD);
+    fprintf(stderr, "  --profile-trace <file> Write per-sample stage timings "
+                    "as CSV\n");
+    fprintf(stderr, "  --energy <file>        Estimate energy with the per-event "
+                    "energies in file\n");
+    fprintf(stderr, "  --energy-trace <file>  Write energy and power every "
+                    "interval to file as CSV\n");
+    fprintf(stderr, "  --energy-interval <N>  Cycles per row of the energy "
+                    "trace (default %d)\n",
+            ENERGY_DEFAULT_INTERVAL);
+    fprintf(stderr, "  --interval-csv <file>  Write IPC, stalls, branch and "
+                    "memory rates every interval as CSV\n");
+    fprintf(stderr, "  --bbv <file>           Write a basic-block vector every "
+                    "interval, for SimPoint\n");
+    fprintf(stderr, "  --interval <N>         Cycles per interval (default "
+                    "%d)\n",
+            INTERVAL_DEFAULT_LENGTH);
+    fprintf(stderr, "  --interval-insns <N>   Retired instructions per "
+                    "interval, instead of cycles\n");
+    fprintf(stderr, "  --max-cycles <N>       Stop the simulation after N "
+                    "cycles\n");
+    fprintf(stderr, "  --cosim                Check every retirement against "
+                    "the reference model\n");
+    fprintf(stderr, "  --mul-latency <N>      Cycles MUL spends in execute "
+                    "(default 1)\n");
+    fprintf(stderr, "  --mem-latency <N>      Cycles a load or store spends in "
+                    "memory (default 1)\n");
+    fprintf(stderr, "  --skip-idle            Jump over cycles in which no stage "
+                    "can make progress\n");
+    fprintf(stderr, "  --fuse                 Fuse CMP/CML/ADDL/SUBL with a "
+                    "following conditional branch\n");
+    fprintf(stderr, "  --loop-buffer          Replay short loops into fetch "
+                    "from a buffer, removing only taken-branch bubbles\n");
+    fprintf(stderr, "  --value-predict <P>    Predict load values for their "
+                    "dependents, P = last or stride\n");
+    fprintf(stderr, "  --load-bypass          Let loads read memory past a busy "
+                    "store to another address\n");
+    fprintf(stderr, "  --stats                Print stall statistics at the "
+                    "end of the run\n");
+    fprintf(stderr, "  --ffwd <N>             Execute the first N instructions "
+                    "functionally before simulating\n");
+    fprintf(stderr, "  --no-jit               Fast-forward on the block cache "
+                    "instead of the x86-64 translator\n");
+    fprintf(stderr, "  --mem-limit <N>        Stop on a load or store at word "
+                    "address N or above\n");
+    fprintf(stderr, "  --mem-init <file[@A]>  Load an image at word address A "
+                    "(default 0), hex text if file ends in .hex\n");
+    fprintf(stderr, "  --mem-dump <file> <A:B> Write words A to B-1 to "
+                    "file at the end of the run\n");
+    fprintf(stderr, "  --cores <N>            Run N cores sharing a coherent "
+                    "data memory (default 1)\n");
+    fprintf(stderr, "  --quantum <N>          Cycles the cores run between two "
+                    "synchronizations (default %d)\n",
+            SYSTEM_DEFAULT_QUANTUM);
+    fprintf(stderr, "  --serial               Run the cores on one host thread, "
+                    "deterministically\n");
+    fprintf(stderr, "  --smt <file>           Run file as another hardware "
+                    "thread on the pipeline (up to %d threads)\n",
+            SMT_MAX_THREADS);
+    fprintf(stderr, "  --fetch-policy <P>     Thread fetched each cycle, P = rr "
+                    "(round-robin, default) or icount\n");
+}
+
+/*
+ * Loads the image named by spec, "file" or "file@address", into data
+ * memory. Returns 0 or -1.
+ */
+static int
+load_memory_image(APEX_Memory *mem, const char *spec)
+{
+    char filename[1024];
+    const char *at = strrchr(spec, '@');
+    unsigned long address = 0;
+    size_t length = at ? (size_t)(at - spec) : strlen(spec);
+    char *end;
+    uint64_t start_ns;
+    int words, mapped_pages;
+
+    if (length >= sizeof(filename))
+    {
+        return -1;
+    }
+    memcpy(filename, spec, length);
+    filename[length] = '\0';
+
+    if (at)
+    {
+        address = strtoul(at + 1, &end, 0);
+        if (at[1] == '\0' || *end != '\0' || address > UINT32_MAX)
+        {
+            return -1;
+        }
+    }
+
+    start_ns = profile_now_ns();
+    mapped_pages = mem->mapped_pages;
+    words = memory_load_file(mem, filename, address);
+    if (words < 0)
+    {
+        return -1;
+    }
+    fprintf(stderr, "APEX_CPU: Loaded %d words of %s at address %lu in "
+                    "%.3f ms (%d pages mapped)\n",
+            words, filename, address, (profile_now_ns() - start_ns) / 1e6,
+            mem->mapped_pages - mapped_pages);
+    return 0;
+}
+
+/* Dump requested with --mem-dump */
+typedef struct Memory_Dump
+{
+    const char *filename;
+    uint32_t start;
+    uint32_t end;         /* First address after the range */
+} Memory_Dump;
+
+/* Parses "A:B", the words from A up to but not including B */
+static int
+parse_dump_range(Memory_Dump *dump, const char *range)
+{
+    unsigned long start, end;
+    char *p;
+
+    start = strtoul(range, &p, 0);
+    if (p == range || *p != ':')
+    {
+        return -1;
+    }
+    range = p + 1;
+    end = strtoul(range, &p, 0);
+    if (p == range || *p != '\0' || end <= start || end > UINT32_MAX)
+    {
+        return -1;
+    }
+    dump->start = start;
+    dump->end = end;
+    return 0;
+}
+
+static void
+dump_memory(const APEX_Memory *mem, const Memory_Dump *dump)
+{
+    if (!dump->filename)
+    {
+        return;
+    }
+    if (memory_dump_file(mem, dump->filename, dump->start,
+                         dump->end - dump->start))
+    {
+        fprintf(stderr, "APEX_Error: Unable to write %s\n", dump->filename);
+        return;
+    }
+    fprintf(stderr, "APEX_CPU: Dumped words %u to %u to %s\n", dump->start,
+            dump->end - 1, dump->filename);
+}
+
+/*
+ * Runs the first insns instructions of cpu functionally and reports the host
+ * speed. Returns TRUE if there is nothing left to simulate.
+ */
+static int
+fast_forward(APEX_CPU *cpu, int insns, int use_jit)
+{
+    APEX_Ffwd_Stats stats;
+    uint64_t start_ns = profile_now_ns();
+    uint64_t elapsed_ns;
+    int status;
+
+    status = APEX_cpu_fast_forward(cpu, insns, use_jit, &stats);
+    elapsed_ns = profile_now_ns() - start_ns;
+    if (status == APEX_RUN_STOPPED)
+    {
+        fprintf(stderr, "APEX_Error: Unable to fast-forward\n");
+        return TRUE;
+    }
+
+    printf("APEX_CPU: Fast-forwarded %llu instructions in %.1f ms "
+           "(%.1f MIPS, %s)\n",
+           (unsigned long long)stats.insns, elapsed_ns / 1e6,
+           elapsed_ns ? stats.insns * 1e3 / elapsed_ns : 0.0,
+           stats.translated ? "translated" : "block cache");
+    if (cpu->print_stats && stats.translated)
+    {
+        printf("APEX_CPU: Translator: blocks = %llu (%.1f instructions "
+               "each), exits chained = %llu, dispatches = %llu, "
+               "interpreted = %llu, flushes = %llu\n",
+               (unsigned long long)stats.jit.blocks,
+               stats.jit.blocks
+                   ? (double)stats.jit.block_insns / stats.jit.blocks : 0.0,
+               (unsigned long long)stats.jit.chained,
+               (unsigned long long)stats.jit.dispatches,
+               (unsigned long long)stats.jit.interpreted,
+               (unsigned long long)stats.jit.flushes);
+    }
+    else if (cpu->print_stats)
+    {
+        printf("APEX_CPU: Block cache: blocks = %llu (%.1f instructions "
+               "each), successor links = %llu, table lookups = %llu, "
+               "interpreted = %llu\n",
+               (unsigned long long)stats.bb.blocks,
+               stats.bb.blocks
+                   ? (double)stats.bb.block_insns / stats.bb.blocks : 0.0,
+               (unsigned long long)stats.bb.links,
+               (unsigned long long)stats.bb.lookups,
+               (unsigned long long)stats.bb.interpreted);
+    }
+
+    if (status == APEX_RUN_HALT)
+    {
+        printf("APEX_CPU: HALT reached while fast-forwarding\n");
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* Runs the program loaded into cpu on a multi-core system */
+static void
+run_system(const APEX_CPU *cpu, int num_cores, int quantum, int serial,
+           int mem_latency, const Memory_Dump *dump)
+{
+    APEX_System *system;
+    int i;
+
+    system = system_create(cpu->code_memory, cpu->code_memory_size, num_cores);
+    if (!system)
+    {
+        fprintf(stderr, "APEX_Error: Unable to create %d cores\n", num_cores);
+        exit(1);
+    }
+
+    /* The cores share a copy of the memory image and limit */
+    memory_free(&system->memory);
+    if (memory_clone(&system->memory, &cpu->data_memory))
+    {
+        fprintf(stderr, "APEX_Error: Unable to copy data memory\n");
+        exit(1);
+    }
+
+    system->quantum = quantum;
+    system->max_cycles = cpu->max_cycles;
+    if (mem_latency)
+    {
+        system->miss_latency = mem_latency;
+    }
+    for (i = 0; i < num_cores; ++i)
+    {
+        system->cores[i]->mul_latency = cpu->mul_latency;
+        system->cores[i]->skip_idle = cpu->skip_idle;
+        system->cores[i]->fusion = cpu->fusion;
+        system->cores[i]->loop_buffer = cpu->loop_buffer;
+        system->cores[i]->value_predict = cpu->value_predict;
+        system->cores[i]->load_bypass = cpu->load_bypass;
+    }
+
+    system_run(system, serial);
+    system_report(system);
+    dump_memory(&system->memory, dump);
+    system_destroy(system);
+}
 
 int
 main(int argc, char const *argv[])
 {
     APEX_CPU *cpu;
+    const char *input_file = NULL;
+    const char *profile_trace = NULL;
+    int profile = FALSE;
+    int profile_period = PROF_DEFAULT_SAMPLE_PERIOD;
+    const char *energy_model = NULL;
+    const char *energy_trace = NULL;
+    int energy_interval = ENERGY_DEFAULT_INTERVAL;
+    const char *interval_csv = NULL;
+    const char *bbv = NULL;
+    int interval = INTERVAL_DEFAULT_LENGTH;
+    int interval_insns = FALSE;
+    int max_cycles = 0;
+    int cosim = FALSE;
+    int mul_latency = 1;
+    int mem_latency = 0;      /* 0 until given */
+    int skip_idle = FALSE;
+    int fusion = FALSE;
+    int loop_buffer = FALSE;
+    int value_predict = VPRED_NONE;
+    int load_bypass = FALSE;
+    int print_stats = FALSE;
+    int ffwd = 0;
+    int use_jit = TRUE;
+    int num_cores = 1;
+    const char *smt_files[SMT_MAX_THREADS];
+    int num_threads = 1;
+    int fetch_policy = SMT_FETCH_RR;
+    int quantum = SYSTEM_DEFAULT_QUANTUM;
+    int serial = FALSE;
+    unsigned long mem_limit = 0;
+    const char *mem_init = NULL;
+    Memory_Dump mem_dump = {NULL, 0, 0};
+    char *end;
+    int i;
 
+#ifdef APEX_CONFIG_NAME
+    fprintf(stderr, "APEX CPU Pipeline Simulator v%0.1lf (configuration %s)\n",
+            VERSION, APEX_CONFIG_NAME);
+#else
     fprintf(stderr, "APEX CPU Pipeline Simulator v%0.1lf\n", VERSION);
+#endif
+
+    for (i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--profile") == 0)
+        {
+            profile = TRUE;
+        }
+        else if (strncmp(argv[i], "--profile=", 10) == 0)
+        {
+            profile = TRUE;
+            profile_period = atoi(argv[i] + 10);
+        }
+        else if (strcmp(argv[i], "--profile-trace") == 0 && i + 1 < argc)
+        {
+            profile = TRUE;
+            profile_trace = argv[++i];
+        }
+        else if (strcmp(argv[i], "--energy") == 0 && i + 1 < argc)
+        {
+            energy_model = argv[++i];
+        }
+        else if (strcmp(argv[i], "--energy-trace") == 0 && i + 1 < argc)
+        {
+            energy_trace = argv[++i];
+        }
+        else if (strcmp(argv[i], "--energy-interval") == 0 && i + 1 < argc)
+        {
+            energy_interval = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--interval-csv") == 0 && i + 1 < argc)
+        {
+            interval_csv = argv[++i];
+        }
+        else if (strcmp(argv[i], "--bbv") == 0 && i + 1 < argc)
+        {
+            bbv = argv[++i];
+        }
+        else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc)
+        {
+            interval = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--interval-insns") == 0 && i + 1 < argc)
+        {
+            interval = atoi(argv[++i]);
+            interval_insns = TRUE;
+        }
+        else if (strcmp(argv[i], "--max-cycles") == 0 && i + 1 < argc)
+        {
+            max_cycles = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--cosim") == 0)
+        {
+            cosim = TRUE;
+        }
+        else if (strcmp(argv[i], "--mul-latency") == 0 && i + 1 < argc)
+        {
+            mul_latency = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--mem-latency") == 0 && i + 1 < argc)
+        {
+            mem_latency = atoi(argv[++i]);
+            if (mem_latency < 1)
+            {
+                print_usage(argv[0]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--skip-idle") == 0)
+        {
+            skip_idle = TRUE;
+        }
+        else if (strcmp(argv[i], "--fuse") == 0)
+        {
+            fusion = TRUE;
+        }
+        else if (strcmp(argv[i], "--loop-buffer") == 0)
+        {
+            loop_buffer = TRUE;
+        }
+        else if (strcmp(argv[i], "--value-predict") == 0 && i + 1 < argc)
+        {
+            ++i;
+            if (strcmp(argv[i], "last") == 0)
+            {
+                value_predict = VPRED_LAST;
+            }
+            else if (strcmp(argv[i], "stride") == 0)
+            {
+                value_predict = VPRED_STRIDE;
+            }
+            else
+            {
+                print_usage(argv[0]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--load-bypass") == 0)
+        {
+            load_bypass = TRUE;
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+            print_stats = TRUE;
+        }
+        else if (strcmp(argv[i], "--ffwd") == 0 && i + 1 < argc)
+        {
+            ffwd = atoi(argv[++i]);
+            if (ffwd < 1)
+            {
+                print_usage(argv[0]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--no-jit") == 0)
+        {
+            use_jit = FALSE;
+        }
+        else if (strcmp(argv[i], "--mem-limit") == 0 && i + 1 < argc)
+        {
+            mem_limit = strtoul(argv[++i], &end, 0);
+            if (*end != '\0' || mem_limit == 0 || mem_limit > UINT32_MAX)
+            {
+                print_usage(argv[0]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--mem-init") == 0 && i + 1 < argc)
+        {
+            mem_init = argv[++i];
+        }
+        else if (strcmp(argv[i], "--mem-dump") == 0 && i + 2 < argc)
+        {
+            mem_dump.filename = argv[++i];
+            if (parse_dump_range(&mem_dump, argv[++i]))
+            {
+                print_usage(argv[0]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--cores") == 0 && i + 1 < argc)
+        {
+            num_cores = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--quantum") == 0 && i + 1 < argc)
+        {
+            quantum = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--serial") == 0)
+        {
+            serial = TRUE;
+        }
+        else if (strcmp(argv[i], "--smt") == 0 && i + 1 < argc
+                 && num_threads < SMT_MAX_THREADS)
+        {
+            smt_files[num_threads++] = argv[++i];
+        }
+        else if (strcmp(argv[i], "--fetch-policy") == 0 && i + 1 < argc)
+        {
+            ++i;
+            if (strcmp(argv[i], "rr") == 0)
+            {
+                fetch_policy = SMT_FETCH_RR;
+            }
+            else if (strcmp(argv[i], "icount") == 0)
+            {
+                fetch_policy = SMT_FETCH_ICOUNT;
+            }
+            else
+            {
+                print_usage(argv[0]);
+                exit(1);
+            }
+        }
+        else if (argv[i][0] != '-' && !input_file)
+        {
+            input_file = argv[i];
+        }
+        else
+        {
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    /* Settings fixed at build time take the place of their options */
+    if (CONFIG_MUL_LATENCY >= 0)
+    {
+        mul_latency = CONFIG_MUL_LATENCY;
+    }
+    if (CONFIG_MEM_LATENCY >= 0)
+    {
+        mem_latency = CONFIG_MEM_LATENCY;
+    }
+    if (CONFIG_SKIP_IDLE >= 0)
+    {
+        skip_idle = CONFIG_SKIP_IDLE;
+    }
+    if (CONFIG_FUSION >= 0)
+    {
+        fusion = CONFIG_FUSION;
+    }
+    if (CONFIG_LOOP_BUFFER >= 0)
+    {
+        loop_buffer = CONFIG_LOOP_BUFFER;
+    }
+    if (CONFIG_VALUE_PREDICT >= 0)
+    {
+        value_predict = CONFIG_VALUE_PREDICT;
+    }
+    if (CONFIG_LOAD_BYPASS >= 0)
+    {
+        load_bypass = CONFIG_LOAD_BYPASS;
+    }
+
+    if (!input_file || mul_latency < 1 || quantum < 1
+        || num_cores < 1 || num_cores > SYSTEM_MAX_CORES)
+    {
+        print_usage(argv[0]);
+        exit(1);
+    }
+
+    if (num_cores > 1 && cosim)
+    {
+        fprintf(stderr, "APEX_Error: --cosim needs a single core\n");
+        exit(1);
+    }
+
+    if (num_cores > 1 && ffwd)
+    {
+        fprintf(stderr, "APEX_Error: --ffwd needs a single core\n");
+        exit(1);
+    }
+
+    if (num_cores > 1 && energy_model)
+    {
+        fprintf(stderr, "APEX_Error: --energy needs a single core\n");
+        exit(1);
+    }
+
+    if (energy_trace && !energy_model)
+    {
+        fprintf(stderr, "APEX_Error: --energy-trace needs --energy\n");
+        exit(1);
+    }
+
+    if (num_cores > 1 && (interval_csv || bbv))
+    {
+        fprintf(stderr, "APEX_Error: --interval-csv and --bbv need a "
+                        "single core\n");
+        exit(1);
+    }
 
-    if (argc != 2)
+    /* Basic blocks are followed through the retirements of one thread */
+    if (num_threads > 1 && bbv)
     {
-        fprintf(stderr, "APEX_Help: Usage %s <input_file>\n", argv[0]);
+        fprintf(stderr, "APEX_Error: --bbv needs a single thread\n");
         exit(1);
     }
 
-    cpu = APEX_cpu_init(argv[1]);
+    /* The reference model, the functional engines and the loop buffer all
+     * follow a single thread */
+    if (num_threads > 1 && (num_cores > 1 || cosim || ffwd || loop_buffer))
+    {
+        fprintf(stderr, "APEX_Error: --smt does not combine with --cores, "
+                        "--cosim, --ffwd or --loop-buffer\n");
+        exit(1);
+    }
+
+    cpu = APEX_cpu_init(input_file);
     if (!cpu)
     {
         fprintf(stderr, "APEX_Error: Unable to initialize CPU\n");
         exit(1);
     }
 
+    cpu->max_cycles = max_cycles;
+    cpu->mul_latency = mul_latency;
+    cpu->mem_latency = mem_latency ? mem_latency : 1;
+    cpu->skip_idle = skip_idle;
+    cpu->fusion = fusion;
+    cpu->loop_buffer = loop_buffer;
+    cpu->value_predict = value_predict;
+    cpu->load_bypass = load_bypass;
+    cpu->print_stats = print_stats;
+    cpu->data_memory.limit = mem_limit;
+
+    if (mem_init && load_memory_image(&cpu->data_memory, mem_init))
+    {
+        fprintf(stderr, "APEX_Error: Unable to load memory image %s\n",
+                mem_init);
+        APEX_cpu_stop(cpu);
+        exit(1);
+    }
+
+    cpu->fetch_policy = fetch_policy;
+    for (i = 1; i < num_threads; ++i)
+    {
+        if (APEX_cpu_add_thread(cpu, smt_files[i]))
+        {
+            fprintf(stderr, "APEX_Error: Unable to load thread %d from %s\n",
+                    i, smt_files[i]);
+            APEX_cpu_stop(cpu);
+            exit(1);
+        }
+    }
+
+    /* In multi-core mode, --mem-latency sets the L1 miss latency instead */
+    if (num_cores > 1)
+    {
+        run_system(cpu, num_cores, quantum, serial, mem_latency, &mem_dump);
+        APEX_cpu_stop(cpu);
+        return 0;
+    }
+
+    if (ffwd && fast_forward(cpu, ffwd, use_jit))
+    {
+        dump_memory(&cpu->data_memory, &mem_dump);
+        APEX_cpu_stop(cpu);
+        return 0;
+    }
+
+    if (cosim && !(cpu->cosim = cosim_create(cpu)))
+    {
+        fprintf(stderr, "APEX_Error: Unable to create co-simulation checker\n");
+        APEX_cpu_stop(cpu);
+        exit(1);
+    }
+
+    if (profile && profile_init(&cpu->profile, profile_period, profile_trace))
+    {
+        fprintf(stderr, "APEX_Error: Unable to open %s\n", profile_trace);
+        APEX_cpu_stop(cpu);
+        exit(1);
+    }
+
+    if (energy_model
+        && energy_init(&cpu->energy, energy_model, energy_interval,
+                       energy_trace))
+    {
+        fprintf(stderr, "APEX_Error: Unable to set up the energy model from "
+                        "%s\n", energy_model);
+        APEX_cpu_stop(cpu);
+        exit(1);
+    }
+
+    if ((interval_csv || bbv)
+        && interval_init(cpu, interval, interval_insns, interval_csv, bbv))
+    {
+        fprintf(stderr, "APEX_Error: Unable to open %s\n",
+                interval_csv ? interval_csv : bbv);
+        APEX_cpu_stop(cpu);
+        exit(1);
+    }
+
     APEX_cpu_run(cpu);
+    dump_memory(&cpu->data_memory, &mem_dump);
+
     APEX_cpu_stop(cpu);
     return 0;
-}
\ No newline at end of file
+}